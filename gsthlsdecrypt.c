@@ -0,0 +1,146 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * gsthlsdecrypt.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+
+#include "gsthlsdecrypt.h"
+
+typedef struct {
+  GMutex lock;
+  GCond cond;
+  guint pending;
+} GstHlsDecryptBatch;
+
+typedef struct {
+  GstHlsDecryptBatch *batch;
+  const guint8 *key;
+  guint8 iv[16];
+  guint8 *data;
+  gsize size;
+} GstHlsDecryptSlice;
+
+static void
+_decrypt_aes128_cbc (const guint8 * key, const guint8 * iv, guint8 * data,
+    gsize size)
+{
+  EVP_CIPHER_CTX ctx;
+  gint outsize = size;
+
+  EVP_CIPHER_CTX_init (&ctx);
+  EVP_CipherInit_ex (&ctx, EVP_aes_128_cbc (), NULL, key, iv, AES_DECRYPT);
+  EVP_CIPHER_CTX_set_padding (&ctx, 0);
+  EVP_CipherUpdate (&ctx, data, &outsize, data, size);
+  EVP_CIPHER_CTX_cleanup (&ctx);
+}
+
+static void
+_decrypt_slice_func (GstHlsDecryptSlice * slice, gpointer unused)
+{
+  GstHlsDecryptBatch *batch = slice->batch;
+
+  _decrypt_aes128_cbc (slice->key, slice->iv, slice->data, slice->size);
+
+  g_mutex_lock (&batch->lock);
+  if (--batch->pending == 0)
+    g_cond_signal (&batch->cond);
+  g_mutex_unlock (&batch->lock);
+}
+
+static GThreadPool *
+_get_decrypt_pool (void)
+{
+  static GThreadPool *pool = NULL;
+  static gsize init = 0;
+
+  if (g_once_init_enter (&init)) {
+    pool = g_thread_pool_new ((GFunc) _decrypt_slice_func, NULL,
+        g_get_num_processors (), FALSE, NULL);
+    g_once_init_leave (&init, 1);
+  }
+
+  return pool;
+}
+
+/* a CBC block only depends on the previous ciphertext block, so slices of
+ * the input can be decrypted in parallel, each using the last block of the
+ * previous slice as IV */
+void
+gst_hls_decrypt_aes128_cbc_slices (const guint8 * key, const guint8 * iv,
+    guint8 * data, gsize size, guint n_slices)
+{
+  GstHlsDecryptBatch batch;
+  GstHlsDecryptSlice *slices;
+  gsize slice_size;
+  gsize offset;
+  guint i;
+
+  g_return_if_fail (size % 16 == 0);
+
+  n_slices = CLAMP (n_slices, 1, MAX (size / 16, 1));
+  slice_size = (size / n_slices) & ~(gsize) 15;
+
+  slices = g_newa (GstHlsDecryptSlice, n_slices);
+
+  g_mutex_init (&batch.lock);
+  g_cond_init (&batch.cond);
+  batch.pending = n_slices - 1;
+
+  /* decryption is done in place, copy the IVs before starting */
+  for (i = 0, offset = 0; i < n_slices; i++, offset += slice_size) {
+    slices[i].batch = &batch;
+    slices[i].key = key;
+    memcpy (slices[i].iv, offset == 0 ? iv : data + offset - 16, 16);
+    slices[i].data = data + offset;
+    slices[i].size = i == n_slices - 1 ? size - offset : slice_size;
+  }
+
+  for (i = 1; i < n_slices; i++)
+    g_thread_pool_push (_get_decrypt_pool (), &slices[i], NULL);
+
+  _decrypt_aes128_cbc (slices[0].key, slices[0].iv, slices[0].data,
+      slices[0].size);
+
+  g_mutex_lock (&batch.lock);
+  while (batch.pending > 0)
+    g_cond_wait (&batch.cond, &batch.lock);
+  g_mutex_unlock (&batch.lock);
+
+  g_mutex_clear (&batch.lock);
+  g_cond_clear (&batch.cond);
+}
+
+gboolean
+gst_hls_decrypt_aes128_cbc_parallel (const guint8 * key, const guint8 * iv,
+    guint8 * data, gsize size)
+{
+  guint n_slices;
+
+  n_slices = MIN (g_get_num_processors (),
+      size / GST_HLS_DECRYPT_SLICE_MIN_SIZE);
+  if (n_slices < 2)
+    return FALSE;
+
+  gst_hls_decrypt_aes128_cbc_slices (key, iv, data, size, n_slices);
+
+  return TRUE;
+}
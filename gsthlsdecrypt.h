@@ -0,0 +1,45 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * gsthlsdecrypt.h
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef GSTHLSDECRYPT_H_
+# define GSTHLSDECRYPT_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* smallest amount of data worth decrypting on another core */
+#define GST_HLS_DECRYPT_SLICE_MIN_SIZE (64 * 1024)
+
+/* decrypt AES-128 CBC data in place, split in slices decrypted on several
+ * cores. The IV is the ciphertext block preceding the data, and the size a
+ * multiple of 16 bytes. FALSE is returned, with the data untouched, when it
+ * is too small to be split. */
+gboolean gst_hls_decrypt_aes128_cbc_parallel (const guint8 * key,
+    const guint8 * iv, guint8 * data, gsize size);
+
+/* same with the given number of slices, for the tests and benchmarks */
+void gst_hls_decrypt_aes128_cbc_slices (const guint8 * key,
+    const guint8 * iv, guint8 * data, gsize size, guint n_slices);
+
+G_END_DECLS
+
+#endif /* GSTHLSDECRYPT_H_ */
@@ -29,6 +29,8 @@
 #include <openssl/evp.h>
 
 #include "gsturidownloader.h"
+#include "gsthlsdecrypt.h"
+#include "gsthlssampleaes.h"
 #include "gsthlsdemux.h"
 
 static GstStaticPadTemplate video_template =
@@ -55,16 +57,107 @@ GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_ALWAYS,
     GST_STATIC_CAPS ("application/x-hls"));
 
+#define DEFAULT_PREFETCH_SEGMENTS 1
+#define DEFAULT_ABR_MODE GST_HLS_DEMUX_ABR_MODE_THROUGHPUT
+#define DEFAULT_MIN_BUFFERING_TIME 0
+#define DEFAULT_MAX_BUFFERING_TIME (10 * GST_SECOND)
+#define DEFAULT_DECRYPT_THREAD FALSE
+
+/* queue limit used while buffer durations are unknown */
+#define QUEUE_MAX_BYTES (256 * 1024)
+
+/* encrypted data waiting for the decryption thread */
+#define DECRYPT_QUEUE_MAX_BYTES (256 * 1024)
+
+/* read-only encrypted data is gathered in buffers of that size before being
+ * decrypted, large enough to be split over several cores */
+#define DECRYPT_POOL_BUFFER_SIZE (8 * GST_HLS_DECRYPT_SLICE_MIN_SIZE)
+
+/* percentage of the measured bandwidth a stream is allowed to use */
+#define BANDWIDTH_USAGE 80
+
+/* downloaded keys are reused for that long, oldest are evicted first */
+#define KEY_CACHE_TTL (5 * 60 * G_USEC_PER_SEC)
+#define KEY_CACHE_SIZE 16
+
+/* number of upcoming segments checked for a key rotation */
+#define KEY_LOOKAHEAD_SEGMENTS 3
+
+/* queue capacity needed by the buffer-based ABR, in target durations. With
+ * less than that, the buffer level can not tell the streams apart */
+#define ABR_BUFFER_MIN_SEGMENTS 5
+
+/* time a pad stays unlinked before its downloads are suspended */
+#define UNLINKED_SUSPEND_TIME (2 * G_USEC_PER_SEC)
+
 enum
 {
   PROP_0,
+  PROP_PREFETCH_SEGMENTS,
+  PROP_ABR_MODE,
+  PROP_MIN_BUFFERING_TIME,
+  PROP_MAX_BUFFERING_TIME,
+  PROP_DECRYPT_THREAD,
   PROP_LAST
 };
 
 GST_DEBUG_CATEGORY_STATIC (gst_hls_demux_debug);
 #define GST_CAT_DEFAULT gst_hls_demux_debug
 
+#define GST_TYPE_HLS_DEMUX_ABR_MODE (gst_hls_demux_abr_mode_get_type ())
+static GType
+gst_hls_demux_abr_mode_get_type (void)
+{
+  static GType type = 0;
+  static const GEnumValue values[] = {
+    {GST_HLS_DEMUX_ABR_MODE_THROUGHPUT,
+        "Select stream from the measured download rate", "throughput"},
+    {GST_HLS_DEMUX_ABR_MODE_BUFFER,
+        "Select stream from the track queue level", "buffer"},
+    {0, NULL, NULL}
+  };
+
+  if (!type)
+    type = g_enum_register_static ("GstHlsDemuxAbrMode", values);
+
+  return type;
+}
+
 typedef struct _GstHlsTrack GstHlsTrack;
+typedef struct _GstHlsPrefetch GstHlsPrefetch;
+typedef struct _GstHlsKey GstHlsKey;
+
+struct _GstHlsKey {
+  guint id;
+  guint8 data[16];
+  gint64 fetch_ts;
+
+  /* set while the key is downloaded */
+  gboolean pending;
+};
+
+typedef struct {
+  GstHlsDemux *demux;
+  gchar *uri;
+  guint id;
+} GstHlsKeyFetch;
+
+struct _GstHlsPrefetch {
+  GstHlsTrack *track;
+  GstUriDownloader *downloader;
+
+  /* segment being fetched, sequence is -1 when the slot is free */
+  gint sequence;
+  gchar *uri;
+  gint64 range_start;
+  gint64 range_end;
+
+  /* downloaded buffers not yet handed to the track, in order */
+  GQueue buffers;
+  gboolean done;
+  gboolean success;
+  gboolean cancelled;
+};
 
 struct _GstHlsTrack {
   GstHlsDemux *demux;
@@ -77,23 +170,125 @@ struct _GstHlsTrack {
   GstDataQueue *queue;
   gboolean exposed;
 
+  /* stream selection, tracks not selected or with an unlinked pad do not
+   * download anything */
+  GstStream *gst_stream;
+  gboolean selected;
+  gboolean unlinked;
+  gint64 not_linked_time;
+  GstClockTime segment_start;
+  GstClockTime suspend_position;
+  GstClockTime resume_position;
+  gboolean resumed;
+
+  /* serializes the suspend and resume of the downloads, which join the
+   * track task and must not be done with the select lock */
+  GMutex suspend_lock;
+  gboolean downloading;
+
   /* segment downloader */
   GstUriDownloader *downloader;
   GRecMutex download_lock;
 
+  /* background fetch of upcoming keys */
+  GstUriDownloader *key_downloader;
+
+  /* interrupts the wait for a key fetched by another track, protected by
+   * the demuxer keys lock */
+  gboolean keys_flushing;
+
+  /* interrupts the wait for the early fetch of the playlist, protected by
+   * the demuxer early lock */
+  gboolean early_flushing;
+
   /* downloader context, set before fetching a segment */
   gint sequence;
+  guint part;
   guint64 length;
   gboolean discont;
   GstClockTime next_pts;
   GstM3U8Key *key;
-
+  gboolean key_chained;
+
+  /* playlist reload scheduling */
+  GMutex reload_lock;
+  GCond reload_cond;
+  gboolean reload_cancelled;
+  GstClockTime reload_ts;
+  gboolean reload_unchanged;
+
+  /* last preload hint requested, a hint is only tried once */
+  gchar *hint_uri;
+  gint64 hint_offset;
+  gboolean hint_done;
+
+  /* download rate estimation, in bits per second */
+  guint64 segment_bytes;
+  gint64 blocked_time;
+  gint64 bitrate;
+
+  /* queue capacity required by the buffer-based ABR, 0 if not used */
+  GstClockTime abr_buffer_time;
+
+  /* buffer duration estimation, from the segment duration and size */
+  GstClockTime segment_duration;
+  guint64 segment_size;
+  GstClockTime segment_time;
+  guint64 content_rate;
+
+  /* prebuffering after start and seek */
+  GMutex buffering_lock;
+  GCond buffering_cond;
+  gboolean buffering;
+  gboolean flushing;
+
+  /* segment prefetch slots, only used with a prefetch depth above 1 */
+  GstHlsPrefetch *prefetch;
+  guint prefetch_depth;
+  GMutex prefetch_lock;
+  GCond prefetch_cond;
+
+  /* the prefetch downloads share the link, so the download rate is
+   * measured over the time at least one of them is running */
+  guint prefetch_active;
+  gint64 prefetch_busy_since;
+  gint64 prefetch_busy_time;
+  guint64 prefetch_bytes;
+  gint64 prefetch_measured_time;
+  guint64 prefetch_measured_bytes;
+
+  /* decryption worker, only used when decrypt-thread is enabled */
+  GThread *decrypt_thread;
+  GMutex decrypt_lock;
+  GCond decrypt_cond;
+  GQueue decrypt_queue;
+  gsize decrypt_bytes;
+  gboolean decrypting;
+  gboolean decrypt_flushing;
+  gboolean decrypt_stop;
+  GstFlowReturn decrypt_ret;
+
+  /* trailing encrypted bytes, not yet decrypted in aes_pending */
   guint8 aes_128_data[16];
   guint aes_128_data_size;
+  GstBuffer *aes_pending;
+  GstBufferPool *aes_pool;
+  GstBuffer *aes_copy;
+  gsize aes_copy_size;
+  guint8 aes_key[16];
+  guint8 aes_iv[16];
   EVP_CIPHER_CTX aes_ctx;
+
+  /* SAMPLE-AES segments are decrypted once complete */
+  GstHlsSampleAes *sample_aes;
+  GQueue sample_aes_buffers;
 };
 
 static void gst_hls_track_free (GstHlsTrack * track);
+static void gst_hls_track_suspend (GstHlsTrack * track);
+static void gst_hls_track_resume (GstHlsTrack * track, GstClockTime position);
+static void gst_hls_track_sync_downloading (GstHlsTrack * track);
+static void gst_hls_track_drop_key (GstHlsTrack * track);
 
 /* GObject */
 static void gst_hls_demux_finalize (GObject * object);
@@ -105,6 +300,8 @@ static void gst_hls_demux_get_property (GObject * object, guint prop_id,
 /* GstElement */
 static GstStateChangeReturn gst_hls_demux_change_state (GstElement * element,
     GstStateChange transition);
+static gboolean gst_hls_demux_send_event (GstElement * element,
+    GstEvent * event);
 
 /* sinkpad */
 static GstFlowReturn gst_hls_demux_chain (GstPad * pad, GstObject * parent,
@@ -112,6 +309,15 @@ static GstFlowReturn gst_hls_demux_chain (GstPad * pad, GstObject * parent,
 static gboolean gst_hls_demux_sink_event (GstPad * pad, GstObject * parent,
     GstEvent * event);
 
+static gboolean gst_hls_demux_wait_early_playlist (GstHlsDemux * demux,
+    GstHlsTrack * track);
+static void gst_hls_demux_stop_early_playlist (GstHlsDemux * demux,
+    GstM3U8Stream * selected);
+static void gst_hls_demux_post_collection (GstHlsDemux * demux);
+static gboolean gst_hls_demux_select_streams (GstHlsDemux * demux,
+    GstEvent * event);
+static GstClockTime gst_hls_demux_get_download_position (GstHlsDemux * demux);
+
 #define gst_hls_demux_parent_class parent_class
 G_DEFINE_TYPE (GstHlsDemux, gst_hls_demux, GST_TYPE_BIN);
 
@@ -133,6 +339,37 @@ gst_hls_demux_class_init (GstHlsDemuxClass * klass)
 
   element_class->change_state =
       GST_DEBUG_FUNCPTR (gst_hls_demux_change_state);
+  element_class->send_event = GST_DEBUG_FUNCPTR (gst_hls_demux_send_event);
+
+  g_object_class_install_property (gobject_class, PROP_PREFETCH_SEGMENTS,
+      g_param_spec_uint ("prefetch-segments", "Prefetch segments",
+          "Number of segments downloaded in parallel for each track",
+          1, 16, DEFAULT_PREFETCH_SEGMENTS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ABR_MODE,
+      g_param_spec_enum ("abr-mode", "ABR mode",
+          "Method used to select the stream of the main rendition",
+          GST_TYPE_HLS_DEMUX_ABR_MODE, DEFAULT_ABR_MODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MIN_BUFFERING_TIME,
+      g_param_spec_uint64 ("min-buffering-time", "Min buffering time",
+          "Amount of data to queue in each track before pushing it after "
+          "start or seek, in nanoseconds",
+          0, G_MAXUINT64, DEFAULT_MIN_BUFFERING_TIME,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_BUFFERING_TIME,
+      g_param_spec_uint64 ("max-buffering-time", "Max buffering time",
+          "Maximum amount of data queued in each track, in nanoseconds",
+          0, G_MAXUINT64, DEFAULT_MAX_BUFFERING_TIME,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_DECRYPT_THREAD,
+      g_param_spec_boolean ("decrypt-thread", "Decrypt thread",
+          "Decrypt segments in a separate thread, while downloading",
+          DEFAULT_DECRYPT_THREAD, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
   gst_element_class_add_pad_template (element_class,
       gst_static_pad_template_get (&video_template));
@@ -169,6 +406,21 @@ gst_hls_demux_init (GstHlsDemux * demux)
   demux->last_stream_id = 0;
   demux->group_id = 0;
   demux->have_group_id = FALSE;
+  demux->prefetch_segments = DEFAULT_PREFETCH_SEGMENTS;
+  demux->abr_mode = DEFAULT_ABR_MODE;
+  demux->min_buffering_time = DEFAULT_MIN_BUFFERING_TIME;
+  demux->max_buffering_time = DEFAULT_MAX_BUFFERING_TIME;
+  demux->decrypt_thread = DEFAULT_DECRYPT_THREAD;
+
+  demux->keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, g_free);
+  g_mutex_init (&demux->keys_lock);
+  g_cond_init (&demux->keys_cond);
+
+  g_mutex_init (&demux->early_lock);
+  g_cond_init (&demux->early_cond);
+
+  g_mutex_init (&demux->select_lock);
 }
 
 static void
@@ -185,6 +437,17 @@ gst_hls_demux_finalize (GObject * object)
   if (demux->client)
     gst_m3u8_client_free (demux->client);
 
+  g_hash_table_unref (demux->keys);
+  g_mutex_clear (&demux->keys_lock);
+  g_cond_clear (&demux->keys_cond);
+
+  g_mutex_clear (&demux->early_lock);
+  g_cond_clear (&demux->early_cond);
+
+  if (demux->collection)
+    gst_object_unref (demux->collection);
+  g_mutex_clear (&demux->select_lock);
+
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
@@ -192,7 +455,29 @@ static void
 gst_hls_demux_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
 {
+  GstHlsDemux *demux = GST_HLS_DEMUX (object);
+
   switch (prop_id) {
+    case PROP_PREFETCH_SEGMENTS:
+      demux->prefetch_segments = g_value_get_uint (value);
+      break;
+
+    case PROP_ABR_MODE:
+      demux->abr_mode = g_value_get_enum (value);
+      break;
+
+    case PROP_MIN_BUFFERING_TIME:
+      demux->min_buffering_time = g_value_get_uint64 (value);
+      break;
+
+    case PROP_MAX_BUFFERING_TIME:
+      demux->max_buffering_time = g_value_get_uint64 (value);
+      break;
+
+    case PROP_DECRYPT_THREAD:
+      demux->decrypt_thread = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -203,23 +488,91 @@ static void
 gst_hls_demux_get_property (GObject * object, guint prop_id, GValue * value,
     GParamSpec * pspec)
 {
+  GstHlsDemux *demux = GST_HLS_DEMUX (object);
+
   switch (prop_id) {
+    case PROP_PREFETCH_SEGMENTS:
+      g_value_set_uint (value, demux->prefetch_segments);
+      break;
+
+    case PROP_ABR_MODE:
+      g_value_set_enum (value, demux->abr_mode);
+      break;
+
+    case PROP_MIN_BUFFERING_TIME:
+      g_value_set_uint64 (value, demux->min_buffering_time);
+      break;
+
+    case PROP_MAX_BUFFERING_TIME:
+      g_value_set_uint64 (value, demux->max_buffering_time);
+      break;
+
+    case PROP_DECRYPT_THREAD:
+      g_value_set_boolean (value, demux->decrypt_thread);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+static void gst_hls_track_prefetch_cancel (GstHlsTrack * track);
+static void gst_hls_track_prefetch_clear (GstHlsTrack * track);
+
 static void
 gst_hls_track_free (GstHlsTrack * track)
 {
+  GstBuffer *buffer;
+  guint i;
+
+  if (track->decrypt_thread) {
+    g_mutex_lock (&track->decrypt_lock);
+    track->decrypt_stop = TRUE;
+    g_cond_broadcast (&track->decrypt_cond);
+    g_mutex_unlock (&track->decrypt_lock);
+
+    g_thread_join (track->decrypt_thread);
+
+    while ((buffer = g_queue_pop_head (&track->decrypt_queue)))
+      gst_buffer_unref (buffer);
+
+    g_mutex_clear (&track->decrypt_lock);
+    g_cond_clear (&track->decrypt_cond);
+  }
+
+  if (track->prefetch) {
+    gst_hls_track_prefetch_cancel (track);
+    gst_hls_track_prefetch_clear (track);
+
+    for (i = 0; i < track->prefetch_depth; i++)
+      gst_object_unref (track->prefetch[i].downloader);
+
+    g_free (track->prefetch);
+    g_mutex_clear (&track->prefetch_lock);
+    g_cond_clear (&track->prefetch_cond);
+  }
+
   if (track->downloader)
     gst_object_unref (track->downloader);
 
+  if (track->key_downloader) {
+    gst_uri_downloader_cancel (track->key_downloader);
+    gst_object_unref (track->key_downloader);
+  }
+
+  g_mutex_clear (&track->reload_lock);
+  g_mutex_clear (&track->suspend_lock);
+  g_cond_clear (&track->reload_cond);
+  g_free (track->hint_uri);
+  g_mutex_clear (&track->buffering_lock);
+  g_cond_clear (&track->buffering_cond);
+
   if (track->task)
     gst_object_unref (track->task);
 
   if (track->pad) {
+    g_signal_handlers_disconnect_by_data (track->pad, track);
     gst_element_remove_pad (GST_ELEMENT_CAST (track->demux), track->pad);
     gst_object_unref (track->pad);
   }
@@ -227,8 +580,28 @@ gst_hls_track_free (GstHlsTrack * track)
   if (track->queue)
     g_object_unref (track->queue);
 
+  if (track->gst_stream)
+    gst_object_unref (track->gst_stream);
+
   EVP_CIPHER_CTX_cleanup (&track->aes_ctx);
 
+  if (track->aes_pending)
+    gst_buffer_unref (track->aes_pending);
+
+  if (track->aes_copy)
+    gst_buffer_unref (track->aes_copy);
+
+  if (track->aes_pool) {
+    gst_buffer_pool_set_active (track->aes_pool, FALSE);
+    gst_object_unref (track->aes_pool);
+  }
+
+  while ((buffer = g_queue_pop_head (&track->sample_aes_buffers)))
+    gst_buffer_unref (buffer);
+
+  if (track->sample_aes)
+    gst_hls_sample_aes_free (track->sample_aes);
+
   g_free (track);
 }
 
@@ -239,48 +612,119 @@ gst_hls_track_get_playlist (GstHlsTrack * track)
       track->media->playlist : track->stream->playlist;
 }
 
-static gchar *
-_buffer_to_utf8 (GstBuffer * buffer)
+/* fall back to polling if the server answers blocking requests right away
+ * with the same playlist */
+static gboolean
+gst_hls_track_can_block_reload (GstHlsTrack * track,
+    GstM3U8Playlist * playlist)
 {
-  gchar *data;
-  gsize size;
-
-  size = gst_buffer_get_size (buffer);
+  return playlist->can_block_reload && !track->reload_unchanged &&
+      track->sequence >= 0;
+}
 
-  data = g_malloc (size + 1);
-  if (data) {
-    size = gst_buffer_extract (buffer, 0, data, size);
-    data[size] = '\0';
+/* get the URI of a live playlist reload. The request blocks until the next
+ * segment or part is published if the server supports it, and only asks for
+ * the changes if the last update is recent enough. */
+static gchar *
+gst_hls_track_get_reload_uri (GstHlsTrack * track, GstM3U8Playlist * playlist,
+    gboolean * delta)
+{
+  GString *uri;
+  GstClockTime now;
+  gboolean blocking;
+  gchar sep;
+  guint part;
+
+  now = gst_util_get_timestamp ();
+  blocking = gst_hls_track_can_block_reload (track, playlist);
+  *delta = GST_CLOCK_TIME_IS_VALID (playlist->can_skip_until) &&
+      GST_CLOCK_TIME_IS_VALID (playlist->download_ts) &&
+      now < playlist->download_ts + playlist->can_skip_until / 2;
+
+  if (!blocking && !*delta)
+    return g_strdup (playlist->uri);
+
+  uri = g_string_new (playlist->uri);
+  sep = strchr (playlist->uri, '?') ? '&' : '?';
+
+  if (blocking) {
+    g_string_append_printf (uri, "%c_HLS_msn=%d", sep, track->sequence);
+    sep = '&';
+
+    /* after a hinted part, the playlist that lists it also has the hint for
+     * the next one */
+    if (GST_CLOCK_TIME_IS_VALID (playlist->part_target)) {
+      part = track->part;
+      if (track->hint_done && part > 0)
+        part--;
+      g_string_append_printf (uri, "&_HLS_part=%u", part);
+    }
   }
 
-  return data;
+  if (*delta)
+    g_string_append_printf (uri, "%c_HLS_skip=YES", sep);
+
+  return g_string_free (uri, FALSE);
 }
 
 static gboolean
-gst_hls_track_update_playlist (GstHlsTrack * track, gboolean * updated)
+gst_hls_track_update_playlist (GstHlsTrack * track, gboolean reload,
+    gboolean * updated)
 {
   GstM3U8Playlist *playlist;
   GstBuffer *buffer;
-  gchar *data;
+  GstMapInfo map;
+  gboolean ret, delta;
+  gchar *uri;
 
   playlist = gst_hls_track_get_playlist (track);
 
-  GST_DEBUG_OBJECT (track->pad, "update playlist with uri %s", playlist->uri);
+  delta = FALSE;
+  if (reload)
+    uri = gst_hls_track_get_reload_uri (track, playlist, &delta);
+  else
+    uri = g_strdup (playlist->uri);
+
+retry:
+  GST_DEBUG_OBJECT (track->pad, "update playlist with uri %s", uri);
 
   track->download_time = g_get_monotonic_time ();
-  buffer = gst_uri_downloader_fetch_uri (track->downloader,
-      playlist->uri, 0, -1);
+  buffer = gst_uri_downloader_fetch_uri (track->downloader, uri, 0, -1);
+
+  if (!buffer && GST_TASK_STATE (track->task) != GST_TASK_STARTED) {
+    GST_DEBUG_OBJECT (track->pad, "playlist download cancelled");
+    g_free (uri);
+    return FALSE;
+  }
 
   if (!buffer) {
+    g_free (uri);
     GST_ELEMENT_ERROR (track->demux, STREAM, DECODE,
         ("Failed to download playlist"), (NULL));
     return FALSE;
   }
 
-  data = _buffer_to_utf8 (buffer);
+  ret = FALSE;
+  if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    ret = gst_m3u8_playlist_update (playlist, (const gchar *) map.data,
+        map.size, updated);
+    gst_buffer_unmap (buffer, &map);
+  }
+
   gst_buffer_unref (buffer);
 
-  if (!data || !gst_m3u8_playlist_update (playlist, data, updated)) {
+  /* the delta update does not match the playlist, get the whole one */
+  if (!ret && delta) {
+    GST_WARNING_OBJECT (track->pad, "delta update failed");
+    g_free (uri);
+    uri = g_strdup (playlist->uri);
+    delta = FALSE;
+    goto retry;
+  }
+
+  g_free (uri);
+
+  if (!ret) {
     GST_ELEMENT_ERROR (track->demux, STREAM, DECODE,
         ("Invalid playlist"), (NULL));
     return FALSE;
@@ -289,12 +733,175 @@ gst_hls_track_update_playlist (GstHlsTrack * track, gboolean * updated)
   return TRUE;
 }
 
+static gboolean
+gst_hls_track_wait_reload (GstHlsTrack * track, GstM3U8Playlist * playlist)
+{
+  GstClockTime target, now, next;
+  gint64 end_time;
+  gboolean ret;
+
+  /* low-latency playlists are updated after each part */
+  target = playlist->part_target;
+  if (!GST_CLOCK_TIME_IS_VALID (target))
+    target = playlist->target_duration;
+  if (!GST_CLOCK_TIME_IS_VALID (target))
+    target = GST_SECOND;
+
+  /* wait one target duration after the playlist last changed, or half a
+   * target duration after the last reload if it did not change */
+  if (gst_hls_track_can_block_reload (track, playlist))
+    next = GST_CLOCK_TIME_NONE;
+  else if (track->reload_unchanged)
+    next = track->reload_ts + target / 2;
+  else
+    next = playlist->download_ts + target;
+
+  now = gst_util_get_timestamp ();
+
+  g_mutex_lock (&track->reload_lock);
+
+  if (GST_CLOCK_TIME_IS_VALID (next) && next > now) {
+    GST_DEBUG_OBJECT (track->pad, "reload playlist in %" GST_TIME_FORMAT,
+        GST_TIME_ARGS (next - now));
+
+    end_time = g_get_monotonic_time () + GST_TIME_AS_USECONDS (next - now);
+
+    while (!track->reload_cancelled &&
+        g_cond_wait_until (&track->reload_cond, &track->reload_lock, end_time));
+  }
+
+  ret = !track->reload_cancelled;
+
+  g_mutex_unlock (&track->reload_lock);
+
+  return ret;
+}
+
+static void
+gst_hls_track_reload_cancel (GstHlsTrack * track)
+{
+  g_mutex_lock (&track->reload_lock);
+  track->reload_cancelled = TRUE;
+  g_cond_signal (&track->reload_cond);
+  g_mutex_unlock (&track->reload_lock);
+}
+
+static void
+gst_hls_track_reload_reset (GstHlsTrack * track)
+{
+  g_mutex_lock (&track->reload_lock);
+  track->reload_cancelled = FALSE;
+  g_mutex_unlock (&track->reload_lock);
+}
+
+/* clear the cancels of the downloads, which stay pending if they were
+ * received between two fetches, before restarting the task */
+static void
+gst_hls_track_reset_downloads (GstHlsTrack * track)
+{
+  guint i;
+
+  gst_uri_downloader_reset (track->downloader);
+  gst_uri_downloader_reset (track->key_downloader);
+
+  for (i = 0; i < track->prefetch_depth; i++)
+    gst_uri_downloader_reset (track->prefetch[i].downloader);
+}
+
+static void
+gst_hls_track_buffering_done (GstHlsTrack * track)
+{
+  g_mutex_lock (&track->buffering_lock);
+  if (track->buffering) {
+    GST_DEBUG_OBJECT (track->pad, "buffering done");
+    track->buffering = FALSE;
+    g_cond_signal (&track->buffering_cond);
+  }
+  g_mutex_unlock (&track->buffering_lock);
+}
+
+static gboolean
+gst_hls_track_wait_buffering (GstHlsTrack * track)
+{
+  gboolean ret;
+
+  g_mutex_lock (&track->buffering_lock);
+  while (track->buffering && !track->flushing)
+    g_cond_wait (&track->buffering_cond, &track->buffering_lock);
+  ret = !track->flushing;
+  g_mutex_unlock (&track->buffering_lock);
+
+  return ret;
+}
+
+static void
+gst_hls_track_set_flushing (GstHlsTrack * track, gboolean flushing)
+{
+  gst_data_queue_set_flushing (track->queue, flushing);
+
+  if (track->decrypt_thread) {
+    GstBuffer *buffer;
+
+    g_mutex_lock (&track->decrypt_lock);
+    track->decrypt_flushing = flushing;
+    if (flushing) {
+      while ((buffer = g_queue_pop_head (&track->decrypt_queue)))
+        gst_buffer_unref (buffer);
+      track->decrypt_bytes = 0;
+    } else {
+      track->decrypt_ret = GST_FLOW_OK;
+    }
+    g_cond_broadcast (&track->decrypt_cond);
+    g_mutex_unlock (&track->decrypt_lock);
+  }
+
+  g_mutex_lock (&track->buffering_lock);
+  track->flushing = flushing;
+  if (!flushing)
+    track->buffering = track->demux->min_buffering_time > 0;
+  g_cond_signal (&track->buffering_cond);
+  g_mutex_unlock (&track->buffering_lock);
+
+  g_mutex_lock (&track->demux->keys_lock);
+  track->keys_flushing = flushing;
+  g_cond_broadcast (&track->demux->keys_cond);
+  g_mutex_unlock (&track->demux->keys_lock);
+
+  g_mutex_lock (&track->demux->early_lock);
+  track->early_flushing = flushing;
+  g_cond_broadcast (&track->demux->early_cond);
+  g_mutex_unlock (&track->demux->early_lock);
+}
+
 static gboolean
 _data_queue_check_full (GstDataQueue * queue, guint visible,
     guint bytes, guint64 time, GstHlsTrack * track)
 {
-  // FIXME: find smarter limit based on download rate and stream bandwidth
-  return bytes > 256 * 1024;
+  gboolean full;
+
+  if (time > 0)
+    full = time >= MAX (track->demux->max_buffering_time,
+        track->abr_buffer_time);
+  else
+    full = bytes > QUEUE_MAX_BYTES;
+
+  /* the queue can not grow anymore, do not wait for it to fill */
+  if (full && track->buffering)
+    gst_hls_track_buffering_done (track);
+
+  return full;
+}
+
+static void
+gst_hls_track_get_buffer_level (GstHlsTrack * track, GstClockTime * level,
+    GstClockTime * capacity)
+{
+  GstDataQueueSize size;
+
+  gst_data_queue_get_level (track->queue, &size);
+
+  *level = size.time;
+  *capacity = MAX (track->demux->max_buffering_time, track->abr_buffer_time);
 }
 
 static void
@@ -312,7 +919,7 @@ gst_hls_track_push_event (GstHlsTrack * track, GstEvent * event)
   GST_LOG_OBJECT (track->pad, "queue %" GST_PTR_FORMAT, event);
 
   item->object = GST_MINI_OBJECT_CAST (event);
-  item->duration = GST_CLOCK_TIME_NONE;
+  item->duration = 0;
   item->size = 0;
   item->visible = FALSE;
   item->destroy = (GDestroyNotify) _data_queue_item_destroy;
@@ -322,6 +929,9 @@ gst_hls_track_push_event (GstHlsTrack * track, GstEvent * event)
     return GST_FLOW_FLUSHING;
   }
 
+  if (GST_EVENT_TYPE (event) == GST_EVENT_EOS)
+    gst_hls_track_buffering_done (track);
+
   return GST_FLOW_OK;
 }
 
@@ -329,6 +939,8 @@ static GstFlowReturn
 gst_hls_track_push_buffer (GstHlsTrack * track, GstBuffer * buffer)
 {
   GstDataQueueItem *item = g_new (GstDataQueueItem, 1);
+  gboolean full;
+  gint64 start;
   gsize size;
 
   size = gst_buffer_get_size (buffer);
@@ -339,27 +951,100 @@ gst_hls_track_push_buffer (GstHlsTrack * track, GstBuffer * buffer)
   GST_LOG_OBJECT (track->pad, "queue %" GST_PTR_FORMAT, buffer);
 
   item->object = GST_MINI_OBJECT_CAST (buffer);
-  item->duration = GST_BUFFER_DURATION (buffer);
+  item->duration = GST_BUFFER_DURATION_IS_VALID (buffer) ?
+      GST_BUFFER_DURATION (buffer) : 0;
   item->size = size;
   item->visible = TRUE;
   item->destroy = (GDestroyNotify) _data_queue_item_destroy;
 
+  /* time spent waiting for the queue does not count in the download rate,
+   * the decryption thread blocking is accounted for by the downloader */
+  start = g_get_monotonic_time ();
+
+  /* do not keep the fetch slot while waiting for the consumer */
+  full = gst_data_queue_is_full (track->queue);
+  if (full)
+    gst_uri_downloader_yield_slot ();
+
   if (!gst_data_queue_push (track->queue, item)) {
+    if (full)
+      gst_uri_downloader_reclaim_slot ();
     _data_queue_item_destroy (item);
     return GST_FLOW_FLUSHING;
   }
 
+  if (full)
+    gst_uri_downloader_reclaim_slot ();
+
+  if (g_thread_self () != track->decrypt_thread)
+    track->blocked_time += g_get_monotonic_time () - start;
   track->length += size;
 
+  if (G_UNLIKELY (track->buffering)) {
+    GstDataQueueSize level;
+
+    gst_data_queue_get_level (track->queue, &level);
+    if (level.time >= track->demux->min_buffering_time)
+      gst_hls_track_buffering_done (track);
+  }
+
   return GST_FLOW_OK;
 }
 
+/* suspend the downloads when nothing links the pad for a while, the data
+ * would be dropped anyway */
+static void
+gst_hls_track_check_unlinked (GstHlsTrack * track)
+{
+  GstHlsDemux *demux = track->demux;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  if (track->not_linked_time == 0) {
+    track->not_linked_time = now;
+    return;
+  }
+
+  if (track->unlinked || now - track->not_linked_time < UNLINKED_SUSPEND_TIME)
+    return;
+
+  g_mutex_lock (&demux->select_lock);
+  if (!track->unlinked && !gst_pad_is_linked (track->pad)) {
+    GST_INFO_OBJECT (track->pad, "pad is not linked");
+    track->unlinked = TRUE;
+  }
+  g_mutex_unlock (&demux->select_lock);
+
+  gst_hls_track_sync_downloading (track);
+}
+
+/* resume the downloads once a suspended pad is linked again */
+static void
+gst_hls_track_pad_linked (GstPad * pad, GstPad * peer, GstHlsTrack * track)
+{
+  GstHlsDemux *demux = track->demux;
+
+  g_mutex_lock (&demux->select_lock);
+  if (track->unlinked) {
+    GST_INFO_OBJECT (pad, "pad linked");
+    track->unlinked = FALSE;
+  }
+  g_mutex_unlock (&demux->select_lock);
+
+  gst_hls_track_sync_downloading (track);
+}
+
 static void
 gst_hls_track_dequeue (GstHlsTrack * track)
 {
   GstDataQueueItem *item;
   GstFlowReturn ret;
 
+  if (G_UNLIKELY (track->buffering) && !gst_hls_track_wait_buffering (track)) {
+    ret = GST_FLOW_FLUSHING;
+    goto pause;
+  }
+
   if (!gst_data_queue_pop (track->queue, &item)) {
     ret = GST_FLOW_FLUSHING;
     goto pause;
@@ -380,6 +1065,11 @@ gst_hls_track_dequeue (GstHlsTrack * track)
 
   g_free (item);
 
+  if (ret == GST_FLOW_NOT_LINKED)
+    gst_hls_track_check_unlinked (track);
+  else
+    track->not_linked_time = 0;
+
   if (ret != GST_FLOW_OK && ret != GST_FLOW_NOT_LINKED)
     goto pause;
 
@@ -400,38 +1090,167 @@ pause:
   }
 }
 
+/* first playlist download, done from the track task so that the tracks
+ * fetch their playlists at the same time */
 static gboolean
-gst_hls_track_activate (GstHlsTrack * track)
+gst_hls_track_load_playlist (GstHlsTrack * track)
 {
   GstM3U8Playlist *playlist;
+  GstM3U8Segment *segment;
+  GstClockTime start;
+  gboolean resumed;
 
   playlist = gst_hls_track_get_playlist (track);
 
-  if (playlist->digest) {
+  resumed = track->resumed;
+  track->resumed = FALSE;
+
+  if (!GST_CLOCK_TIME_IS_VALID (playlist->download_ts)) {
+    if (!gst_hls_track_update_playlist (track, FALSE, NULL))
+      return FALSE;
+  } else if (resumed) {
+    /* live playlist is outdated when the track is selected again */
+    if (!playlist->endlist &&
+        !gst_hls_track_update_playlist (track, FALSE, NULL))
+      return FALSE;
+  } else {
     /* playlist was already downloaded upstream */
     track->download_time = track->demux->start_time;
+  }
+
+  segment = NULL;
+  if (GST_CLOCK_TIME_IS_VALID (track->resume_position)) {
+    segment = gst_m3u8_playlist_find_segment (playlist,
+        track->resume_position, FALSE, &start);
+    track->resume_position = GST_CLOCK_TIME_NONE;
+  }
+
+  track->part = 0;
+  gst_hls_track_drop_key (track);
+
+  if (segment) {
+    GST_DEBUG_OBJECT (track->pad, "resume at sequence %d, start time %"
+        GST_TIME_FORMAT, segment->sequence, GST_TIME_ARGS (start));
+    track->sequence = segment->sequence;
+    track->next_pts = start;
+  } else if (!playlist->endlist && gst_m3u8_playlist_get_live_start (playlist,
+          &track->sequence, &track->part)) {
+    GST_DEBUG_OBJECT (track->pad, "start at part %u of sequence %d",
+        track->part, track->sequence);
   } else {
-    if (!gst_hls_track_update_playlist (track, NULL))
-      return FALSE;
+    track->sequence = playlist->media_sequence;
   }
 
-  track->sequence = playlist->media_sequence;
   track->discont = TRUE;
 
-  gst_task_start (track->task);
+  return TRUE;
+}
+
+static void
+gst_hls_track_activate (GstHlsTrack * track)
+{
+  gst_hls_track_reload_reset (track);
+
+  GST_OBJECT_LOCK (track->demux);
+  track->downloading = track->selected && !track->unlinked;
+  GST_OBJECT_UNLOCK (track->demux);
+
+  if (track->downloading)
+    gst_task_start (track->task);
   gst_pad_start_task (track->pad, (GstTaskFunction) gst_hls_track_dequeue,
       track, NULL);
+}
 
-  return TRUE;
+/* stop downloading for a stream that is not rendered. The data already
+ * queued is still pushed */
+static void
+gst_hls_track_suspend (GstHlsTrack * track)
+{
+  GST_INFO_OBJECT (track->pad, "stop downloading");
+
+  gst_hls_track_set_flushing (track, TRUE);
+  gst_task_stop (track->task);
+  gst_uri_downloader_cancel (track->downloader);
+  gst_hls_track_prefetch_cancel (track);
+  gst_hls_track_reload_cancel (track);
+  gst_task_join (track->task);
+  gst_hls_track_prefetch_clear (track);
+  gst_hls_track_set_flushing (track, FALSE);
+
+  /* nothing is downloaded anymore, release the queued data without waiting
+   * for the buffering level */
+  gst_hls_track_buffering_done (track);
+
+  gst_pad_start_task (track->pad, (GstTaskFunction) gst_hls_track_dequeue,
+      track, NULL);
+}
+
+/* resume downloading at the given stream time */
+static void
+gst_hls_track_resume (GstHlsTrack * track, GstClockTime position)
+{
+  GST_INFO_OBJECT (track->pad, "resume downloading at %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (position));
+
+  track->sequence = -1;
+  track->resume_position = position;
+  track->resumed = TRUE;
+
+  /* buffer again, as after a seek */
+  g_mutex_lock (&track->buffering_lock);
+  track->buffering = track->demux->min_buffering_time > 0;
+  g_mutex_unlock (&track->buffering_lock);
+
+  gst_hls_track_reset_downloads (track);
+  gst_hls_track_reload_reset (track);
+  gst_task_start (track->task);
+}
+
+/* start or stop the downloads after the track was selected, deselected,
+ * linked or unlinked. Must be called without the select lock */
+static void
+gst_hls_track_sync_downloading (GstHlsTrack * track)
+{
+  GstHlsDemux *demux = track->demux;
+  GstClockTime position;
+  gboolean active;
+
+  g_mutex_lock (&track->suspend_lock);
+
+  g_mutex_lock (&demux->select_lock);
+  active = track->selected && !track->unlinked;
+  g_mutex_unlock (&demux->select_lock);
+
+  if (active && !track->downloading) {
+    /* start where the other tracks are downloading, or where this one
+     * stopped if it is the only one */
+    position = gst_hls_demux_get_download_position (demux);
+    if (!GST_CLOCK_TIME_IS_VALID (position))
+      position = track->suspend_position;
+
+    GST_OBJECT_LOCK (demux);
+    track->downloading = TRUE;
+    track->segment_start = GST_CLOCK_TIME_NONE;
+    GST_OBJECT_UNLOCK (demux);
+
+    gst_hls_track_resume (track, position);
+  } else if (!active && track->downloading) {
+    gst_hls_track_suspend (track);
+
+    GST_OBJECT_LOCK (demux);
+    track->suspend_position = track->segment_start;
+    track->downloading = FALSE;
+    GST_OBJECT_UNLOCK (demux);
+  }
+
+  g_mutex_unlock (&track->suspend_lock);
 }
 
 static gboolean
 gst_hls_track_expose (GstHlsTrack * track, GstCaps * caps)
 {
   GstHlsDemux *demux;
-  gchar *stream_id;
   GstEvent *stream_start;
-  GstStreamFlags stream_flags;
   GstSegment segment;
   GstM3U8Playlist *playlist;
 
@@ -453,25 +1272,24 @@ gst_hls_track_expose (GstHlsTrack * track, GstCaps * caps)
     demux->group_id = gst_util_group_id_next ();
   }
 
-  stream_id = gst_pad_create_stream_id_printf (track->pad,
-      GST_ELEMENT_CAST (demux), "%03u", demux->last_stream_id++);
-  stream_start = gst_event_new_stream_start (stream_id);
-  g_free (stream_id);
+  stream_start = gst_event_new_stream_start (
+      gst_stream_get_stream_id (track->gst_stream));
 
   if (demux->have_group_id)
     gst_event_set_group_id (stream_start, demux->group_id);
 
-  if (track->media) {
-    stream_flags = GST_STREAM_FLAG_NONE;
-    if (track->media->type == GST_M3U8_MEDIA_TYPE_SUBTITLES)
-      stream_flags |= GST_STREAM_FLAG_SPARSE;
-    if (track->media->is_default)
-      stream_flags |= GST_STREAM_FLAG_SELECT;
-    gst_event_set_stream_flags (stream_start, stream_flags);
-  }
+  gst_event_set_stream_flags (stream_start,
+      gst_stream_get_stream_flags (track->gst_stream));
+  gst_event_set_stream (stream_start, track->gst_stream);
+  gst_stream_set_caps (track->gst_stream, caps);
 
   gst_hls_track_push_event (track, stream_start);
 
+  /* send stream collection */
+  if (demux->collection)
+    gst_hls_track_push_event (track,
+        gst_event_new_stream_collection (demux->collection));
+
   /* send caps */
   gst_hls_track_push_event (track, gst_event_new_caps (caps));
 
@@ -484,7 +1302,9 @@ gst_hls_track_expose (GstHlsTrack * track, GstCaps * caps)
 
   gst_hls_track_push_event (track, gst_event_new_segment (&segment));
 
-  track->next_pts = 0;
+  /* a track selected late starts at the position of the others */
+  if (!GST_CLOCK_TIME_IS_VALID (track->next_pts))
+    track->next_pts = 0;
 
   return TRUE;
 }
@@ -544,31 +1364,223 @@ _find_caps (GstBuffer * buffer)
   return caps;
 }
 
+/* must be called with the keys lock held */
+static void
+gst_hls_demux_evict_keys (GstHlsDemux * demux, gint64 now)
+{
+  GHashTableIter iter;
+  GstHlsKey *key, *oldest;
+  gpointer oldest_uri;
+  gpointer uri;
+
+  do {
+    oldest = NULL;
+    oldest_uri = NULL;
+
+    g_hash_table_iter_init (&iter, demux->keys);
+    while (g_hash_table_iter_next (&iter, &uri, (gpointer *) & key)) {
+      if (key->pending)
+        continue;
+
+      if (now - key->fetch_ts > KEY_CACHE_TTL) {
+        g_hash_table_iter_remove (&iter);
+        continue;
+      }
+
+      if (!oldest || key->fetch_ts < oldest->fetch_ts) {
+        oldest = key;
+        oldest_uri = uri;
+      }
+    }
+
+    if (g_hash_table_size (demux->keys) < KEY_CACHE_SIZE || !oldest)
+      break;
+
+    g_hash_table_remove (demux->keys, oldest_uri);
+  } while (TRUE);
+}
+
+/* must be called with the keys lock held */
+static guint
+gst_hls_demux_add_pending_key (GstHlsDemux * demux, const gchar * uri,
+    gint64 now)
+{
+  GstHlsKey *key;
+
+  gst_hls_demux_evict_keys (demux, now);
+
+  key = g_new0 (GstHlsKey, 1);
+  key->id = ++demux->last_key_id;
+  key->pending = TRUE;
+  g_hash_table_replace (demux->keys, g_strdup (uri), key);
+
+  return key->id;
+}
+
+/* store a downloaded key, or forget it when data is NULL */
+static void
+gst_hls_demux_set_key (GstHlsDemux * demux, const gchar * uri, guint id,
+    const guint8 * data)
+{
+  GstHlsKey *key;
+
+  g_mutex_lock (&demux->keys_lock);
+
+  /* the cache may have been cleared meanwhile */
+  key = g_hash_table_lookup (demux->keys, uri);
+  if (key && key->id == id) {
+    if (data) {
+      memcpy (key->data, data, 16);
+      key->fetch_ts = g_get_monotonic_time ();
+      key->pending = FALSE;
+    } else {
+      g_hash_table_remove (demux->keys, uri);
+    }
+  }
+
+  g_cond_broadcast (&demux->keys_cond);
+  g_mutex_unlock (&demux->keys_lock);
+}
+
+static void
+key_fetch_done (GstBuffer * buffer, gpointer user_data)
+{
+  GstHlsKeyFetch *fetch = user_data;
+  guint8 data[16];
+  gboolean ok = FALSE;
+
+  if (buffer) {
+    ok = gst_buffer_extract (buffer, 0, data, 16) == 16;
+    gst_buffer_unref (buffer);
+  }
+
+  GST_DEBUG_OBJECT (fetch->demux, "prefetch of key %s %s", fetch->uri,
+      ok ? "done" : "failed");
+
+  gst_hls_demux_set_key (fetch->demux, fetch->uri, fetch->id,
+      ok ? data : NULL);
+
+  gst_object_unref (fetch->demux);
+  g_free (fetch->uri);
+  g_free (fetch);
+}
+
+/* fetch the next key in the background when the upcoming segments rotate
+ * it, so that it is cached when needed */
+static void
+gst_hls_track_prefetch_key (GstHlsTrack * track, GstM3U8Playlist * playlist,
+    GstM3U8Segment * segment)
+{
+  GstHlsDemux *demux = track->demux;
+  GstM3U8Segment *next = segment;
+  GstHlsKeyFetch *fetch;
+  GstHlsKey *key;
+  gint64 now;
+  guint i;
+
+  for (i = 0; i < KEY_LOOKAHEAD_SEGMENTS; i++) {
+    next = gst_m3u8_playlist_get_segment (playlist, next->sequence + 1);
+    if (!next)
+      return;
+
+    if (next->key != segment->key)
+      break;
+  }
+
+  if (i == KEY_LOOKAHEAD_SEGMENTS || !next->key || !next->key->uri ||
+      next->key->method == GST_M3U8_KEY_METHOD_NONE)
+    return;
+
+  if (segment->key && segment->key->uri &&
+      !strcmp (segment->key->uri, next->key->uri))
+    return;
+
+  g_mutex_lock (&demux->keys_lock);
+
+  now = g_get_monotonic_time ();
+  key = g_hash_table_lookup (demux->keys, next->key->uri);
+  if (key && (key->pending || now - key->fetch_ts <= KEY_CACHE_TTL)) {
+    g_mutex_unlock (&demux->keys_lock);
+    return;
+  }
+
+  fetch = g_new (GstHlsKeyFetch, 1);
+  fetch->demux = gst_object_ref (demux);
+  fetch->uri = g_strdup (next->key->uri);
+  fetch->id = gst_hls_demux_add_pending_key (demux, fetch->uri, now);
+
+  g_mutex_unlock (&demux->keys_lock);
+
+  GST_INFO_OBJECT (track->pad, "prefetch key %s for segment %d", fetch->uri,
+      next->sequence);
+
+  gst_uri_downloader_fetch_uri_async (track->key_downloader, fetch->uri, 0,
+      -1, key_fetch_done, fetch);
+}
+
 static gboolean
-gst_hls_track_decrypt_aes128_init (GstHlsTrack * track, GstM3U8Key * params)
+gst_hls_track_get_key (GstHlsTrack * track, const gchar * uri, guint8 * data)
 {
+  GstHlsDemux *demux = track->demux;
   GstBuffer *key_buffer;
+  GstHlsKey *key;
   guint key_size;
-  guint8 key[16];
-  guint8 iv[16];
+  gint64 now;
+  guint id;
+
+  g_mutex_lock (&demux->keys_lock);
+
+  /* another track is downloading that key, wait for it */
+  while ((key = g_hash_table_lookup (demux->keys, uri)) && key->pending &&
+      !track->keys_flushing)
+    g_cond_wait (&demux->keys_cond, &demux->keys_lock);
 
-  GST_INFO_OBJECT (track->pad, "download AES-128 key from %s", params->uri);
+  if (track->keys_flushing) {
+    GST_DEBUG_OBJECT (track->pad, "key wait interrupted");
+    g_mutex_unlock (&demux->keys_lock);
+    return FALSE;
+  }
+
+  now = g_get_monotonic_time ();
+
+  if (key && now - key->fetch_ts <= KEY_CACHE_TTL) {
+    memcpy (data, key->data, 16);
+    g_mutex_unlock (&demux->keys_lock);
+    return TRUE;
+  }
+
+  id = gst_hls_demux_add_pending_key (demux, uri, now);
+  g_mutex_unlock (&demux->keys_lock);
+
+  GST_INFO_OBJECT (track->pad, "download AES-128 key from %s", uri);
 
-  key_buffer = gst_uri_downloader_fetch_uri (track->downloader,
-      params->uri, 0, -1);
+  key_buffer = gst_uri_downloader_fetch_uri (track->downloader, uri, 0, -1);
+  key_size = 0;
 
   if (!key_buffer) {
     GST_ERROR_OBJECT (track->pad, "failed to download key");
-    return FALSE;
+  } else {
+    key_size = gst_buffer_extract (key_buffer, 0, data, 16);
+    gst_buffer_unref (key_buffer);
+
+    if (key_size != 16)
+      GST_ERROR_OBJECT (track->pad, "AES-128 key is too small");
   }
 
-  key_size = gst_buffer_extract (key_buffer, 0, key, 16);
-  gst_buffer_unref (key_buffer);
+  gst_hls_demux_set_key (demux, uri, id, key_size == 16 ? data : NULL);
+
+  return key_size == 16;
+}
+
+static GstFlowReturn gst_hls_track_push_data (GstHlsTrack * track,
+    GstBuffer * buffer, GstClockTime duration);
 
-  if (key_size != 16) {
-    GST_ERROR_OBJECT (track->pad, "AES-128 key is too small");
+static gboolean
+gst_hls_track_get_key_iv (GstHlsTrack * track, GstM3U8Key * params,
+    guint8 * key, guint8 * iv)
+{
+  if (!gst_hls_track_get_key (track, params->uri, key))
     return FALSE;
-  }
 
   if (params->iv) {
     if (!gst_m3u8_hex_to_bin (params->iv, iv, 16)) {
@@ -583,123 +1595,1081 @@ gst_hls_track_decrypt_aes128_init (GstHlsTrack * track, GstM3U8Key * params)
   GST_MEMDUMP ("AES-128 key", key, 16);
   GST_MEMDUMP ("AES-128 iv", iv, 16);
 
+  return TRUE;
+}
+
+static gboolean
+gst_hls_track_decrypt_aes128_init (GstHlsTrack * track, GstM3U8Key * params)
+{
+  guint8 key[16];
+  guint8 iv[16];
+
+  if (!gst_hls_track_get_key_iv (track, params, key, iv))
+    return FALSE;
+
   EVP_CipherInit_ex (&track->aes_ctx, EVP_aes_128_cbc (), NULL,
       key, iv, AES_DECRYPT);
+  EVP_CIPHER_CTX_set_padding (&track->aes_ctx, 0);
+
+  memcpy (track->aes_key, key, 16);
+  memcpy (track->aes_iv, iv, 16);
+  track->aes_128_data_size = 0;
+  gst_buffer_replace (&track->aes_pending, NULL);
+  gst_buffer_replace (&track->aes_copy, NULL);
 
   return TRUE;
 }
 
-static GstBuffer *
-gst_hls_track_decrypt_aes128_data (GstHlsTrack * track, GstBuffer * buffer)
+/* decrypt a writable buffer in place. The trailing partial block is kept in
+ * aes_128_data until the next buffer completes it, and the buffer is held
+ * back in aes_pending until then, so that the plaintext can be written over
+ * its last bytes. The last buffer is held until the end of the segment for
+ * padding removal. */
+static GstFlowReturn
+gst_hls_track_decrypt_aes128_inplace (GstHlsTrack * track, GstBuffer * buffer,
+    GstClockTime duration)
 {
-  GstBuffer *outbuf = NULL;
-  GstMapInfo map, outmap;
+  GstBuffer *pending;
+  GstMapInfo map;
+  guint8 block[16];
+  guint8 next_iv[16];
+  gsize head, size, tail;
   gint outsize;
-  gint blocksize;
 
-  if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
-    goto map_failed;
+  GST_BUFFER_DURATION (buffer) = duration;
 
-  blocksize = EVP_CIPHER_CTX_block_size (&track->aes_ctx);
-  outbuf = gst_buffer_new_allocate (NULL, map.size + blocksize, NULL);
-  if (!outbuf)
-    goto alloc_failed;
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READWRITE)) {
+    gst_buffer_unref (buffer);
+    return GST_FLOW_ERROR;
+  }
 
-  if (!gst_buffer_map (outbuf, &outmap, GST_MAP_WRITE))
-    goto outmap_failed;
+  /* not enough data to complete a block */
+  if (track->aes_128_data_size + map.size < 16) {
+    memcpy (track->aes_128_data + track->aes_128_data_size, map.data,
+        map.size);
+    track->aes_128_data_size += map.size;
+    gst_buffer_unmap (buffer, &map);
+    goto hold;
+  }
 
-  outsize = outmap.size;
-  EVP_CipherUpdate (&track->aes_ctx,
-      outmap.data, &outsize, map.data, map.size);
+  /* complete the block started in the pending buffer */
+  head = 0;
+  if (track->aes_128_data_size > 0) {
+    head = 16 - track->aes_128_data_size;
 
-  gst_buffer_unmap (outbuf, &outmap);
-  gst_buffer_set_size (outbuf, outsize);
-  gst_buffer_unref (buffer);
+    memcpy (track->aes_128_data + track->aes_128_data_size, map.data, head);
+    memcpy (next_iv, track->aes_128_data, 16);
+
+    outsize = 16;
+    EVP_CipherUpdate (&track->aes_ctx, block, &outsize, track->aes_128_data,
+        16);
+    memcpy (track->aes_iv, next_iv, 16);
+
+    gst_buffer_fill (track->aes_pending,
+        gst_buffer_get_size (track->aes_pending) - track->aes_128_data_size,
+        block, track->aes_128_data_size);
+    memcpy (map.data, block + track->aes_128_data_size, head);
+  }
+
+  size = (map.size - head) & ~(gsize) 15;
+  tail = map.size - head - size;
+
+  if (size > 0) {
+    memcpy (next_iv, map.data + head + size - 16, 16);
+
+    if (gst_hls_decrypt_aes128_cbc_parallel (track->aes_key, track->aes_iv,
+            map.data + head, size)) {
+      /* continue the chain from the last ciphertext block */
+      EVP_CipherInit_ex (&track->aes_ctx, NULL, NULL, NULL, next_iv, -1);
+    } else {
+      outsize = size;
+      EVP_CipherUpdate (&track->aes_ctx, map.data + head, &outsize,
+          map.data + head, size);
+    }
+
+    memcpy (track->aes_iv, next_iv, 16);
+  }
+
+  memcpy (track->aes_128_data, map.data + head + size, tail);
+  track->aes_128_data_size = tail;
+
+  gst_buffer_unmap (buffer, &map);
+
+  /* keep at least a block in the pending buffer for padding removal */
+  if (gst_buffer_get_size (buffer) < 16)
+    goto hold;
+
+  pending = track->aes_pending;
+  track->aes_pending = buffer;
+
+  if (!pending)
+    return GST_FLOW_OK;
+
+  return gst_hls_track_push_data (track, pending,
+      GST_BUFFER_DURATION (pending));
+
+hold:
+  if (track->aes_pending) {
+    if (GST_CLOCK_TIME_IS_VALID (duration) &&
+        GST_BUFFER_DURATION_IS_VALID (track->aes_pending))
+      duration += GST_BUFFER_DURATION (track->aes_pending);
+
+    track->aes_pending = gst_buffer_append (track->aes_pending, buffer);
+    GST_BUFFER_DURATION (track->aes_pending) = duration;
+  } else {
+    track->aes_pending = buffer;
+  }
+
+  return GST_FLOW_OK;
+}
+
+/* decrypt the data gathered so far from read-only buffers */
+static GstFlowReturn
+gst_hls_track_decrypt_aes128_flush_copy (GstHlsTrack * track)
+{
+  GstBuffer *buffer;
 
-  return outbuf;
+  buffer = track->aes_copy;
+  track->aes_copy = NULL;
+
+  if (!buffer)
+    return GST_FLOW_OK;
+
+  gst_buffer_set_size (buffer, track->aes_copy_size);
+
+  return gst_hls_track_decrypt_aes128_inplace (track, buffer,
+      GST_BUFFER_DURATION (buffer));
+}
+
+static GstFlowReturn
+gst_hls_track_decrypt_aes128_data (GstHlsTrack * track, GstBuffer * buffer,
+    GstClockTime duration)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstStructure *config;
+  GstMapInfo map;
+  gsize offset, chunk;
+
+  if (gst_buffer_is_writable (buffer) &&
+      gst_buffer_is_all_memory_writable (buffer)) {
+    ret = gst_hls_track_decrypt_aes128_flush_copy (track);
+    if (ret != GST_FLOW_OK) {
+      gst_buffer_unref (buffer);
+      return ret;
+    }
+
+    return gst_hls_track_decrypt_aes128_inplace (track, buffer, duration);
+  }
+
+  /* shared data, the downloader usually hands it over in small chunks.
+   * Gather it in pooled buffers so that it can be decrypted on several
+   * cores */
+  if (!track->aes_pool) {
+    track->aes_pool = gst_buffer_pool_new ();
+    config = gst_buffer_pool_get_config (track->aes_pool);
+    gst_buffer_pool_config_set_params (config, NULL, DECRYPT_POOL_BUFFER_SIZE,
+        0, 0);
+    gst_buffer_pool_set_config (track->aes_pool, config);
+    gst_buffer_pool_set_active (track->aes_pool, TRUE);
+  }
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    gst_buffer_unref (buffer);
+    return GST_FLOW_ERROR;
+  }
+
+  for (offset = 0; offset < map.size && ret == GST_FLOW_OK; offset += chunk) {
+    if (!track->aes_copy) {
+      if (gst_buffer_pool_acquire_buffer (track->aes_pool, &track->aes_copy,
+              NULL) != GST_FLOW_OK) {
+        ret = GST_FLOW_ERROR;
+        break;
+      }
+      track->aes_copy_size = 0;
+      GST_BUFFER_DURATION (track->aes_copy) =
+          GST_CLOCK_TIME_IS_VALID (duration) ? 0 : GST_CLOCK_TIME_NONE;
+    }
+
+    chunk = MIN (map.size - offset,
+        DECRYPT_POOL_BUFFER_SIZE - track->aes_copy_size);
+
+    gst_buffer_fill (track->aes_copy, track->aes_copy_size, map.data + offset,
+        chunk);
+    track->aes_copy_size += chunk;
+
+    if (GST_CLOCK_TIME_IS_VALID (duration) &&
+        GST_BUFFER_DURATION_IS_VALID (track->aes_copy))
+      GST_BUFFER_DURATION (track->aes_copy) +=
+          gst_util_uint64_scale (duration, chunk, map.size);
+    else
+      GST_BUFFER_DURATION (track->aes_copy) = GST_CLOCK_TIME_NONE;
+
+    if (track->aes_copy_size == DECRYPT_POOL_BUFFER_SIZE)
+      ret = gst_hls_track_decrypt_aes128_flush_copy (track);
+  }
 
-outmap_failed:
-  gst_buffer_unref (outbuf);
-alloc_failed:
   gst_buffer_unmap (buffer, &map);
-map_failed:
   gst_buffer_unref (buffer);
-  return NULL;
+
+  return ret;
 }
 
-static void
+static GstFlowReturn
 gst_hls_track_decrypt_aes128_finish (GstHlsTrack * track)
 {
+  GstFlowReturn ret;
   GstBuffer *buffer;
-  GstMapInfo map;
-  gint blocksize;
+  guint8 padding;
+  gsize size;
+
+  ret = gst_hls_track_decrypt_aes128_flush_copy (track);
+
+  buffer = track->aes_pending;
+  track->aes_pending = NULL;
 
-  blocksize = EVP_CIPHER_CTX_block_size (&track->aes_ctx);
-  buffer = gst_buffer_new_allocate (NULL, blocksize, NULL);
   if (!buffer)
-    return;
+    return ret;
 
-  if (!gst_buffer_map (buffer, &map, GST_MAP_WRITE)) {
+  if (ret != GST_FLOW_OK) {
     gst_buffer_unref (buffer);
-    return;
+    return ret;
   }
 
-  EVP_CipherFinal_ex (&track->aes_ctx, map.data, &blocksize);
-  gst_buffer_unmap (buffer, &map);
+  size = gst_buffer_get_size (buffer);
+
+  if (track->aes_128_data_size != 0) {
+    GST_WARNING_OBJECT (track->pad, "truncated AES-128 data");
+    size -= track->aes_128_data_size;
+    track->aes_128_data_size = 0;
+  } else {
+    /* strip PKCS7 padding */
+    gst_buffer_extract (buffer, size - 1, &padding, 1);
+    if (padding == 0 || padding > 16 || padding > size)
+      GST_WARNING_OBJECT (track->pad, "invalid AES-128 padding");
+    else
+      size -= padding;
+  }
 
-  if (blocksize == 0) {
+  if (size == 0) {
     gst_buffer_unref (buffer);
-    return;
+    return GST_FLOW_OK;
+  }
+
+  gst_buffer_resize (buffer, 0, size);
+
+  return gst_hls_track_push_data (track, buffer, GST_BUFFER_DURATION (buffer));
+}
+
+static gboolean
+gst_hls_track_decrypt_sample_aes_init (GstHlsTrack * track,
+    GstM3U8Key * params)
+{
+  GstBuffer *buffer;
+  guint8 key[16];
+  guint8 iv[16];
+
+  if (!gst_hls_track_get_key_iv (track, params, key, iv))
+    return FALSE;
+
+  if (!track->sample_aes)
+    track->sample_aes = gst_hls_sample_aes_new ();
+
+  gst_hls_sample_aes_set_key (track->sample_aes, key, iv);
+
+  while ((buffer = g_queue_pop_head (&track->sample_aes_buffers)))
+    gst_buffer_unref (buffer);
+
+  return TRUE;
+}
+
+static GstFlowReturn
+gst_hls_track_decrypt_sample_aes_data (GstHlsTrack * track,
+    GstBuffer * buffer, GstClockTime duration)
+{
+  /* the data is modified in place */
+  if (!gst_buffer_is_writable (buffer) ||
+      !gst_buffer_is_all_memory_writable (buffer)) {
+    GstBuffer *copy = gst_buffer_copy_deep (buffer);
+
+    gst_buffer_unref (buffer);
+    buffer = copy;
   }
 
-  gst_buffer_set_size (buffer, blocksize);
-  gst_hls_track_push_buffer (track, buffer);
+  GST_BUFFER_DURATION (buffer) = duration;
+  g_queue_push_tail (&track->sample_aes_buffers, buffer);
+
+  return GST_FLOW_OK;
 }
 
 static GstFlowReturn
-track_downloader_chain (GstBuffer * buffer, gpointer user_data)
+gst_hls_track_decrypt_sample_aes_finish (GstHlsTrack * track)
 {
-  GstHlsTrack *track = user_data;
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstMapInfo *maps;
+  GstBuffer *buffer;
+  gboolean decrypted;
+  guint n_maps = 0;
+  guint i;
+  GList *l;
 
-  if (track->key && track->key->method == GST_M3U8_KEY_METHOD_AES_128) {
-    buffer = gst_hls_track_decrypt_aes128_data (track, buffer);
-    if (!buffer)
+  maps = g_new (GstMapInfo, track->sample_aes_buffers.length);
+
+  for (l = track->sample_aes_buffers.head; l; l = l->next) {
+    if (!gst_buffer_map (l->data, &maps[n_maps], GST_MAP_READWRITE))
+      break;
+    n_maps++;
+  }
+
+  decrypted = n_maps == track->sample_aes_buffers.length &&
+      gst_hls_sample_aes_decrypt (track->sample_aes, maps, n_maps);
+
+  l = track->sample_aes_buffers.head;
+  for (i = 0; i < n_maps; i++, l = l->next)
+    gst_buffer_unmap (l->data, &maps[i]);
+
+  g_free (maps);
+
+  /* never let encrypted samples through, the segment is dropped */
+  if (!decrypted) {
+    GST_ELEMENT_WARNING (track->demux, STREAM, DECRYPT,
+        ("Failed to decrypt SAMPLE-AES segment"),
+        ("dropping segment %d", track->sequence));
+
+    while ((buffer = g_queue_pop_head (&track->sample_aes_buffers)))
+      gst_buffer_unref (buffer);
+
+    track->discont = TRUE;
+    return GST_FLOW_OK;
+  }
+
+  while ((buffer = g_queue_pop_head (&track->sample_aes_buffers))) {
+    if (ret == GST_FLOW_OK)
+      ret = gst_hls_track_push_data (track, buffer,
+          GST_BUFFER_DURATION (buffer));
+    else
+      gst_buffer_unref (buffer);
+  }
+
+  return ret;
+}
+
+/* estimate the duration of the data received so far in the segment */
+static GstClockTime
+gst_hls_track_next_duration (GstHlsTrack * track)
+{
+  GstClockTime time;
+  GstClockTime duration;
+
+  if (track->segment_size == 0 ||
+      !GST_CLOCK_TIME_IS_VALID (track->segment_duration))
+    return GST_CLOCK_TIME_NONE;
+
+  time = gst_util_uint64_scale (track->segment_bytes,
+      track->segment_duration, track->segment_size);
+  time = MIN (time, track->segment_duration);
+
+  duration = time > track->segment_time ? time - track->segment_time : 0;
+  track->segment_time = MAX (time, track->segment_time);
+
+  return duration;
+}
+
+static GstFlowReturn
+gst_hls_track_push_data (GstHlsTrack * track, GstBuffer * buffer,
+    GstClockTime duration)
+{
+  if (G_UNLIKELY (!track->exposed)) {
+    GstCaps *caps;
+    gboolean exposed;
+
+    caps = _find_caps (buffer);
+    exposed = gst_hls_track_expose (track, caps);
+    gst_caps_unref (caps);
+
+    if (!exposed)
       goto fail;
+
+    track->exposed = TRUE;
+  }
+
+  buffer = gst_buffer_make_writable (buffer);
+
+  GST_BUFFER_FLAGS (buffer) = 0;
+  GST_BUFFER_PTS (buffer) = track->next_pts;
+  GST_BUFFER_DTS (buffer) = GST_CLOCK_TIME_NONE;
+  GST_BUFFER_DURATION (buffer) = duration;
+
+  track->next_pts = GST_CLOCK_TIME_NONE;
+
+  if (track->discont) {
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+    track->discont = FALSE;
+  }
+
+  return gst_hls_track_push_buffer (track, buffer);
+
+fail:
+  gst_buffer_unref (buffer);
+  return GST_FLOW_ERROR;
+}
+
+static gpointer
+gst_hls_track_decrypt_loop (GstHlsTrack * track)
+{
+  GstBuffer *buffer;
+  GstClockTime duration;
+  GstFlowReturn ret;
+
+  g_mutex_lock (&track->decrypt_lock);
+
+  while (!track->decrypt_stop) {
+    buffer = g_queue_pop_head (&track->decrypt_queue);
+    if (!buffer) {
+      g_cond_wait (&track->decrypt_cond, &track->decrypt_lock);
+      continue;
+    }
+
+    track->decrypt_bytes -= gst_buffer_get_size (buffer);
+    track->decrypting = TRUE;
+    g_cond_broadcast (&track->decrypt_cond);
+    g_mutex_unlock (&track->decrypt_lock);
+
+    duration = GST_BUFFER_DURATION (buffer);
+    ret = gst_hls_track_decrypt_aes128_data (track, buffer, duration);
+
+    g_mutex_lock (&track->decrypt_lock);
+    if (ret != GST_FLOW_OK && !track->decrypt_flushing)
+      track->decrypt_ret = ret;
+    track->decrypting = FALSE;
+    g_cond_broadcast (&track->decrypt_cond);
+  }
+
+  g_mutex_unlock (&track->decrypt_lock);
+
+  return NULL;
+}
+
+/* hand over encrypted data to the decryption thread, in order */
+static GstFlowReturn
+gst_hls_track_queue_decrypt (GstHlsTrack * track, GstBuffer * buffer,
+    GstClockTime duration)
+{
+  GstFlowReturn ret;
+  gboolean full;
+  gint64 start;
+  gsize size;
+
+  buffer = gst_buffer_make_writable (buffer);
+  GST_BUFFER_DURATION (buffer) = duration;
+  size = gst_buffer_get_size (buffer);
+
+  g_mutex_lock (&track->decrypt_lock);
+
+  start = g_get_monotonic_time ();
+  full = track->decrypt_bytes > DECRYPT_QUEUE_MAX_BYTES;
+  if (full)
+    gst_uri_downloader_yield_slot ();
+
+  while (track->decrypt_bytes > DECRYPT_QUEUE_MAX_BYTES &&
+      track->decrypt_ret == GST_FLOW_OK && !track->decrypt_flushing)
+    g_cond_wait (&track->decrypt_cond, &track->decrypt_lock);
+  track->blocked_time += g_get_monotonic_time () - start;
+
+  ret = track->decrypt_ret;
+  if (track->decrypt_flushing)
+    ret = GST_FLOW_FLUSHING;
+
+  if (ret == GST_FLOW_OK) {
+    g_queue_push_tail (&track->decrypt_queue, buffer);
+    track->decrypt_bytes += size;
+    g_cond_broadcast (&track->decrypt_cond);
+  } else {
+    gst_buffer_unref (buffer);
+  }
+
+  g_mutex_unlock (&track->decrypt_lock);
+
+  if (full) {
+    start = g_get_monotonic_time ();
+    gst_uri_downloader_reclaim_slot ();
+    track->blocked_time += g_get_monotonic_time () - start;
+  }
+
+  return ret;
+}
+
+/* wait for the decryption thread to process all queued data, the queue is
+ * emptied when flushing */
+static gboolean
+gst_hls_track_decrypt_drain (GstHlsTrack * track)
+{
+  gboolean ret;
+
+  g_mutex_lock (&track->decrypt_lock);
+
+  while (track->decrypting || track->decrypt_queue.length > 0)
+    g_cond_wait (&track->decrypt_cond, &track->decrypt_lock);
+
+  ret = track->decrypt_ret == GST_FLOW_OK && !track->decrypt_flushing;
+  track->decrypt_ret = GST_FLOW_OK;
+  g_mutex_unlock (&track->decrypt_lock);
+
+  return ret;
+}
+
+static GstFlowReturn
+track_downloader_chain (GstBuffer * buffer, gpointer user_data)
+{
+  GstHlsTrack *track = user_data;
+  GstClockTime duration;
+
+  track->segment_bytes += gst_buffer_get_size (buffer);
+  duration = gst_hls_track_next_duration (track);
+
+  if (track->key && track->key->method == GST_M3U8_KEY_METHOD_AES_128) {
+    if (track->decrypt_thread)
+      return gst_hls_track_queue_decrypt (track, buffer, duration);
+
+    return gst_hls_track_decrypt_aes128_data (track, buffer, duration);
+  }
+
+  if (track->key && track->key->method == GST_M3U8_KEY_METHOD_SAMPLE_AES)
+    return gst_hls_track_decrypt_sample_aes_data (track, buffer, duration);
+
+  return gst_hls_track_push_data (track, buffer, duration);
+}
+
+static GstFlowReturn
+prefetch_downloader_chain (GstBuffer * buffer, gpointer user_data)
+{
+  GstHlsPrefetch *prefetch = user_data;
+  GstHlsTrack *track = prefetch->track;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  g_mutex_lock (&track->prefetch_lock);
+  if (prefetch->cancelled) {
+    gst_buffer_unref (buffer);
+    ret = GST_FLOW_FLUSHING;
+  } else {
+    track->prefetch_bytes += gst_buffer_get_size (buffer);
+    g_queue_push_tail (&prefetch->buffers, buffer);
+    g_cond_broadcast (&track->prefetch_cond);
+  }
+  g_mutex_unlock (&track->prefetch_lock);
+
+  return ret;
+}
+
+static void
+prefetch_downloader_done (gboolean success, gpointer user_data)
+{
+  GstHlsPrefetch *prefetch = user_data;
+  GstHlsTrack *track = prefetch->track;
+
+  g_mutex_lock (&track->prefetch_lock);
+  prefetch->success = success;
+  prefetch->done = TRUE;
+  if (--track->prefetch_active == 0)
+    track->prefetch_busy_time +=
+        g_get_monotonic_time () - track->prefetch_busy_since;
+  g_cond_broadcast (&track->prefetch_cond);
+  g_mutex_unlock (&track->prefetch_lock);
+}
+
+/* must be called with the prefetch lock held */
+static void
+gst_hls_track_prefetch_release (GstHlsTrack * track, GstHlsPrefetch * prefetch)
+{
+  GstBuffer *buffer;
+
+  if (prefetch->sequence < 0)
+    return;
+
+  if (!prefetch->done) {
+    prefetch->cancelled = TRUE;
+
+    /* the downloader may be blocked pushing to us, do not hold the lock */
+    g_mutex_unlock (&track->prefetch_lock);
+    gst_uri_downloader_cancel (prefetch->downloader);
+    g_mutex_lock (&track->prefetch_lock);
+
+    while (!prefetch->done)
+      g_cond_wait (&track->prefetch_cond, &track->prefetch_lock);
+  }
+
+  while ((buffer = g_queue_pop_head (&prefetch->buffers)))
+    gst_buffer_unref (buffer);
+
+  g_free (prefetch->uri);
+  prefetch->uri = NULL;
+  prefetch->sequence = -1;
+}
+
+static GstHlsPrefetch *
+gst_hls_track_prefetch_find (GstHlsTrack * track, gint sequence)
+{
+  guint i;
+
+  for (i = 0; i < track->prefetch_depth; i++) {
+    if (track->prefetch[i].sequence == sequence)
+      return &track->prefetch[i];
+  }
+
+  return NULL;
+}
+
+/* must be called with the prefetch lock held */
+static GstHlsPrefetch *
+gst_hls_track_prefetch_schedule (GstHlsTrack * track,
+    GstM3U8Playlist * playlist, GstM3U8Segment * segment)
+{
+  GstHlsPrefetch *prefetch;
+  gint sequence;
+  guint i;
+
+  /* drop segments we already went past */
+  for (i = 0; i < track->prefetch_depth; i++) {
+    prefetch = &track->prefetch[i];
+    if (prefetch->sequence >= 0 && prefetch->sequence < segment->sequence)
+      gst_hls_track_prefetch_release (track, prefetch);
+  }
+
+  /* the slots are all busy with later segments, this happens when the
+   * sequence moved backwards */
+  if (!gst_hls_track_prefetch_find (track, segment->sequence) &&
+      !gst_hls_track_prefetch_find (track, -1)) {
+    for (i = 0; i < track->prefetch_depth; i++)
+      gst_hls_track_prefetch_release (track, &track->prefetch[i]);
+  }
+
+  /* start downloading the next segments in free slots */
+  sequence = segment->sequence;
+
+  for (i = 0; i < track->prefetch_depth && segment; i++) {
+    if (!gst_hls_track_prefetch_find (track, segment->sequence)) {
+      prefetch = gst_hls_track_prefetch_find (track, -1);
+      if (!prefetch)
+        break;
+
+      prefetch->sequence = segment->sequence;
+      prefetch->uri = g_strdup (segment->uri);
+      prefetch->range_start = segment->offset;
+      prefetch->range_end = segment->length < 0 ? -1 :
+          segment->length + segment->offset;
+      prefetch->done = FALSE;
+      prefetch->success = FALSE;
+      prefetch->cancelled = FALSE;
+
+      if (track->prefetch_active++ == 0)
+        track->prefetch_busy_since = g_get_monotonic_time ();
+
+      GST_DEBUG_OBJECT (track->pad, "prefetch segment %d uri %s",
+          prefetch->sequence, prefetch->uri);
+
+      gst_uri_downloader_stream_uri_async (prefetch->downloader,
+          prefetch->uri, prefetch->range_start, prefetch->range_end,
+          prefetch_downloader_chain, prefetch_downloader_done, prefetch);
+    }
+
+    segment = gst_m3u8_playlist_get_segment (playlist, segment->sequence + 1);
+  }
+
+  return gst_hls_track_prefetch_find (track, sequence);
+}
+
+/* hand over the data of a prefetched segment. The segment may have been
+ * downloaded long before, so the bytes received by all the slots and the
+ * time they were busy since the previous segment are returned for the rate
+ * estimation */
+static gboolean
+gst_hls_track_prefetch_stream (GstHlsTrack * track,
+    GstM3U8Playlist * playlist, GstM3U8Segment * segment,
+    guint64 * bytes, gint64 * elapsed)
+{
+  GstHlsPrefetch *prefetch;
+  GstFlowReturn flow = GST_FLOW_OK;
+  gboolean ret;
+  gint64 busy_time;
+
+  g_mutex_lock (&track->prefetch_lock);
+
+  prefetch = gst_hls_track_prefetch_schedule (track, playlist, segment);
+
+  /* hand over the buffers in order as they arrive */
+  while (flow == GST_FLOW_OK) {
+    GstBuffer *buffer;
+
+    buffer = g_queue_pop_head (&prefetch->buffers);
+    if (buffer) {
+      g_mutex_unlock (&track->prefetch_lock);
+      flow = track_downloader_chain (buffer, track);
+      g_mutex_lock (&track->prefetch_lock);
+      continue;
+    }
+
+    if (prefetch->done || prefetch->cancelled)
+      break;
+
+    g_cond_wait (&track->prefetch_cond, &track->prefetch_lock);
+  }
+
+  ret = flow == GST_FLOW_OK && !prefetch->cancelled && prefetch->success;
+
+  busy_time = track->prefetch_busy_time;
+  if (track->prefetch_active > 0)
+    busy_time += g_get_monotonic_time () - track->prefetch_busy_since;
+
+  *bytes = track->prefetch_bytes - track->prefetch_measured_bytes;
+  *elapsed = busy_time - track->prefetch_measured_time;
+  track->prefetch_measured_bytes = track->prefetch_bytes;
+  track->prefetch_measured_time = busy_time;
+
+  gst_hls_track_prefetch_release (track, prefetch);
+
+  g_mutex_unlock (&track->prefetch_lock);
+
+  return ret;
+}
+
+static void
+gst_hls_track_prefetch_cancel (GstHlsTrack * track)
+{
+  GstHlsPrefetch *prefetch;
+  guint i;
+
+  if (!track->prefetch)
+    return;
+
+  g_mutex_lock (&track->prefetch_lock);
+  for (i = 0; i < track->prefetch_depth; i++) {
+    prefetch = &track->prefetch[i];
+    if (prefetch->sequence >= 0 && !prefetch->done)
+      prefetch->cancelled = TRUE;
+  }
+  g_cond_broadcast (&track->prefetch_cond);
+  g_mutex_unlock (&track->prefetch_lock);
+
+  for (i = 0; i < track->prefetch_depth; i++) {
+    prefetch = &track->prefetch[i];
+    if (prefetch->cancelled)
+      gst_uri_downloader_cancel (prefetch->downloader);
+  }
+}
+
+static void
+gst_hls_track_prefetch_clear (GstHlsTrack * track)
+{
+  guint i;
+
+  if (!track->prefetch)
+    return;
+
+  g_mutex_lock (&track->prefetch_lock);
+  for (i = 0; i < track->prefetch_depth; i++)
+    gst_hls_track_prefetch_release (track, &track->prefetch[i]);
+  g_mutex_unlock (&track->prefetch_lock);
+}
+
+/* account bytes received in the given time, in microseconds */
+static void
+gst_hls_track_update_bitrate (GstHlsTrack * track, guint64 bytes,
+    gint64 elapsed)
+{
+  gint64 bitrate;
+
+  if (elapsed <= 0 || bytes == 0)
+    return;
+
+  bitrate = gst_util_uint64_scale (bytes * 8, G_USEC_PER_SEC, elapsed);
+
+  /* smooth out the measures with an exponential moving average */
+  if (track->bitrate == 0)
+    track->bitrate = bitrate;
+  else
+    track->bitrate = (bitrate + 3 * track->bitrate) / 4;
+
+  GST_DEBUG_OBJECT (track->pad, "segment downloaded at %" G_GINT64_FORMAT
+      " kbps, estimated bandwidth %" G_GINT64_FORMAT " kbps",
+      bitrate / 1000, track->bitrate / 1000);
+}
+
+static void
+gst_hls_track_switch_stream (GstHlsTrack * track)
+{
+  GstM3U8Stream *stream, *previous;
+  GstM3U8Playlist *playlist;
+  gint64 max_bitrate;
+
+  playlist = gst_hls_track_get_playlist (track);
+
+  switch (track->demux->abr_mode) {
+    case GST_HLS_DEMUX_ABR_MODE_BUFFER: {
+      GstClockTime level, capacity;
+
+      if (GST_CLOCK_TIME_IS_VALID (playlist->target_duration))
+        track->abr_buffer_time =
+            ABR_BUFFER_MIN_SEGMENTS * playlist->target_duration;
+
+      gst_hls_track_get_buffer_level (track, &level, &capacity);
+      stream = gst_m3u8_client_select_stream_for_buffer (track->demux->client,
+          level, capacity, playlist->target_duration);
+      break;
+    }
+
+    case GST_HLS_DEMUX_ABR_MODE_THROUGHPUT:
+    default:
+      if (track->bitrate == 0)
+        return;
+
+      max_bitrate = track->bitrate * BANDWIDTH_USAGE / 100;
+      stream = gst_m3u8_client_select_stream (track->demux->client,
+          MIN (max_bitrate, G_MAXINT));
+      break;
+  }
+
+  if (stream == track->stream)
+    return;
+
+  GST_INFO_OBJECT (track->pad, "switching to stream with bandwidth %d kbps, "
+      "estimated bandwidth %" G_GINT64_FORMAT " kbps", stream->bandwidth / 1000,
+      track->bitrate / 1000);
+
+  previous = track->stream;
+  track->stream = stream;
+
+  /* prefetched segments belong to the previous stream */
+  gst_hls_track_prefetch_clear (track);
+
+  playlist = gst_hls_track_get_playlist (track);
+  if (!GST_CLOCK_TIME_IS_VALID (playlist->download_ts) ||
+      !playlist->endlist) {
+    if (!gst_hls_track_update_playlist (track, FALSE, NULL)) {
+      GST_WARNING_OBJECT (track->pad, "failed to switch stream");
+      track->stream = previous;
+      return;
+    }
+  }
+
+  /* continue at the same sequence in the new stream */
+  track->discont = TRUE;
+}
+
+/* forget the crypto context chained from the previous parts, its data is not
+ * pushed */
+static void
+gst_hls_track_drop_key (GstHlsTrack * track)
+{
+  GstBuffer *buffer;
+
+  track->key = NULL;
+  track->key_chained = FALSE;
+  track->aes_128_data_size = 0;
+  gst_buffer_replace (&track->aes_pending, NULL);
+  gst_buffer_replace (&track->aes_copy, NULL);
+
+  while ((buffer = g_queue_pop_head (&track->sample_aes_buffers)))
+    gst_buffer_unref (buffer);
+}
+
+/* init crypto context when it does not match the previous segment */
+static gboolean
+gst_hls_track_init_key (GstHlsTrack * track, GstM3U8Key * key)
+{
+  /* a seek can leave the context chained over the parts of another
+   * segment */
+  if (track->key_chained)
+    gst_hls_track_drop_key (track);
+
+  track->key = NULL;
+
+  if (!key || !key->uri)
+    return TRUE;
+
+  switch (key->method) {
+    case GST_M3U8_KEY_METHOD_NONE:
+      break;
+
+    case GST_M3U8_KEY_METHOD_AES_128:
+      if (!gst_hls_track_decrypt_aes128_init (track, key))
+        return FALSE;
+      break;
+
+    case GST_M3U8_KEY_METHOD_SAMPLE_AES:
+      if (!gst_hls_track_decrypt_sample_aes_init (track, key))
+        return FALSE;
+      break;
+
+    default:
+      GST_ERROR_OBJECT (track->pad, "unsupported crypt method");
+      return FALSE;
+  }
+
+  track->key = key;
+
+  return TRUE;
+}
+
+/* finish/flush crypto context */
+static GstFlowReturn
+gst_hls_track_finish_key (GstHlsTrack * track)
+{
+  if (track->key && track->key->method == GST_M3U8_KEY_METHOD_AES_128)
+    return gst_hls_track_decrypt_aes128_finish (track);
+  else if (track->key && track->key->method == GST_M3U8_KEY_METHOD_SAMPLE_AES)
+    return gst_hls_track_decrypt_sample_aes_finish (track);
+
+  return GST_FLOW_OK;
+}
+
+/* end the crypto context chained over the parts of a segment when a part is
+ * missing. The data decrypted so far is pushed, it has no padding yet */
+static void
+gst_hls_track_abort_key (GstHlsTrack * track)
+{
+  GstBuffer *buffer;
+  gsize size;
+
+  if (!track->key_chained)
+    return;
+
+  if (track->key && track->key->method == GST_M3U8_KEY_METHOD_AES_128) {
+    gst_hls_track_decrypt_aes128_flush_copy (track);
+
+    buffer = track->aes_pending;
+    track->aes_pending = NULL;
+
+    if (buffer) {
+      size = gst_buffer_get_size (buffer) - track->aes_128_data_size;
+      if (size > 0) {
+        gst_buffer_resize (buffer, 0, size);
+        gst_hls_track_push_data (track, buffer, GST_BUFFER_DURATION (buffer));
+      } else {
+        gst_buffer_unref (buffer);
+      }
+    }
+    track->aes_128_data_size = 0;
+  } else {
+    gst_hls_track_finish_key (track);
+  }
+
+  track->key = NULL;
+  track->key_chained = FALSE;
+}
+
+/* get the preload hint if it is the next part to download */
+static GstM3U8Part *
+gst_hls_track_get_preload_hint (GstHlsTrack * track,
+    GstM3U8Playlist * playlist)
+{
+  GstM3U8Part *hint = playlist->preload_hint;
+  guint n_parts;
+
+  if (!hint || playlist->endlist || playlist->parts_sequence != track->sequence)
+    return NULL;
+
+  n_parts = playlist->parts ? playlist->parts->len : 0;
+  if (track->part != n_parts)
+    return NULL;
+
+  /* the playlist is reloaded if the hinted part cannot be downloaded */
+  if (!g_strcmp0 (hint->uri, track->hint_uri) &&
+      hint->offset == track->hint_offset)
+    return NULL;
+
+  g_free (track->hint_uri);
+  track->hint_uri = g_strdup (hint->uri);
+  track->hint_offset = hint->offset;
+
+  return hint;
+}
+
+/* download a part of a segment. The crypto context is set up at the first
+ * part and chained over the next ones, AES-128 CBC continuing from the last
+ * ciphertext block of the previous part */
+static gboolean
+gst_hls_track_download_part (GstHlsTrack * track, GstM3U8Playlist * playlist,
+    GstM3U8Segment * segment, GstM3U8Part * part)
+{
+  guint64 range_start, range_end;
+  gboolean downloaded, is_hint;
+
+  is_hint = part == playlist->preload_hint;
+
+  if (track->part == 0 && !segment && playlist->parts_discont)
+    track->discont = TRUE;
+
+  if (part->gap) {
+    GST_DEBUG_OBJECT (track->pad, "skip gap part %u of sequence %d",
+        track->part, track->sequence);
+    gst_hls_track_abort_key (track);
+    track->discont = TRUE;
+    track->part++;
+    return TRUE;
+  }
+
+  GST_OBJECT_LOCK (track->demux);
+  track->segment_start = segment ?
+      gst_m3u8_playlist_get_segment_start (playlist, segment) :
+      playlist->duration;
+  GST_OBJECT_UNLOCK (track->demux);
+
+  /* starting in the middle of a segment, the IV of the part is unknown and
+   * only its first block is lost, the stream is already discontinuous */
+  if (!track->key_chained || track->part == 0) {
+    if (!gst_hls_track_init_key (track, part->key))
+      return FALSE;
+    track->key_chained = TRUE;
   }
 
-  if (G_UNLIKELY (!track->exposed)) {
-    GstCaps *caps;
-    gboolean exposed;
+  GST_DEBUG_OBJECT (track->pad, "download %s %u of sequence %d, offset %"
+      G_GINT64_FORMAT " size %" G_GINT64_FORMAT " uri %s",
+      is_hint ? "hinted part" : "part", track->part, track->sequence,
+      part->offset, part->length, part->uri);
 
-    caps = _find_caps (buffer);
-    exposed = gst_hls_track_expose (track, caps);
-    gst_caps_unref (caps);
+  track->segment_bytes = 0;
+  track->blocked_time = 0;
+  track->download_time = g_get_monotonic_time ();
 
-    if (!exposed)
-      goto fail;
+  track->segment_duration = GST_CLOCK_TIME_IS_VALID (part->duration) ?
+      part->duration : playlist->part_target;
+  track->segment_time = 0;
+  if (part->length > 0)
+    track->segment_size = part->length;
+  else
+    track->segment_size = gst_util_uint64_scale (track->content_rate,
+        track->segment_duration, GST_SECOND);
 
-    track->exposed = TRUE;
-  }
+  range_start = part->offset;
+  range_end = part->length < 0 ? -1 : part->length + part->offset;
 
-  buffer = gst_buffer_make_writable (buffer);
+  downloaded = gst_uri_downloader_stream_uri (track->downloader,
+      part->uri, range_start, range_end, track_downloader_chain, track);
 
-  GST_BUFFER_FLAGS (buffer) = 0;
-  GST_BUFFER_PTS (buffer) = track->next_pts;
-  GST_BUFFER_DTS (buffer) = GST_CLOCK_TIME_NONE;
-  GST_BUFFER_DURATION (buffer) = GST_CLOCK_TIME_NONE;
+  if (track->decrypt_thread && !gst_hls_track_decrypt_drain (track))
+    downloaded = FALSE;
 
-  track->next_pts = GST_CLOCK_TIME_NONE;
+  track->hint_done = is_hint && downloaded;
 
-  if (track->discont) {
-    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
-    track->discont = FALSE;
-  }
+  if (downloaded) {
+    gst_hls_track_update_bitrate (track, track->segment_bytes,
+        g_get_monotonic_time () - track->download_time - track->blocked_time);
+    track->part++;
+  } else if (!is_hint) {
+    GST_DEBUG_OBJECT (track->pad, "failed download");
+    gst_hls_track_abort_key (track);
+    track->discont = TRUE;
+    track->part++;
+  } else {
+    GST_DEBUG_OBJECT (track->pad, "hinted part not available");
 
-  return gst_hls_track_push_buffer (track, buffer);
+    /* the chain is broken if some of the part was received */
+    if (track->segment_bytes > 0) {
+      gst_hls_track_abort_key (track);
+      track->discont = TRUE;
+    }
+  }
 
-fail:
-  gst_buffer_unref (buffer);
-  return GST_FLOW_ERROR;
+  return TRUE;
 }
 
 static void
@@ -707,13 +2677,71 @@ gst_hls_track_download (GstHlsTrack * track)
 {
   GstM3U8Playlist *playlist;
   GstM3U8Segment *segment;
+  GstM3U8Part *part;
   guint64 range_start, range_end;
+  guint64 bytes;
+  gint64 elapsed;
+  gboolean downloaded;
+
+  if (track->sequence < 0) {
+    if (!gst_hls_demux_wait_early_playlist (track->demux, track)) {
+      GST_DEBUG_OBJECT (track->pad, "early playlist wait interrupted");
+      return;
+    }
+
+    if (!gst_hls_track_load_playlist (track)) {
+      GST_ERROR_OBJECT (track->pad, "failed to fetch stream playlist");
+      goto eos;
+    }
+  }
+
+  /* adapt main rendition to the download rate on segment boundaries */
+  if (!track->media && track->part == 0)
+    gst_hls_track_switch_stream (track);
 
   playlist = gst_hls_track_get_playlist (track);
 
   /* find next segment to download based on sequence */
 retry:
   segment = gst_m3u8_playlist_get_segment (playlist, track->sequence);
+
+  /* the segment being downloaded by parts went out of the live window */
+  if (track->part > 0 && segment && segment->sequence != track->sequence) {
+    gst_hls_track_abort_key (track);
+    track->part = 0;
+  }
+
+  /* segments not complete yet, or started in the middle, are downloaded by
+   * parts */
+  if (!segment || track->part > 0) {
+    part = gst_m3u8_playlist_get_part (playlist, track->sequence, track->part);
+
+    if (!part && segment) {
+      /* remaining parts are unknown if they are not listed anymore */
+      if (!segment->parts || track->part < segment->parts->len) {
+        gst_hls_track_abort_key (track);
+        track->discont = TRUE;
+      } else if (track->key_chained) {
+        if (gst_hls_track_finish_key (track) != GST_FLOW_OK)
+          track->discont = TRUE;
+        track->key_chained = FALSE;
+      }
+
+      track->sequence++;
+      track->part = 0;
+      goto retry;
+    }
+
+    if (!part)
+      part = gst_hls_track_get_preload_hint (track, playlist);
+
+    if (part) {
+      if (!gst_hls_track_download_part (track, playlist, segment, part))
+        goto eos;
+      return;
+    }
+  }
+
   if (!segment) {
     if (playlist->endlist) {
       GST_DEBUG_OBJECT (track->pad, "all segments downloaded, send EOS");
@@ -721,15 +2749,25 @@ retry:
     } else {
       gboolean update;
 
-      if (!gst_hls_track_update_playlist (track, &update)) {
+      if (!gst_hls_track_wait_reload (track, playlist)) {
+        GST_DEBUG_OBJECT (track->pad, "playlist reload cancelled");
+        return;
+      }
+
+      track->reload_ts = gst_util_get_timestamp ();
+
+      if (!gst_hls_track_update_playlist (track, TRUE, &update)) {
+        if (GST_TASK_STATE (track->task) != GST_TASK_STARTED)
+          return;
         GST_ERROR_OBJECT (track->pad, "failed to fetch stream playlist");
         goto eos;
-      } else if (!update) {
-        /* FIXME: is this an error ?? */
-        GST_ERROR_OBJECT (track->pad, "no more segments in playlist");
-        goto eos;
-      } else
-        goto retry;
+      }
+
+      if (!update)
+        GST_DEBUG_OBJECT (track->pad, "playlist did not change");
+
+      track->reload_unchanged = !update;
+      goto retry;
     }
   }
 
@@ -738,44 +2776,70 @@ retry:
     track->discont = TRUE;
 
   track->sequence = segment->sequence;
-  track->key = NULL;
-
-  /* init crypto context when it does not match the previous segment */
-  if (segment->key && segment->key->uri) {
-    switch (segment->key->method) {
-      case GST_M3U8_KEY_METHOD_NONE:
-        break;
+  track->hint_done = FALSE;
 
-      case GST_M3U8_KEY_METHOD_AES_128:
-        if (!gst_hls_track_decrypt_aes128_init (track, segment->key))
-          goto eos;
-        break;
+  GST_OBJECT_LOCK (track->demux);
+  track->segment_start =
+      gst_m3u8_playlist_get_segment_start (playlist, segment);
+  GST_OBJECT_UNLOCK (track->demux);
 
-      default:
-        GST_ERROR_OBJECT (track->pad, "unsupported crypt method");
-        goto eos;
-    }
+  if (!gst_hls_track_init_key (track, segment->key))
+    goto eos;
 
-    track->key = segment->key;
-  }
+  gst_hls_track_prefetch_key (track, playlist, segment);
 
   /* download segment data */
   GST_DEBUG_OBJECT (track->pad, "download segment %u, offset %" G_GINT64_FORMAT
       " size %" G_GINT64_FORMAT " uri %s", segment->sequence, segment->offset,
       segment->length, segment->uri);
 
-  range_start = segment->offset;
-  range_end = segment->length < 0 ? -1 : segment->length + segment->offset;
+  track->segment_bytes = 0;
+  track->blocked_time = 0;
+  track->download_time = g_get_monotonic_time ();
+
+  /* use the byte range if known, or the size of the previous segments */
+  track->segment_duration = segment->duration;
+  track->segment_time = 0;
+  if (segment->length > 0)
+    track->segment_size = segment->length;
+  else
+    track->segment_size = gst_util_uint64_scale (track->content_rate,
+        segment->duration, GST_SECOND);
+
+  if (track->prefetch) {
+    /* the prefetch downloads never wait for the track */
+    downloaded = gst_hls_track_prefetch_stream (track, playlist, segment,
+        &bytes, &elapsed);
+  } else {
+    range_start = segment->offset;
+    range_end = segment->length < 0 ? -1 : segment->length + segment->offset;
+
+    downloaded = gst_uri_downloader_stream_uri (track->downloader,
+        segment->uri, range_start, range_end, track_downloader_chain, track);
+    bytes = track->segment_bytes;
+    elapsed = g_get_monotonic_time () - track->download_time -
+        track->blocked_time;
+  }
+
+  /* the decryption context is reused for the next segment */
+  if (track->decrypt_thread && !gst_hls_track_decrypt_drain (track))
+    downloaded = FALSE;
 
-  if (!gst_uri_downloader_stream_uri (track->downloader, segment->uri,
-        range_start, range_end, track_downloader_chain, track)) {
+  if (!downloaded) {
     GST_DEBUG_OBJECT (track->pad, "failed download");
     track->discont = TRUE;
+  } else {
+    gst_hls_track_update_bitrate (track, bytes, elapsed);
+
+    if (segment->duration > 0)
+      track->content_rate = gst_util_uint64_scale (track->segment_bytes,
+          GST_SECOND, segment->duration);
   }
 
-  /* finish/flush crypto context */
-  if (track->key && track->key->method == GST_M3U8_KEY_METHOD_AES_128)
-    gst_hls_track_decrypt_aes128_finish (track);
+  if (gst_hls_track_finish_key (track) != GST_FLOW_OK) {
+    GST_DEBUG_OBJECT (track->pad, "failed to push end of segment");
+    track->discont = TRUE;
+  }
 
   /* set next segment to download */
   track->sequence++;
@@ -848,7 +2912,7 @@ static gboolean
 gst_hls_track_handle_seek_event (GstHlsTrack * track, GstEvent * event)
 {
   GstM3U8Playlist *playlist;
-  GSList *list;
+  GstM3U8Segment *segment;
   gdouble rate;
   GstFormat format;
   GstSeekFlags flags;
@@ -902,10 +2966,13 @@ gst_hls_track_handle_seek_event (GstHlsTrack * track, GstEvent * event)
   if (flags & GST_SEEK_FLAG_FLUSH) {
     GstEvent *flush_event = gst_event_new_flush_start ();
     GST_DEBUG_OBJECT (track->pad, "starting flush");
-    gst_data_queue_set_flushing (track->queue, TRUE);
+    gst_hls_track_set_flushing (track, TRUE);
     gst_task_stop (track->task);
     gst_uri_downloader_cancel (track->downloader);
+    gst_hls_track_prefetch_cancel (track);
+    gst_hls_track_reload_cancel (track);
     gst_task_join (track->task);
+    gst_hls_track_prefetch_clear (track);
     gst_data_queue_flush (track->queue);
     gst_event_set_seqnum (flush_event, seqnum);
     gst_pad_push_event (track->pad, flush_event);
@@ -914,36 +2981,24 @@ gst_hls_track_handle_seek_event (GstHlsTrack * track, GstEvent * event)
   snap_after = !!(flags & GST_SEEK_FLAG_SNAP_AFTER) &&
       !(flags & GST_SEEK_FLAG_SNAP_BEFORE);
 
-  pos = 0;
-  for (list = playlist->segments; list != NULL; list = list->next) {
-    GstM3U8Segment *segment = (GstM3U8Segment *) list->data;
-    gboolean clip;
-
-    if (snap_after)
-      clip = seeksegment.position <= pos;
-    else
-      clip = seeksegment.position >= pos &&
-          seeksegment.position < pos + segment->duration;
-
-    if (clip) {
-      GST_DEBUG_OBJECT (track->pad, "found sequence %u, start time %"
-          GST_TIME_FORMAT, segment->sequence, GST_TIME_ARGS (pos));
-      track->sequence = segment->sequence;
-      seeksegment.position = pos;
-      if (flags & GST_SEEK_FLAG_KEY_UNIT) {
-        seeksegment.time = pos;
-        seeksegment.start = pos;
-      }
-      break;
+  segment = gst_m3u8_playlist_find_segment (playlist, seeksegment.position,
+      snap_after, &pos);
+  if (segment) {
+    GST_DEBUG_OBJECT (track->pad, "found sequence %u, start time %"
+        GST_TIME_FORMAT, segment->sequence, GST_TIME_ARGS (pos));
+    track->sequence = segment->sequence;
+    track->part = 0;
+    seeksegment.position = pos;
+    if (flags & GST_SEEK_FLAG_KEY_UNIT) {
+      seeksegment.time = pos;
+      seeksegment.start = pos;
     }
-
-    pos += segment->duration;
   }
 
   if (flags & GST_SEEK_FLAG_FLUSH) {
     GstEvent *flush_event = gst_event_new_flush_stop (TRUE);
     GST_DEBUG_OBJECT (track->pad, "stopping flush");
-    gst_data_queue_set_flushing (track->queue, FALSE);
+    gst_hls_track_set_flushing (track, FALSE);
     gst_event_set_seqnum (flush_event, seqnum);
     gst_pad_push_event (track->pad, flush_event);
   }
@@ -955,7 +3010,10 @@ gst_hls_track_handle_seek_event (GstHlsTrack * track, GstEvent * event)
   track->discont = TRUE;
   track->length = 0;
   track->next_pts = seeksegment.position;
+  track->suspend_position = seeksegment.position;
 
+  gst_hls_track_reset_downloads (track);
+  gst_hls_track_reload_reset (track);
   gst_task_start (track->task);
   gst_pad_start_task (track->pad, (GstTaskFunction) gst_hls_track_dequeue,
       track, NULL);
@@ -976,17 +3034,23 @@ gst_hls_track_pad_event (GstPad * pad, GstObject * parent, GstEvent * event)
       res = gst_hls_track_handle_seek_event (track, event);
       break;
 
+    case GST_EVENT_SELECT_STREAMS:
+      res = gst_hls_demux_select_streams (track->demux, event);
+      break;
+
     case GST_EVENT_FLUSH_START:
       GST_DEBUG_OBJECT (pad, "flush start");
       gst_task_stop (track->task);
       gst_uri_downloader_cancel (track->downloader);
-      gst_data_queue_set_flushing (track->queue, TRUE);
+      gst_hls_track_prefetch_cancel (track);
+      gst_hls_track_reload_cancel (track);
+      gst_hls_track_set_flushing (track, TRUE);
       gst_data_queue_flush (track->queue);
       break;
 
     case GST_EVENT_FLUSH_STOP:
       GST_DEBUG_OBJECT (pad, "flush stop");
-      gst_data_queue_set_flushing (track->queue, FALSE);
+      gst_hls_track_set_flushing (track, FALSE);
       break;
 
     default:
@@ -997,6 +3061,52 @@ gst_hls_track_pad_event (GstPad * pad, GstObject * parent, GstEvent * event)
   return res;
 }
 
+static void
+gst_hls_track_create_stream (GstHlsTrack * track,
+    GstM3U8MediaType media_type)
+{
+  GstHlsDemux *demux = track->demux;
+  GstStreamType type;
+  GstStreamFlags flags;
+  GstTagList *tags;
+  gchar *stream_id;
+
+  flags = GST_STREAM_FLAG_NONE;
+  switch (media_type) {
+    case GST_M3U8_MEDIA_TYPE_AUDIO:
+      type = GST_STREAM_TYPE_AUDIO;
+      break;
+    case GST_M3U8_MEDIA_TYPE_VIDEO:
+      type = GST_STREAM_TYPE_VIDEO;
+      break;
+    case GST_M3U8_MEDIA_TYPE_SUBTITLES:
+    default:
+      type = GST_STREAM_TYPE_TEXT;
+      flags |= GST_STREAM_FLAG_SPARSE;
+      break;
+  }
+
+  if (!track->media || track->media->is_default)
+    flags |= GST_STREAM_FLAG_SELECT;
+
+  stream_id = gst_pad_create_stream_id_printf (track->pad,
+      GST_ELEMENT_CAST (demux), "%03u", demux->last_stream_id++);
+  track->gst_stream = gst_stream_new (stream_id, NULL, type, flags);
+  g_free (stream_id);
+
+  if (track->media) {
+    tags = gst_tag_list_new_empty ();
+    if (track->media->language)
+      gst_tag_list_add (tags, GST_TAG_MERGE_REPLACE, GST_TAG_LANGUAGE_CODE,
+          track->media->language, NULL);
+    if (track->media->name)
+      gst_tag_list_add (tags, GST_TAG_MERGE_REPLACE, GST_TAG_TITLE,
+          track->media->name, NULL);
+    gst_stream_set_tags (track->gst_stream, tags);
+    gst_tag_list_unref (tags);
+  }
+}
+
 static gboolean
 gst_hls_demux_add_track (GstHlsDemux * demux, GstM3U8Stream * stream,
     GstM3U8Media * media)
@@ -1021,6 +3131,10 @@ gst_hls_demux_add_track (GstHlsDemux * demux, GstM3U8Stream * stream,
   track->sequence = -1;
   track->last_seek_seqnum = (guint32) -1;
   track->next_pts = GST_CLOCK_TIME_NONE;
+  track->selected = TRUE;
+  track->segment_start = GST_CLOCK_TIME_NONE;
+  track->suspend_position = GST_CLOCK_TIME_NONE;
+  track->resume_position = GST_CLOCK_TIME_NONE;
   track->queue = gst_data_queue_new ((GstDataQueueCheckFullFunction)
       _data_queue_check_full, NULL, NULL, track);
 
@@ -1052,9 +3166,53 @@ gst_hls_demux_add_track (GstHlsDemux * demux, GstM3U8Stream * stream,
   gst_pad_set_query_function (track->pad, gst_hls_track_pad_query);
   gst_pad_set_event_function (track->pad, gst_hls_track_pad_event);
   gst_pad_set_element_private (track->pad, track);
+  g_signal_connect (track->pad, "linked",
+      G_CALLBACK (gst_hls_track_pad_linked), track);
+
+  gst_hls_track_create_stream (track, media_type);
 
   /* setup segment downloader */
   track->downloader = gst_uri_downloader_new ();
+  track->key_downloader = gst_uri_downloader_new ();
+
+  /* setup segment prefetch downloaders */
+  track->prefetch_depth = demux->prefetch_segments;
+  if (track->prefetch_depth > 1) {
+    guint i;
+
+    g_mutex_init (&track->prefetch_lock);
+    g_cond_init (&track->prefetch_cond);
+
+    track->prefetch = g_new0 (GstHlsPrefetch, track->prefetch_depth);
+    for (i = 0; i < track->prefetch_depth; i++) {
+      track->prefetch[i].track = track;
+      track->prefetch[i].downloader = gst_uri_downloader_new ();
+      track->prefetch[i].sequence = -1;
+      g_queue_init (&track->prefetch[i].buffers);
+    }
+  }
+
+  g_mutex_init (&track->reload_lock);
+  g_mutex_init (&track->suspend_lock);
+  g_cond_init (&track->reload_cond);
+  track->reload_ts = GST_CLOCK_TIME_NONE;
+
+  g_mutex_init (&track->buffering_lock);
+  g_cond_init (&track->buffering_cond);
+  track->buffering = demux->min_buffering_time > 0;
+
+  if (demux->decrypt_thread) {
+    g_mutex_init (&track->decrypt_lock);
+    g_cond_init (&track->decrypt_cond);
+    g_queue_init (&track->decrypt_queue);
+
+    track->decrypt_thread = g_thread_new ("hlsdecrypt",
+        (GThreadFunc) gst_hls_track_decrypt_loop, track);
+  }
+
+  /* until a segment is downloaded, rely on the advertised bandwidth */
+  if (!media)
+    track->content_rate = stream->bandwidth / 8;
 
   /* create task for downloader */
   g_rec_mutex_init (&track->download_lock);
@@ -1092,13 +3250,29 @@ gst_hls_demux_change_state (GstElement * element, GstStateChange transition)
     case GST_STATE_CHANGE_PAUSED_TO_READY:
       GST_DEBUG_OBJECT (demux, "stopping downloads");
       gst_pad_stop_task (demux->sinkpad);
+      gst_hls_demux_stop_early_playlist (demux, NULL);
+      /* interrupt all downloads and key waits before joining any track, a
+       * track may wait for a key fetched by another one */
       for (i = 0; i < demux->tracks->len; i++) {
         GstHlsTrack *track = g_ptr_array_index (demux->tracks, i);
-        gst_data_queue_set_flushing (track->queue, TRUE);
+        gst_hls_track_set_flushing (track, TRUE);
         gst_task_stop (track->task);
+        gst_uri_downloader_cancel (track->downloader);
+        gst_uri_downloader_cancel (track->key_downloader);
+        gst_hls_track_prefetch_cancel (track);
+        gst_hls_track_reload_cancel (track);
+      }
+      for (i = 0; i < demux->tracks->len; i++) {
+        GstHlsTrack *track = g_ptr_array_index (demux->tracks, i);
+        gst_task_join (track->task);
       }
       g_ptr_array_free (demux->tracks, TRUE);
       demux->tracks = NULL;
+
+      g_mutex_lock (&demux->keys_lock);
+      g_hash_table_remove_all (demux->keys);
+      g_cond_broadcast (&demux->keys_cond);
+      g_mutex_unlock (&demux->keys_lock);
       break;
 
     default:
@@ -1113,29 +3287,195 @@ gst_hls_demux_change_state (GstElement * element, GstStateChange transition)
   return ret;
 }
 
+typedef struct {
+  GstHlsDemux *demux;
+  guint id;
+} GstHlsEarlyFetch;
+
+static void
+early_playlist_done (GstBuffer * buffer, gpointer user_data)
+{
+  GstHlsEarlyFetch *fetch = user_data;
+  GstHlsDemux *demux = fetch->demux;
+  GstM3U8Playlist *playlist;
+  GstMapInfo map;
+  gboolean ret = FALSE;
+
+  g_mutex_lock (&demux->early_lock);
+
+  /* the playlist is only updated if the fetch was not stopped, the lock
+   * keeps the track from using it meanwhile */
+  if (fetch->id == demux->early_id && demux->early_stream) {
+    playlist = demux->early_stream->playlist;
+
+    if (buffer && gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+      ret = gst_m3u8_playlist_update (playlist, (const gchar *) map.data,
+          map.size, NULL);
+      gst_buffer_unmap (buffer, &map);
+    }
+
+    GST_DEBUG_OBJECT (demux, "early fetch of playlist %s %s", playlist->uri,
+        ret ? "done" : "failed");
+
+    demux->early_stream = NULL;
+    g_cond_broadcast (&demux->early_cond);
+  } else {
+    GST_DEBUG_OBJECT (demux, "discarding stopped early playlist fetch");
+  }
+
+  g_mutex_unlock (&demux->early_lock);
+
+  if (buffer)
+    gst_buffer_unref (buffer);
+
+  gst_object_unref (demux);
+  g_free (fetch);
+}
+
+/* fetch the media playlist of the stream that would be selected with the
+ * variants known so far, while the rest of the master playlist is still
+ * being received */
+static void
+gst_hls_demux_fetch_early_playlist (GstHlsDemux * demux)
+{
+  GstHlsEarlyFetch *fetch;
+  GstM3U8Stream *stream;
+
+  g_mutex_lock (&demux->early_lock);
+
+  if (demux->early_stream) {
+    g_mutex_unlock (&demux->early_lock);
+    return;
+  }
+
+  stream = gst_m3u8_client_select_stream (demux->client, 0);
+  if (!stream || stream == demux->early_tried || !stream->playlist ||
+      GST_CLOCK_TIME_IS_VALID (stream->playlist->download_ts)) {
+    g_mutex_unlock (&demux->early_lock);
+    return;
+  }
+
+  if (!demux->early_downloader)
+    demux->early_downloader = gst_uri_downloader_new ();
+
+  demux->early_stream = stream;
+  demux->early_tried = stream;
+
+  fetch = g_new (GstHlsEarlyFetch, 1);
+  fetch->demux = gst_object_ref (demux);
+  fetch->id = demux->early_id;
+
+  g_mutex_unlock (&demux->early_lock);
+
+  GST_INFO_OBJECT (demux, "early fetch of playlist %s (bandwidth %d)",
+      stream->playlist->uri, stream->bandwidth);
+
+  gst_uri_downloader_fetch_uri_async (demux->early_downloader,
+      stream->playlist->uri, 0, -1, early_playlist_done, fetch);
+}
+
+/* stop the early playlist fetch without waiting for it, unless it is for
+ * the selected stream. The track of that stream waits for it instead. */
+static void
+gst_hls_demux_stop_early_playlist (GstHlsDemux * demux,
+    GstM3U8Stream * selected)
+{
+  GstUriDownloader *downloader = NULL;
+
+  g_mutex_lock (&demux->early_lock);
+
+  if (demux->early_stream && demux->early_stream != selected) {
+    gst_uri_downloader_cancel (demux->early_downloader);
+    demux->early_stream = NULL;
+    demux->early_id++;
+    g_cond_broadcast (&demux->early_cond);
+  }
+
+  /* the async job holds a reference on the downloader while it runs */
+  if (!demux->early_stream) {
+    downloader = demux->early_downloader;
+    demux->early_downloader = NULL;
+  }
+
+  demux->early_tried = NULL;
+  g_mutex_unlock (&demux->early_lock);
+
+  if (downloader)
+    gst_object_unref (downloader);
+}
+
+/* wait for the early fetch of a track playlist to complete. Returns FALSE
+ * if the track is flushed meanwhile */
+static gboolean
+gst_hls_demux_wait_early_playlist (GstHlsDemux * demux, GstHlsTrack * track)
+{
+  GstM3U8Playlist *playlist;
+  gboolean ret;
+
+  playlist = gst_hls_track_get_playlist (track);
+
+  g_mutex_lock (&demux->early_lock);
+  while (demux->early_stream && demux->early_stream->playlist == playlist &&
+      !track->early_flushing)
+    g_cond_wait (&demux->early_cond, &demux->early_lock);
+  ret = !track->early_flushing;
+  g_mutex_unlock (&demux->early_lock);
+
+  return ret;
+}
+
 static GstFlowReturn
 gst_hls_demux_chain (GstPad * pad, GstObject * parent, GstBuffer * buffer)
 {
   GstHlsDemux *demux = GST_HLS_DEMUX (parent);
+  GstQuery *query;
+  GstMapInfo map;
 
   if (!demux->playlist) {
-    demux->playlist = buffer;
     demux->start_time = g_get_monotonic_time ();
-  } else
+
+    if (demux->client)
+      gst_m3u8_client_free (demux->client);
+    demux->client = gst_m3u8_client_new ();
+
+    query = gst_query_new_uri ();
+    if (!gst_pad_peer_query (demux->sinkpad, query)) {
+      GST_WARNING_OBJECT (demux, "failed to query playlist URI");
+    } else {
+      gst_query_parse_uri (query, &demux->client->master_playlist.uri);
+      GST_INFO_OBJECT (demux, "fetching master playlist at URI: %s",
+          demux->client->master_playlist.uri);
+    }
+    gst_query_unref (query);
+  }
+
+  /* parse the lines received so far, the buffer is kept in case the
+   * whole playlist is a rendition playlist */
+  if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    gst_m3u8_client_push_master_playlist (demux->client,
+        (const gchar *) map.data, map.size);
+    gst_buffer_unmap (buffer, &map);
+  }
+
+  if (!demux->playlist)
+    demux->playlist = buffer;
+  else
     demux->playlist = gst_buffer_append (demux->playlist, buffer);
 
+  if (demux->client->is_variant)
+    gst_hls_demux_fetch_early_playlist (demux);
+
   return GST_FLOW_OK;
 }
 
 static gboolean
 gst_hls_demux_parse_master_playlist (GstHlsDemux * demux)
 {
-  GstQuery *query;
   GstM3U8Stream *stream;
   GstM3U8Media *media;
   GPtrArray *group;
+  GstMapInfo map;
   guint i;
-  gchar *data;
   gboolean ret;
 
   if (demux->playlist == NULL) {
@@ -1143,32 +3483,26 @@ gst_hls_demux_parse_master_playlist (GstHlsDemux * demux)
     return FALSE;
   }
 
-  demux->client = gst_m3u8_client_new ();
-
-  query = gst_query_new_uri ();
-  if (!gst_pad_peer_query (demux->sinkpad, query)) {
-    GST_WARNING_OBJECT (demux, "failed to query playlist URI");
-  } else {
-    gst_query_parse_uri (query, &demux->client->master_playlist.uri);
-    GST_INFO_OBJECT (demux, "fetched master playlist at URI: %s",
-        demux->client->master_playlist.uri);
+  ret = FALSE;
+  if (gst_buffer_map (demux->playlist, &map, GST_MAP_READ)) {
+    ret = gst_m3u8_client_finish_master_playlist (demux->client,
+        (const gchar *) map.data, map.size);
+    gst_buffer_unmap (demux->playlist, &map);
   }
-  gst_query_unref (query);
 
-  data = _buffer_to_utf8 (demux->playlist);
   gst_buffer_unref (demux->playlist);
   demux->playlist = NULL;
 
-  ret = TRUE;
-  if (!data || !gst_m3u8_client_parse_master_playlist (demux->client, data)) {
+  if (!ret)
     GST_ELEMENT_ERROR (demux, STREAM, DECODE, ("Invalid playlist"), (NULL));
-    ret = FALSE;
-  }
-
-  g_free (data);
 
   /* select stream with highest bandwidth */
   stream = gst_m3u8_client_select_stream (demux->client, 0);
+  demux->client->stream = stream;
+
+  /* keep the media playlist fetched early if it is the selected one */
+  gst_hls_demux_stop_early_playlist (demux, stream);
+
   if (!stream) {
     GST_ERROR_OBJECT (demux, "failed to select stream to render");
     return FALSE;
@@ -1215,13 +3549,145 @@ gst_hls_demux_parse_master_playlist (GstHlsDemux * demux)
 
   gst_element_no_more_pads (GST_ELEMENT (demux));
 
-  /* activate each track pad */
+  /* activate each track pad, their playlists are fetched in parallel */
+  g_mutex_lock (&demux->select_lock);
   for (i = 0; i < demux->tracks->len; i++)
     gst_hls_track_activate (g_ptr_array_index (demux->tracks, i));
+  g_mutex_unlock (&demux->select_lock);
+
+  gst_hls_demux_post_collection (demux);
 
   return ret;
 }
 
+static void
+gst_hls_demux_post_collection (GstHlsDemux * demux)
+{
+  GstStreamCollection *collection;
+  gchar *upstream_id;
+  guint i;
+
+  upstream_id = gst_pad_get_stream_id (demux->sinkpad);
+  collection = gst_stream_collection_new (upstream_id);
+  g_free (upstream_id);
+
+  for (i = 0; i < demux->tracks->len; i++) {
+    GstHlsTrack *track = g_ptr_array_index (demux->tracks, i);
+    gst_stream_collection_add_stream (collection,
+        gst_object_ref (track->gst_stream));
+  }
+
+  GST_OBJECT_LOCK (demux);
+  if (demux->collection)
+    gst_object_unref (demux->collection);
+  demux->collection = gst_object_ref (collection);
+  GST_OBJECT_UNLOCK (demux);
+
+  gst_element_post_message (GST_ELEMENT_CAST (demux),
+      gst_message_new_stream_collection (GST_OBJECT_CAST (demux),
+          collection));
+  gst_object_unref (collection);
+}
+
+/* earliest segment downloaded by the active tracks */
+static GstClockTime
+gst_hls_demux_get_download_position (GstHlsDemux * demux)
+{
+  GstClockTime position;
+  guint i;
+
+  position = GST_CLOCK_TIME_NONE;
+
+  GST_OBJECT_LOCK (demux);
+  for (i = 0; i < demux->tracks->len; i++) {
+    GstHlsTrack *track = g_ptr_array_index (demux->tracks, i);
+    if (track->downloading &&
+        GST_CLOCK_TIME_IS_VALID (track->segment_start) &&
+        (!GST_CLOCK_TIME_IS_VALID (position) ||
+            track->segment_start < position))
+      position = track->segment_start;
+  }
+  GST_OBJECT_UNLOCK (demux);
+
+  return position;
+}
+
+static gboolean
+gst_hls_demux_select_streams (GstHlsDemux * demux, GstEvent * event)
+{
+  GstMessage *message;
+  GList *streams;
+  guint i;
+
+  if (!demux->collection || !demux->tracks) {
+    gst_event_unref (event);
+    return FALSE;
+  }
+
+  gst_event_parse_select_streams (event, &streams);
+
+  GST_DEBUG_OBJECT (demux, "select %u streams", g_list_length (streams));
+
+  message = gst_message_new_streams_selected (GST_OBJECT_CAST (demux),
+      demux->collection);
+  gst_message_set_seqnum (message, gst_event_get_seqnum (event));
+
+  g_mutex_lock (&demux->select_lock);
+
+  for (i = 0; i < demux->tracks->len; i++) {
+    GstHlsTrack *track = g_ptr_array_index (demux->tracks, i);
+    const gchar *stream_id = gst_stream_get_stream_id (track->gst_stream);
+    gboolean selected;
+
+    selected = g_list_find_custom (streams, stream_id,
+        (GCompareFunc) g_strcmp0) != NULL;
+
+    if (selected)
+      gst_message_streams_selected_add (message, track->gst_stream);
+
+    if (selected == track->selected)
+      continue;
+
+    GST_INFO_OBJECT (track->pad, "stream %s", selected ? "selected" :
+        "deselected");
+
+    track->selected = selected;
+  }
+
+  g_mutex_unlock (&demux->select_lock);
+
+  /* tracks selected again start where the others are downloading, before
+   * the deselected ones stop */
+  for (i = 0; i < demux->tracks->len; i++) {
+    GstHlsTrack *track = g_ptr_array_index (demux->tracks, i);
+    if (track->selected)
+      gst_hls_track_sync_downloading (track);
+  }
+  for (i = 0; i < demux->tracks->len; i++) {
+    GstHlsTrack *track = g_ptr_array_index (demux->tracks, i);
+    if (!track->selected)
+      gst_hls_track_sync_downloading (track);
+  }
+
+  g_list_free_full (streams, g_free);
+  gst_event_unref (event);
+
+  gst_element_post_message (GST_ELEMENT_CAST (demux), message);
+
+  return TRUE;
+}
+
+static gboolean
+gst_hls_demux_send_event (GstElement * element, GstEvent * event)
+{
+  GstHlsDemux *demux = GST_HLS_DEMUX (element);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_SELECT_STREAMS)
+    return gst_hls_demux_select_streams (demux, event);
+
+  return GST_ELEMENT_CLASS (parent_class)->send_event (element, event);
+}
+
 static gboolean
 gst_hls_demux_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
 {
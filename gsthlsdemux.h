@@ -23,12 +23,19 @@
 # define GST_HLS_DEMUX_H_
 
 #include "m3u8.h"
+#include "gsturidownloader.h"
 
 G_BEGIN_DECLS
 
 typedef struct _GstHlsDemux GstHlsDemux;
 typedef struct _GstHlsDemuxClass GstHlsDemuxClass;
 
+typedef enum
+{
+  GST_HLS_DEMUX_ABR_MODE_THROUGHPUT,
+  GST_HLS_DEMUX_ABR_MODE_BUFFER,
+} GstHlsDemuxAbrMode;
+
 struct _GstHlsDemux
 {
   GstBin parent;
@@ -46,6 +53,30 @@ struct _GstHlsDemux
   gboolean have_group_id;
   guint group_id;
 
+  guint prefetch_segments;
+  GstHlsDemuxAbrMode abr_mode;
+  GstClockTime min_buffering_time;
+  GstClockTime max_buffering_time;
+  gboolean decrypt_thread;
+
+  /* AES-128 keys shared by the tracks, by URI */
+  GHashTable *keys;
+  GMutex keys_lock;
+  GCond keys_cond;
+  guint last_key_id;
+
+  /* media playlist fetched while the master playlist is received */
+  GstUriDownloader *early_downloader;
+  GstM3U8Stream *early_stream;   /* fetch in progress */
+  GstM3U8Stream *early_tried;
+  guint early_id;                /* discards the results of stopped fetches */
+  GMutex early_lock;
+  GCond early_cond;
+
+  /* streams of the tracks, and lock for their selection */
+  GstStreamCollection *collection;
+  GMutex select_lock;
+
   GPtrArray *tracks;
 };
 
@@ -0,0 +1,642 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * gsthlssampleaes.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+
+#include "gsthlssampleaes.h"
+
+GST_DEBUG_CATEGORY_EXTERN (gst_hls_sample_aes_debug);
+#define GST_CAT_DEFAULT gst_hls_sample_aes_debug
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+
+#define STREAM_TYPE_AAC_ADTS 0x0f
+#define STREAM_TYPE_H264 0x1b
+#define STREAM_TYPE_AAC_ADTS_SAMPLE_AES 0xcf
+#define STREAM_TYPE_H264_SAMPLE_AES 0xdb
+
+/* NAL units up to that size are left in the clear */
+#define NAL_CLEAR_SIZE 48
+
+/* clear bytes at the start of encrypted NAL units and audio frames */
+#define NAL_LEADER_SIZE 32
+#define AUDIO_LEADER_SIZE 16
+
+/* NAL units have one encrypted block followed by up to 144 clear bytes */
+#define NAL_PATTERN_SIZE 160
+
+typedef struct {
+  guint8 *data;
+  gsize size;
+} Fragment;
+
+/* position in a list of fragments */
+typedef struct {
+  Fragment *fragments;
+  guint n_fragments;
+  guint index;
+  gsize offset;
+} Cursor;
+
+typedef struct {
+  guint8 stream_type;
+
+  /* Fragment, current PES packet */
+  GArray *fragments;
+} Stream;
+
+/* packet spanning several chunks, processed in a copy written back at the
+ * end */
+typedef struct {
+  guint8 data[TS_PACKET_SIZE];
+  GArray *parts;
+} SplitPacket;
+
+struct _GstHlsSampleAes {
+  guint8 key[16];
+  guint8 iv[16];
+  EVP_CIPHER_CTX ctx;
+
+  gint pmt_pid;
+  GHashTable *streams;
+};
+
+static void
+cursor_init (Cursor * c, GArray * fragments)
+{
+  c->fragments = (Fragment *) fragments->data;
+  c->n_fragments = fragments->len;
+  c->index = 0;
+  c->offset = 0;
+}
+
+static inline guint8
+cursor_read_byte (Cursor * c)
+{
+  guint8 b;
+
+  b = c->fragments[c->index].data[c->offset];
+  if (++c->offset == c->fragments[c->index].size) {
+    c->index++;
+    c->offset = 0;
+  }
+
+  return b;
+}
+
+static inline void
+cursor_write_byte (Cursor * c, guint8 b)
+{
+  c->fragments[c->index].data[c->offset] = b;
+  if (++c->offset == c->fragments[c->index].size) {
+    c->index++;
+    c->offset = 0;
+  }
+}
+
+/* read, write or skip data, stopping at the end of the fragments */
+static gboolean
+cursor_move (Cursor * c, guint8 * data, gsize size, gboolean write)
+{
+  gsize avail;
+
+  while (size > 0) {
+    if (c->index >= c->n_fragments)
+      return FALSE;
+
+    avail = MIN (size, c->fragments[c->index].size - c->offset);
+
+    if (data && write)
+      memcpy (c->fragments[c->index].data + c->offset, data, avail);
+    else if (data)
+      memcpy (data, c->fragments[c->index].data + c->offset, avail);
+
+    if (data)
+      data += avail;
+
+    size -= avail;
+    c->offset += avail;
+
+    if (c->offset == c->fragments[c->index].size) {
+      c->index++;
+      c->offset = 0;
+    }
+  }
+
+  return TRUE;
+}
+
+static guint32
+_crc32_mpeg (const guint8 * data, gsize size)
+{
+  guint32 crc = 0xffffffff;
+  guint i;
+
+  while (size--) {
+    crc ^= *data++ << 24;
+    for (i = 0; i < 8; i++)
+      crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+  }
+
+  return crc;
+}
+
+static void
+stream_free (Stream * stream)
+{
+  g_array_free (stream->fragments, TRUE);
+  g_free (stream);
+}
+
+GstHlsSampleAes *
+gst_hls_sample_aes_new (void)
+{
+  GstHlsSampleAes *dec;
+
+  dec = g_new0 (GstHlsSampleAes, 1);
+  EVP_CIPHER_CTX_init (&dec->ctx);
+  dec->pmt_pid = -1;
+  dec->streams = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) stream_free);
+
+  return dec;
+}
+
+void
+gst_hls_sample_aes_free (GstHlsSampleAes * dec)
+{
+  EVP_CIPHER_CTX_cleanup (&dec->ctx);
+  g_hash_table_unref (dec->streams);
+  g_free (dec);
+}
+
+void
+gst_hls_sample_aes_set_key (GstHlsSampleAes * dec, const guint8 * key,
+    const guint8 * iv)
+{
+  memcpy (dec->key, key, 16);
+  memcpy (dec->iv, iv, 16);
+
+  EVP_CipherInit_ex (&dec->ctx, EVP_aes_128_cbc (), NULL, key, iv,
+      AES_DECRYPT);
+  EVP_CIPHER_CTX_set_padding (&dec->ctx, 0);
+}
+
+static inline guint8
+_read_unescaped (Cursor * c, guint * zeros)
+{
+  guint8 b;
+
+  b = cursor_read_byte (c);
+  if (*zeros >= 2 && b == 0x03) {
+    *zeros = 0;
+    b = cursor_read_byte (c);
+  }
+
+  *zeros = b == 0 ? *zeros + 1 : 0;
+
+  return b;
+}
+
+/* encrypted NAL units are escaped after encryption. The unescaped data is
+ * decrypted and written back in place, the removed emulation prevention
+ * bytes are replaced by trailing zero bytes. */
+static void
+decrypt_nal (GstHlsSampleAes * dec, const Cursor * start, gsize size)
+{
+  Cursor r, w;
+  guint8 block[16];
+  gsize i, k, length, n_epb;
+  guint zeros;
+  gint outsize;
+  guint8 type;
+
+  type = start->fragments[start->index].data[start->offset] & 0x1f;
+  if ((type != 1 && type != 5) || size <= NAL_CLEAR_SIZE)
+    return;
+
+  r = *start;
+  zeros = 0;
+  n_epb = 0;
+
+  for (i = 0; i < size; i++) {
+    guint8 b = cursor_read_byte (&r);
+
+    if (zeros >= 2 && b == 0x03) {
+      n_epb++;
+      zeros = 0;
+    } else {
+      zeros = b == 0 ? zeros + 1 : 0;
+    }
+  }
+
+  length = size - n_epb;
+  if (length <= NAL_CLEAR_SIZE)
+    return;
+
+  EVP_CipherInit_ex (&dec->ctx, NULL, NULL, NULL, dec->iv, -1);
+
+  r = w = *start;
+  zeros = 0;
+
+  for (k = 0; k < length;) {
+    if (k >= NAL_LEADER_SIZE &&
+        (k - NAL_LEADER_SIZE) % NAL_PATTERN_SIZE == 0 && length - k >= 16) {
+      for (i = 0; i < 16; i++)
+        block[i] = _read_unescaped (&r, &zeros);
+
+      outsize = 16;
+      EVP_CipherUpdate (&dec->ctx, block, &outsize, block, 16);
+      cursor_move (&w, block, 16, TRUE);
+      k += 16;
+    } else {
+      cursor_write_byte (&w, _read_unescaped (&r, &zeros));
+      k++;
+    }
+  }
+
+  for (i = 0; i < n_epb; i++)
+    cursor_write_byte (&w, 0);
+}
+
+static void
+decrypt_h264 (GstHlsSampleAes * dec, Cursor * c, gsize size)
+{
+  Cursor nal;
+  gsize nal_pos = 0;
+  gboolean in_nal = FALSE;
+  guint zeros = 0;
+  gsize i;
+
+  for (i = 0; i < size; i++) {
+    guint8 b = cursor_read_byte (c);
+
+    if (b == 0x01 && zeros >= 2) {
+      if (in_nal && i - zeros > nal_pos)
+        decrypt_nal (dec, &nal, i - zeros - nal_pos);
+
+      nal = *c;
+      nal_pos = i + 1;
+      in_nal = TRUE;
+      zeros = 0;
+      continue;
+    }
+
+    zeros = b == 0 ? zeros + 1 : 0;
+  }
+
+  if (in_nal && size - zeros > nal_pos)
+    decrypt_nal (dec, &nal, size - zeros - nal_pos);
+}
+
+static void
+decrypt_adts (GstHlsSampleAes * dec, Cursor * c, gsize size)
+{
+  Cursor r, w;
+  guint8 header[7];
+  guint8 block[16];
+  gsize header_size, frame_size, n_blocks;
+  gint outsize;
+
+  while (size >= sizeof (header)) {
+    r = *c;
+    cursor_move (&r, header, sizeof (header), FALSE);
+
+    if (header[0] != 0xff || (header[1] & 0xf0) != 0xf0) {
+      GST_WARNING ("lost ADTS sync");
+      return;
+    }
+
+    header_size = (header[1] & 0x01) ? 7 : 9;
+    frame_size = ((header[3] & 0x03) << 11) | (header[4] << 3) |
+        (header[5] >> 5);
+
+    if (frame_size < header_size || frame_size > size)
+      return;
+
+    if (frame_size > header_size + AUDIO_LEADER_SIZE) {
+      n_blocks = (frame_size - header_size - AUDIO_LEADER_SIZE) / 16;
+
+      r = *c;
+      cursor_move (&r, NULL, header_size + AUDIO_LEADER_SIZE, FALSE);
+
+      EVP_CipherInit_ex (&dec->ctx, NULL, NULL, NULL, dec->iv, -1);
+
+      while (n_blocks--) {
+        w = r;
+        cursor_move (&r, block, 16, FALSE);
+        outsize = 16;
+        EVP_CipherUpdate (&dec->ctx, block, &outsize, block, 16);
+        cursor_move (&w, block, 16, TRUE);
+      }
+    }
+
+    cursor_move (c, NULL, frame_size, FALSE);
+    size -= frame_size;
+  }
+}
+
+static void
+process_pes (GstHlsSampleAes * dec, Stream * stream)
+{
+  Cursor c;
+  guint8 header[9];
+  gsize size = 0;
+  guint i;
+
+  for (i = 0; i < stream->fragments->len; i++)
+    size += g_array_index (stream->fragments, Fragment, i).size;
+
+  cursor_init (&c, stream->fragments);
+
+  if (!cursor_move (&c, header, sizeof (header), FALSE))
+    return;
+
+  if (header[0] != 0 || header[1] != 0 || header[2] != 1)
+    return;
+
+  if (size < sizeof (header) + header[8])
+    return;
+
+  cursor_move (&c, NULL, header[8], FALSE);
+  size -= sizeof (header) + header[8];
+
+  if (stream->stream_type == STREAM_TYPE_AAC_ADTS_SAMPLE_AES)
+    decrypt_adts (dec, &c, size);
+  else
+    decrypt_h264 (dec, &c, size);
+}
+
+static guint8 *
+_psi_section (guint8 * payload, gsize size, guint8 table_id,
+    gsize * section_size)
+{
+  guint8 *section;
+  gsize length;
+
+  if (size < 1 || payload[0] + 1 + 3 > size)
+    return NULL;
+
+  section = payload + 1 + payload[0];
+  size -= 1 + payload[0];
+
+  if (section[0] != table_id)
+    return NULL;
+
+  length = 3 + (((section[1] & 0x0f) << 8) | section[2]);
+  if (length > size || length < 12 + 4)
+    return NULL;
+
+  *section_size = length;
+
+  return section;
+}
+
+static void
+parse_pat (GstHlsSampleAes * dec, guint8 * payload, gsize size)
+{
+  guint8 *section;
+  gsize length, i;
+
+  section = _psi_section (payload, size, 0x00, &length);
+  if (!section)
+    return;
+
+  for (i = 8; i + 4 <= length - 4; i += 4) {
+    guint program = (section[i] << 8) | section[i + 1];
+
+    if (program != 0) {
+      dec->pmt_pid = ((section[i + 2] & 0x1f) << 8) | section[i + 3];
+      break;
+    }
+  }
+}
+
+static void
+parse_pmt (GstHlsSampleAes * dec, guint8 * payload, gsize size)
+{
+  guint8 *section;
+  gsize length, end, i;
+  gboolean modified = FALSE;
+
+  section = _psi_section (payload, size, 0x02, &length);
+  if (!section)
+    return;
+
+  end = length - 4;
+  i = 12 + (((section[10] & 0x0f) << 8) | section[11]);
+
+  while (i + 5 <= end) {
+    guint8 clear_type = 0;
+    guint pid;
+
+    pid = ((section[i + 1] & 0x1f) << 8) | section[i + 2];
+
+    switch (section[i]) {
+      case STREAM_TYPE_H264_SAMPLE_AES:
+        clear_type = STREAM_TYPE_H264;
+        break;
+      case STREAM_TYPE_AAC_ADTS_SAMPLE_AES:
+        clear_type = STREAM_TYPE_AAC_ADTS;
+        break;
+      default:
+        break;
+    }
+
+    if (clear_type) {
+      if (!g_hash_table_contains (dec->streams, GUINT_TO_POINTER (pid))) {
+        Stream *stream = g_new0 (Stream, 1);
+
+        GST_DEBUG ("encrypted stream type 0x%02x on pid 0x%04x",
+            section[i], pid);
+
+        stream->stream_type = section[i];
+        stream->fragments = g_array_new (FALSE, FALSE, sizeof (Fragment));
+        g_hash_table_insert (dec->streams, GUINT_TO_POINTER (pid), stream);
+      }
+
+      section[i] = clear_type;
+      modified = TRUE;
+    }
+
+    i += 5 + (((section[i + 3] & 0x0f) << 8) | section[i + 4]);
+  }
+
+  if (modified)
+    GST_WRITE_UINT32_BE (section + end, _crc32_mpeg (section, end));
+}
+
+static void
+process_packet (GstHlsSampleAes * dec, guint8 * packet)
+{
+  Stream *stream;
+  Fragment fragment;
+  guint8 *payload;
+  gsize size;
+  gboolean pusi;
+  guint pid;
+
+  pusi = (packet[1] & 0x40) != 0;
+  pid = ((packet[1] & 0x1f) << 8) | packet[2];
+
+  /* no payload */
+  if (!(packet[3] & 0x10))
+    return;
+
+  payload = packet + 4;
+  size = TS_PACKET_SIZE - 4;
+
+  if (packet[3] & 0x20) {
+    if (payload[0] >= size)
+      return;
+
+    size -= 1 + payload[0];
+    payload += 1 + payload[0];
+  }
+
+  if (size == 0)
+    return;
+
+  if (pid == 0) {
+    if (pusi)
+      parse_pat (dec, payload, size);
+    return;
+  }
+
+  if ((gint) pid == dec->pmt_pid) {
+    if (pusi)
+      parse_pmt (dec, payload, size);
+    return;
+  }
+
+  stream = g_hash_table_lookup (dec->streams, GUINT_TO_POINTER (pid));
+  if (!stream)
+    return;
+
+  if (pusi) {
+    if (stream->fragments->len > 0)
+      process_pes (dec, stream);
+    g_array_set_size (stream->fragments, 0);
+  } else if (stream->fragments->len == 0) {
+    /* not in a PES packet */
+    return;
+  }
+
+  fragment.data = payload;
+  fragment.size = size;
+  g_array_append_val (stream->fragments, fragment);
+}
+
+gboolean
+gst_hls_sample_aes_decrypt (GstHlsSampleAes * dec, GstMapInfo * maps,
+    guint n_maps)
+{
+  GHashTableIter iter;
+  GSList *splits = NULL;
+  SplitPacket *split;
+  Stream *stream;
+  gboolean ret = TRUE;
+  guint8 *packet;
+  gsize offset = 0;
+  guint i = 0, j;
+
+  while (TRUE) {
+    while (i < n_maps && offset == maps[i].size) {
+      i++;
+      offset = 0;
+    }
+
+    if (i == n_maps)
+      break;
+
+    if (maps[i].size - offset >= TS_PACKET_SIZE) {
+      packet = maps[i].data + offset;
+      offset += TS_PACKET_SIZE;
+    } else {
+      Fragment part;
+      gsize filled = 0;
+
+      split = g_new (SplitPacket, 1);
+      split->parts = g_array_new (FALSE, FALSE, sizeof (Fragment));
+      splits = g_slist_prepend (splits, split);
+
+      while (filled < TS_PACKET_SIZE && i < n_maps) {
+        part.data = maps[i].data + offset;
+        part.size = MIN (maps[i].size - offset, TS_PACKET_SIZE - filled);
+
+        if (part.size > 0) {
+          memcpy (split->data + filled, part.data, part.size);
+          g_array_append_val (split->parts, part);
+          filled += part.size;
+          offset += part.size;
+        }
+
+        if (offset == maps[i].size) {
+          i++;
+          offset = 0;
+        }
+      }
+
+      if (filled < TS_PACKET_SIZE) {
+        GST_WARNING ("truncated packet at end of segment");
+        break;
+      }
+
+      packet = split->data;
+    }
+
+    if (packet[0] != TS_SYNC_BYTE) {
+      GST_WARNING ("lost packet sync");
+      ret = FALSE;
+      break;
+    }
+
+    process_packet (dec, packet);
+  }
+
+  g_hash_table_iter_init (&iter, dec->streams);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) & stream)) {
+    if (stream->fragments->len > 0)
+      process_pes (dec, stream);
+    g_array_set_size (stream->fragments, 0);
+  }
+
+  while (splits) {
+    split = splits->data;
+    offset = 0;
+
+    for (j = 0; j < split->parts->len; j++) {
+      Fragment *part = &g_array_index (split->parts, Fragment, j);
+
+      memcpy (part->data, split->data + offset, part->size);
+      offset += part->size;
+    }
+
+    g_array_free (split->parts, TRUE);
+    g_free (split);
+    splits = g_slist_delete_link (splits, splits);
+  }
+
+  return ret;
+}
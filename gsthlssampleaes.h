@@ -0,0 +1,46 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * gsthlssampleaes.h
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef GSTHLSSAMPLEAES_H_
+# define GSTHLSSAMPLEAES_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstHlsSampleAes GstHlsSampleAes;
+
+GstHlsSampleAes *gst_hls_sample_aes_new (void);
+void gst_hls_sample_aes_free (GstHlsSampleAes * dec);
+
+void gst_hls_sample_aes_set_key (GstHlsSampleAes * dec, const guint8 * key,
+    const guint8 * iv);
+
+/* decrypt the H.264 and ADTS AAC samples of a MPEG-TS segment in place. The
+ * segment data is given as a list of mapped chunks, which do not need to be
+ * aligned on packet boundaries. Encrypted stream types are replaced in the
+ * PMT by their clear equivalent. */
+gboolean gst_hls_sample_aes_decrypt (GstHlsSampleAes * dec, GstMapInfo * maps,
+    guint n_maps);
+
+G_END_DECLS
+
+#endif /* GSTHLSSAMPLEAES_H_ */
@@ -31,6 +31,45 @@ GST_STATIC_PAD_TEMPLATE ("sink",
 #define GST_CAT_DEFAULT uridownloader_debug
 GST_DEBUG_CATEGORY (uridownloader_debug);
 
+/* HTTP session shared by the source elements of all downloaders, so that
+ * open connections are reused across fetches. It is released with the last
+ * downloader. */
+static GMutex session_lock;
+static guint session_users;
+static GstContext *session_context;
+
+/* fetches are I/O bound, allow a few per core */
+#define FETCH_SLOTS_PER_CPU 4
+
+/* fetch scheduler shared by all downloaders of the process. The waiting
+ * downloaders are queued so that slots are granted in request order. */
+static GMutex fetch_lock;
+static GCond fetch_cond;
+static GQueue fetch_waiters = G_QUEUE_INIT;
+static guint fetch_slots;
+static guint fetch_active;
+
+/* downloader whose chain function runs in the current thread */
+static GPrivate fetch_chain_downloader;
+
+/* worker threads running asynchronous fetches, one per fetch slot. Fetches
+ * do not depend on each other, so a queued fetch always gets a worker. */
+static GThreadPool *async_pool;
+
+typedef struct {
+  GstUriDownloader *downloader;
+  gchar *uri;
+  gint64 range_start;
+  gint64 range_end;
+  GstUriDownloaderChainFunction chain_func;
+  GstUriDownloaderDoneFunction done_func;
+  GstUriDownloaderFetchFunction fetch_func;
+  gpointer user_data;
+} GstUriDownloaderJob;
+
+static void gst_uri_downloader_job_func (GstUriDownloaderJob * job,
+    gpointer unused);
+
 static void gst_uri_downloader_finalize (GObject * object);
 static void gst_uri_downloader_dispose (GObject * object);
 
@@ -70,6 +109,10 @@ gst_uri_downloader_init (GstUriDownloader * downloader)
 
   g_mutex_init (&downloader->download_lock);
   g_cond_init (&downloader->cond);
+
+  g_mutex_lock (&session_lock);
+  session_users++;
+  g_mutex_unlock (&session_lock);
 }
 
 static void
@@ -108,6 +151,13 @@ gst_uri_downloader_finalize (GObject * object)
   g_mutex_clear (&downloader->download_lock);
   g_cond_clear (&downloader->cond);
 
+  g_mutex_lock (&session_lock);
+  if (--session_users == 0 && session_context) {
+    gst_context_unref (session_context);
+    session_context = NULL;
+  }
+  g_mutex_unlock (&session_lock);
+
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
@@ -144,7 +194,34 @@ gst_uri_downloader_bus_handler (GstBus * bus,
 {
   GstUriDownloader *downloader = (GstUriDownloader *) (data);
 
-  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR ||
+  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_HAVE_CONTEXT) {
+    GstContext *context;
+
+    gst_message_parse_have_context (message, &context);
+
+    g_mutex_lock (&session_lock);
+    if (!session_context) {
+      GST_DEBUG_OBJECT (downloader, "sharing context %s",
+          gst_context_get_context_type (context));
+      session_context = context;
+    } else {
+      gst_context_unref (context);
+    }
+    g_mutex_unlock (&session_lock);
+
+  } else if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_NEED_CONTEXT) {
+    const gchar *context_type;
+
+    gst_message_parse_context_type (message, &context_type);
+
+    g_mutex_lock (&session_lock);
+    if (session_context && !g_strcmp0 (context_type,
+            gst_context_get_context_type (session_context)))
+      gst_element_set_context (GST_ELEMENT (GST_MESSAGE_SRC (message)),
+          session_context);
+    g_mutex_unlock (&session_lock);
+
+  } else if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR ||
       GST_MESSAGE_TYPE (message) == GST_MESSAGE_WARNING) {
     GError *err = NULL;
     gchar *dbg_info = NULL;
@@ -180,14 +257,98 @@ gst_uri_downloader_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
   GST_LOG_OBJECT (downloader, "got %" G_GSIZE_FORMAT " bytes buffer",
       gst_buffer_get_size (buf));
 
-  if (downloader->chain)
+  if (downloader->chain) {
+    g_private_set (&fetch_chain_downloader, downloader);
     ret = downloader->chain (buf, downloader->priv);
-  else
+    g_private_set (&fetch_chain_downloader, NULL);
+  } else {
     ret = GST_FLOW_OK;
+  }
 
   return ret;
 }
 
+static guint
+gst_uri_downloader_get_fetch_slots (void)
+{
+  static gsize init = 0;
+
+  if (g_once_init_enter (&init)) {
+    fetch_slots = FETCH_SLOTS_PER_CPU * g_get_num_processors ();
+    g_once_init_leave (&init, 1);
+  }
+
+  return fetch_slots;
+}
+
+/* wait for a free fetch slot, or for the download to be cancelled */
+static void
+gst_uri_downloader_acquire_slot (GstUriDownloader * downloader)
+{
+  guint slots = gst_uri_downloader_get_fetch_slots ();
+  gboolean cancelled;
+
+  g_mutex_lock (&fetch_lock);
+  if (downloader->has_slot) {
+    g_mutex_unlock (&fetch_lock);
+    return;
+  }
+
+  g_queue_push_tail (&fetch_waiters, downloader);
+
+  for (;;) {
+    if (fetch_active < slots &&
+        g_queue_peek_head (&fetch_waiters) == downloader) {
+      fetch_active++;
+      downloader->has_slot = TRUE;
+      break;
+    }
+
+    GST_OBJECT_LOCK (downloader);
+    cancelled = downloader->cancelled;
+    GST_OBJECT_UNLOCK (downloader);
+    if (cancelled)
+      break;
+
+    g_cond_wait (&fetch_cond, &fetch_lock);
+  }
+
+  /* the next waiter may be served */
+  g_queue_remove (&fetch_waiters, downloader);
+  g_cond_broadcast (&fetch_cond);
+  g_mutex_unlock (&fetch_lock);
+}
+
+static void
+gst_uri_downloader_release_slot (GstUriDownloader * downloader)
+{
+  g_mutex_lock (&fetch_lock);
+  if (downloader->has_slot) {
+    downloader->has_slot = FALSE;
+    fetch_active--;
+    g_cond_broadcast (&fetch_cond);
+  }
+  g_mutex_unlock (&fetch_lock);
+}
+
+void
+gst_uri_downloader_yield_slot (void)
+{
+  GstUriDownloader *downloader = g_private_get (&fetch_chain_downloader);
+
+  if (downloader)
+    gst_uri_downloader_release_slot (downloader);
+}
+
+void
+gst_uri_downloader_reclaim_slot (void)
+{
+  GstUriDownloader *downloader = g_private_get (&fetch_chain_downloader);
+
+  if (downloader)
+    gst_uri_downloader_acquire_slot (downloader);
+}
+
 static void
 gst_uri_downloader_stop (GstUriDownloader * downloader)
 {
@@ -211,6 +372,19 @@ gst_uri_downloader_cancel (GstUriDownloader * downloader)
   downloader->cancelled = TRUE;
   g_cond_signal (&downloader->cond);
   GST_OBJECT_UNLOCK (downloader);
+
+  /* the download may be waiting for a fetch slot */
+  g_mutex_lock (&fetch_lock);
+  g_cond_broadcast (&fetch_cond);
+  g_mutex_unlock (&fetch_lock);
+}
+
+void
+gst_uri_downloader_reset (GstUriDownloader * downloader)
+{
+  GST_OBJECT_LOCK (downloader);
+  downloader->cancelled = FALSE;
+  GST_OBJECT_UNLOCK (downloader);
 }
 
 static gboolean
@@ -263,10 +437,17 @@ gst_uri_downloader_set_uri (GstUriDownloader * downloader, const gchar * uri)
     return FALSE;
   }
 
-  /* add a sync handler for the bus messages to detect errors */
+  /* keep connections open between fetches */
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (downloader->urisrc),
+          "keep-alive"))
+    g_object_set (downloader->urisrc, "keep-alive", TRUE, NULL);
+
+  g_mutex_lock (&session_lock);
+  if (session_context)
+    gst_element_set_context (downloader->urisrc, session_context);
+  g_mutex_unlock (&session_lock);
+
   gst_element_set_bus (downloader->urisrc, downloader->bus);
-  gst_bus_set_sync_handler (downloader->bus,
-      gst_uri_downloader_bus_handler, downloader, NULL);
 
   pad = gst_element_get_static_pad (downloader->urisrc, "src");
   gst_pad_link_full (pad, downloader->pad, GST_PAD_LINK_CHECK_NOTHING);
@@ -285,6 +466,9 @@ gst_uri_downloader_stream_uri (GstUriDownloader * downloader,
   GST_INFO_OBJECT (downloader, "fetching URI %s", uri);
 
   g_mutex_lock (&downloader->download_lock);
+
+  gst_uri_downloader_acquire_slot (downloader);
+
   downloader->chain = chain_func;
   downloader->priv = user_data;
   downloader->eos = FALSE;
@@ -300,7 +484,11 @@ gst_uri_downloader_stream_uri (GstUriDownloader * downloader,
     goto quit;
   }
 
+  /* add a sync handler for the bus messages to detect errors and share
+   * the HTTP session */
   gst_bus_set_flushing (downloader->bus, FALSE);
+  gst_bus_set_sync_handler (downloader->bus,
+      gst_uri_downloader_bus_handler, downloader, NULL);
   GST_OBJECT_UNLOCK (downloader);
 
   /* set to ready state first to allow setting range */
@@ -357,6 +545,8 @@ quit:
     downloader->cancelled = FALSE;
     gst_uri_downloader_stop (downloader);
     GST_OBJECT_UNLOCK (downloader);
+
+    gst_uri_downloader_release_slot (downloader);
     g_mutex_unlock (&downloader->download_lock);
 
     return ret;
@@ -373,7 +563,7 @@ _download_chain (GstBuffer * buffer, gpointer user_data)
   dl_context *ctx = user_data;
 
   if (ctx->buffer)
-    gst_buffer_append (ctx->buffer, buffer);
+    ctx->buffer = gst_buffer_append (ctx->buffer, buffer);
   else
     ctx->buffer = buffer;
 
@@ -392,3 +582,87 @@ gst_uri_downloader_fetch_uri (GstUriDownloader * downloader,
 
   return ctx.buffer;
 }
+
+static void
+gst_uri_downloader_job_func (GstUriDownloaderJob * job, gpointer unused)
+{
+  if (job->fetch_func) {
+    GstBuffer *buffer;
+
+    buffer = gst_uri_downloader_fetch_uri (job->downloader, job->uri,
+        job->range_start, job->range_end);
+    job->fetch_func (buffer, job->user_data);
+  } else {
+    gboolean ret;
+
+    ret = gst_uri_downloader_stream_uri (job->downloader, job->uri,
+        job->range_start, job->range_end, job->chain_func, job->user_data);
+    if (job->done_func)
+      job->done_func (ret, job->user_data);
+  }
+
+  gst_object_unref (job->downloader);
+  g_free (job->uri);
+  g_free (job);
+}
+
+static GThreadPool *
+gst_uri_downloader_get_async_pool (void)
+{
+  static gsize init = 0;
+
+  if (g_once_init_enter (&init)) {
+    async_pool = g_thread_pool_new ((GFunc) gst_uri_downloader_job_func,
+        NULL, gst_uri_downloader_get_fetch_slots (), FALSE, NULL);
+    g_once_init_leave (&init, 1);
+  }
+
+  return async_pool;
+}
+
+static void
+gst_uri_downloader_push_job (GstUriDownloader * downloader,
+    const gchar * uri, gint64 range_start, gint64 range_end,
+    GstUriDownloaderChainFunction chain_func,
+    GstUriDownloaderDoneFunction done_func,
+    GstUriDownloaderFetchFunction fetch_func, gpointer user_data)
+{
+  GstUriDownloaderJob *job;
+
+  job = g_new (GstUriDownloaderJob, 1);
+  job->downloader = gst_object_ref (downloader);
+  job->uri = g_strdup (uri);
+  job->range_start = range_start;
+  job->range_end = range_end;
+  job->chain_func = chain_func;
+  job->done_func = done_func;
+  job->fetch_func = fetch_func;
+  job->user_data = user_data;
+
+  g_thread_pool_push (gst_uri_downloader_get_async_pool (), job, NULL);
+}
+
+void
+gst_uri_downloader_stream_uri_async (GstUriDownloader * downloader,
+    const gchar * uri, gint64 range_start, gint64 range_end,
+    GstUriDownloaderChainFunction chain_func,
+    GstUriDownloaderDoneFunction done_func, gpointer user_data)
+{
+  GST_DEBUG_OBJECT (downloader, "queue fetch of URI %s", uri);
+
+  gst_uri_downloader_push_job (downloader, uri, range_start, range_end,
+      chain_func, done_func, NULL, user_data);
+}
+
+void
+gst_uri_downloader_fetch_uri_async (GstUriDownloader * downloader,
+    const gchar * uri, gint64 range_start, gint64 range_end,
+    GstUriDownloaderFetchFunction fetch_func, gpointer user_data)
+{
+  g_return_if_fail (fetch_func != NULL);
+
+  GST_DEBUG_OBJECT (downloader, "queue fetch of URI %s", uri);
+
+  gst_uri_downloader_push_job (downloader, uri, range_start, range_end,
+      NULL, NULL, fetch_func, user_data);
+}
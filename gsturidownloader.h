@@ -33,6 +33,12 @@ typedef struct _GstUriDownloaderClass GstUriDownloaderClass;
 typedef GstFlowReturn (*GstUriDownloaderChainFunction)
   (GstBuffer * buffer, gpointer user_data);
 
+typedef void (*GstUriDownloaderDoneFunction)
+  (gboolean success, gpointer user_data);
+
+typedef void (*GstUriDownloaderFetchFunction)
+  (GstBuffer * buffer, gpointer user_data);
+
 struct _GstUriDownloader
 {
   GstObject parent;
@@ -46,6 +52,9 @@ struct _GstUriDownloader
   gboolean cancelled;
   gboolean eos;
 
+  /* holds a slot of the fetch scheduler, protected by its lock */
+  gboolean has_slot;
+
   GstUriDownloaderChainFunction chain;
   gpointer priv;
 };
@@ -60,6 +69,17 @@ GType gst_uri_downloader_get_type (void);
 GstUriDownloader *gst_uri_downloader_new (void);
 void gst_uri_downloader_cancel (GstUriDownloader *downloader);
 
+/* a cancel received while no fetch is running fails the next fetch, clear
+ * it before using the downloader again */
+void gst_uri_downloader_reset (GstUriDownloader *downloader);
+
+/* all the fetches of the process share a bounded number of slots, granted
+ * in request order. A chain function about to wait for its consumer gives
+ * the slot of its fetch back meanwhile, so that the other fetches are not
+ * blocked behind it. Both do nothing outside of a chain function. */
+void gst_uri_downloader_yield_slot (void);
+void gst_uri_downloader_reclaim_slot (void);
+
 gboolean gst_uri_downloader_stream_uri (GstUriDownloader * downloader,
     const gchar * uri, gint64 range_start, gint64 range_end,
     GstUriDownloaderChainFunction chain_func, gpointer user_data);
@@ -67,6 +87,20 @@ gboolean gst_uri_downloader_stream_uri (GstUriDownloader * downloader,
 GstBuffer *gst_uri_downloader_fetch_uri (GstUriDownloader * downloader,
     const gchar * uri, gint64 range_start, gint64 range_end);
 
+/* asynchronous variants, returning immediately. The fetch runs on a worker
+ * thread, which also calls the done and fetch callbacks. Fetches on the
+ * same downloader never overlap, but are not necessarily run in the order
+ * they were queued. The workers are shared by the whole process and there
+ * are as many as fetch slots. */
+void gst_uri_downloader_stream_uri_async (GstUriDownloader * downloader,
+    const gchar * uri, gint64 range_start, gint64 range_end,
+    GstUriDownloaderChainFunction chain_func,
+    GstUriDownloaderDoneFunction done_func, gpointer user_data);
+
+void gst_uri_downloader_fetch_uri_async (GstUriDownloader * downloader,
+    const gchar * uri, gint64 range_start, gint64 range_end,
+    GstUriDownloaderFetchFunction fetch_func, gpointer user_data);
+
 #define GST_TYPE_URI_DOWNLOADER \
   (gst_uri_downloader_get_type())
 #define GST_URI_DOWNLOADER(obj) \
@@ -20,6 +20,7 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -28,7 +29,7 @@
 GST_DEBUG_CATEGORY_EXTERN (gst_hls_m3u8);
 #define GST_CAT_DEFAULT gst_hls_m3u8
 
-#define GST_M3U8_VERSION 5
+#define GST_M3U8_VERSION 9
 
 typedef struct {
   GstM3U8Media *medias;
@@ -146,11 +147,32 @@ static void
 gst_m3u8_key_free (GstM3U8Key * key)
 {
   g_free (key->uri);
+  g_free (key->iv);
   g_free (key);
 }
 
+static GstM3U8Part *
+gst_m3u8_part_new (void)
+{
+  GstM3U8Part *part;
+
+  part = g_new0 (GstM3U8Part, 1);
+  part->duration = GST_CLOCK_TIME_NONE;
+  part->offset = 0;
+  part->length = -1;
+
+  return part;
+}
+
+static void
+gst_m3u8_part_free (GstM3U8Part * part)
+{
+  g_free (part->uri);
+  g_free (part);
+}
+
 static GstM3U8Segment *
-gst_m3u8_segment_new (gchar * uri, GstClockTime duration, guint sequence)
+gst_m3u8_segment_new (gchar * uri, GstClockTime duration, gint sequence)
 {
   GstM3U8Segment *segment;
 
@@ -163,6 +185,7 @@ gst_m3u8_segment_new (gchar * uri, GstClockTime duration, guint sequence)
   segment->discont = FALSE;
   segment->key = NULL;
   segment->map = NULL;
+  segment->parts = NULL;
 
   return segment;
 }
@@ -170,12 +193,14 @@ gst_m3u8_segment_new (gchar * uri, GstClockTime duration, guint sequence)
 static void
 gst_m3u8_segment_free (GstM3U8Segment * segment)
 {
+  if (segment->parts)
+    g_ptr_array_unref (segment->parts);
   g_free (segment->uri);
   g_free (segment);
 }
 
 static void
-gst_m3u8_playlist_reset (GstM3U8Playlist * playlist)
+gst_m3u8_playlist_reset_tags (GstM3U8Playlist * playlist)
 {
   playlist->version = 0;
   playlist->type = GST_M3U8_PLAYLIST_TYPE_NONE;
@@ -183,14 +208,39 @@ gst_m3u8_playlist_reset (GstM3U8Playlist * playlist)
   playlist->allow_cache = FALSE;
   playlist->media_sequence = 0;
   playlist->target_duration = GST_CLOCK_TIME_NONE;
+  playlist->part_target = GST_CLOCK_TIME_NONE;
+  playlist->can_block_reload = FALSE;
+  playlist->can_skip_until = GST_CLOCK_TIME_NONE;
+  playlist->hold_back = GST_CLOCK_TIME_NONE;
+  playlist->part_hold_back = GST_CLOCK_TIME_NONE;
   playlist->i_frames_only = FALSE;
-  playlist->datetime = NULL;
   playlist->download_ts = GST_CLOCK_TIME_NONE;
 
-  if (playlist->segments != NULL) {
-    g_slist_free_full (playlist->segments,
-        (GDestroyNotify) gst_m3u8_segment_free);
-    playlist->segments = NULL;
+  if (playlist->datetime) {
+    gst_date_time_unref (playlist->datetime);
+    playlist->datetime = NULL;
+  }
+
+  if (playlist->preload_hint) {
+    gst_m3u8_part_free (playlist->preload_hint);
+    playlist->preload_hint = NULL;
+  }
+}
+
+static void
+gst_m3u8_playlist_reset (GstM3U8Playlist * playlist)
+{
+  gst_m3u8_playlist_reset_tags (playlist);
+
+  if (playlist->segments != NULL)
+    g_ptr_array_set_size (playlist->segments, 0);
+
+  if (playlist->start_times != NULL)
+    g_array_set_size (playlist->start_times, 0);
+
+  if (playlist->parts != NULL) {
+    g_ptr_array_unref (playlist->parts);
+    playlist->parts = NULL;
   }
 
   if (playlist->maps != NULL) {
@@ -205,15 +255,12 @@ gst_m3u8_playlist_reset (GstM3U8Playlist * playlist)
     playlist->keys = NULL;
   }
 
-  if (playlist->datetime) {
-    gst_date_time_unref (playlist->datetime);
-    playlist->datetime = NULL;
-  }
-
-  if (playlist->digest) {
-    g_free (playlist->digest);
-    playlist->digest = NULL;
-  }
+  g_free (playlist->data_last_uri);
+  playlist->data_last_uri = NULL;
+  playlist->data_size = 0;
+  playlist->data_sequence = 0;
+  playlist->data_hash = 0;
+  playlist->data_hashed = FALSE;
 }
 
 static GstM3U8Playlist *
@@ -222,6 +269,9 @@ gst_m3u8_playlist_new (void)
   GstM3U8Playlist *playlist;
 
   playlist = g_new0 (GstM3U8Playlist, 1);
+  playlist->segments = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_m3u8_segment_free);
+  playlist->start_times = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
   gst_m3u8_playlist_reset (playlist);
 
   return playlist;
@@ -231,6 +281,8 @@ static void
 gst_m3u8_playlist_free (GstM3U8Playlist * playlist)
 {
   gst_m3u8_playlist_reset (playlist);
+  g_ptr_array_unref (playlist->segments);
+  g_array_unref (playlist->start_times);
   g_free (playlist->uri);
   g_free (playlist);
 }
@@ -238,18 +290,189 @@ gst_m3u8_playlist_free (GstM3U8Playlist * playlist)
 GstM3U8Segment *
 gst_m3u8_playlist_get_segment (GstM3U8Playlist * playlist, gint sequence)
 {
-  GstM3U8Segment *segment;
-  GSList *list;
+  GstM3U8Segment *first;
+  gint index;
+
+  if (playlist->segments->len == 0)
+    return NULL;
+
+  /* segment sequences are contiguous, so the index is found directly */
+  first = g_ptr_array_index (playlist->segments, 0);
+  index = MAX (sequence - first->sequence, 0);
+
+  if (index >= (gint) playlist->segments->len)
+    return NULL;
+
+  return g_ptr_array_index (playlist->segments, index);
+}
+
+GstM3U8Segment *
+gst_m3u8_playlist_find_segment (GstM3U8Playlist * playlist,
+    GstClockTime position, gboolean snap_after, GstClockTime * start)
+{
+  GstClockTime *start_times;
+  guint low, high, index;
+
+  if (playlist->segments->len == 0)
+    return NULL;
+
+  start_times = (GstClockTime *) playlist->start_times->data;
+
+  /* find the last segment starting at or before the position */
+  low = 0;
+  high = playlist->segments->len;
+
+  while (high - low > 1) {
+    guint mid = low + (high - low) / 2;
+    if (start_times[mid] <= position)
+      low = mid;
+    else
+      high = mid;
+  }
 
-  for (list = playlist->segments; list != NULL; list = list->next) {
-    segment = (GstM3U8Segment *) list->data;
-    if (segment->sequence >= sequence)
-      return segment;
+  index = low;
+
+  if (snap_after) {
+    if (start_times[index] < position)
+      index++;
+  } else if (position >= playlist->duration) {
+    return NULL;
   }
 
+  if (index >= playlist->segments->len)
+    return NULL;
+
+  if (start)
+    *start = start_times[index];
+
+  return g_ptr_array_index (playlist->segments, index);
+}
+
+GstClockTime
+gst_m3u8_playlist_get_segment_start (GstM3U8Playlist * playlist,
+    GstM3U8Segment * segment)
+{
+  GstM3U8Segment *first;
+  guint index;
+
+  if (playlist->segments->len == 0)
+    return GST_CLOCK_TIME_NONE;
+
+  first = g_ptr_array_index (playlist->segments, 0);
+  index = segment->sequence - first->sequence;
+
+  if (index >= playlist->start_times->len)
+    return GST_CLOCK_TIME_NONE;
+
+  return g_array_index (playlist->start_times, GstClockTime, index);
+}
+
+static GPtrArray *
+gst_m3u8_playlist_get_parts (GstM3U8Playlist * playlist, gint sequence)
+{
+  GstM3U8Segment *segment;
+
+  if (sequence == playlist->parts_sequence)
+    return playlist->parts;
+
+  segment = gst_m3u8_playlist_get_segment (playlist, sequence);
+  if (segment && segment->sequence == sequence)
+    return segment->parts;
+
   return NULL;
 }
 
+/* get a part of a segment, which may not be complete yet */
+GstM3U8Part *
+gst_m3u8_playlist_get_part (GstM3U8Playlist * playlist, gint sequence,
+    guint index)
+{
+  GPtrArray *parts;
+
+  parts = gst_m3u8_playlist_get_parts (playlist, sequence);
+  if (parts == NULL || index >= parts->len)
+    return NULL;
+
+  return g_ptr_array_index (parts, index);
+}
+
+/* find the part to start a low-latency live playlist from, at least
+ * PART-HOLD-BACK from the end of the playlist. Playback must start on an
+ * independent part, and encrypted segments are always downloaded from the
+ * start. Returns FALSE if the playlist has no parts. */
+gboolean
+gst_m3u8_playlist_get_live_start (GstM3U8Playlist * playlist,
+    gint * sequence, guint * part)
+{
+  GstClockTime hold_back, duration;
+  GstM3U8Segment *segment;
+  GPtrArray *parts;
+  gint seq, first, best_seq;
+  guint i, best_part;
+
+  if (!GST_CLOCK_TIME_IS_VALID (playlist->part_target))
+    return FALSE;
+
+  hold_back = playlist->part_hold_back;
+  if (!GST_CLOCK_TIME_IS_VALID (hold_back))
+    hold_back = 3 * playlist->part_target;
+
+  first = playlist->media_sequence;
+  if (playlist->segments->len > 0) {
+    segment = g_ptr_array_index (playlist->segments, 0);
+    first = segment->sequence;
+  }
+
+  duration = 0;
+  best_seq = -1;
+  best_part = 0;
+
+  for (seq = playlist->parts_sequence; seq >= first; seq--) {
+    parts = gst_m3u8_playlist_get_parts (playlist, seq);
+
+    if (parts == NULL || parts->len == 0) {
+      /* segments without parts can only be started from the beginning */
+      segment = gst_m3u8_playlist_get_segment (playlist, seq);
+      if (segment == NULL || segment->sequence != seq)
+        continue;
+
+      duration += segment->duration;
+      if (duration >= hold_back) {
+        best_seq = seq;
+        best_part = 0;
+        break;
+      }
+      continue;
+    }
+
+    for (i = parts->len; i > 0; i--) {
+      GstM3U8Part *p = g_ptr_array_index (parts, i - 1);
+
+      duration += p->duration;
+      if (duration < hold_back)
+        continue;
+
+      if (i - 1 == 0 || (p->independent && (p->key == NULL ||
+                  p->key->method == GST_M3U8_KEY_METHOD_NONE))) {
+        best_seq = seq;
+        best_part = i - 1;
+        break;
+      }
+    }
+
+    if (best_seq >= 0)
+      break;
+  }
+
+  if (best_seq < 0)
+    return FALSE;
+
+  *sequence = best_seq;
+  *part = best_part;
+
+  return TRUE;
+}
+
 static GstM3U8Media *
 gst_m3u8_media_new (void)
 {
@@ -436,20 +659,48 @@ parse_double (gchar * ptr, gchar ** endptr, gdouble * val)
   return end != ptr;
 }
 
-static gchar *
-parse_line (gchar *data)
+/* get the next line of the data, without end of line characters. The
+ * returned line is not NUL-terminated. */
+static gboolean
+read_line (const gchar ** data, const gchar * end, const gchar ** line,
+    gsize * length)
 {
-  gchar *endl;
+  const gchar *endl;
 
-  endl = strchr (data, '\n');
-  if (endl) {
-    *endl = '\0';
-    if (endl > data && endl[-1] == '\r')
-      endl[-1] = '\0';
-    endl++;
-  }
+  if (*data >= end)
+    return FALSE;
+
+  *line = *data;
+
+  endl = memchr (*data, '\n', end - *data);
+  if (endl)
+    *data = endl + 1;
+  else
+    *data = endl = end;
+
+  if (endl > *line && endl[-1] == '\r')
+    endl--;
+
+  *length = endl - *line;
+
+  return TRUE;
+}
+
+static gboolean
+line_equals (const gchar * line, gsize length, const gchar * str)
+{
+  return strlen (str) == length && !memcmp (line, str, length);
+}
+
+/* copy a line to a NUL-terminated string that can be modified in place by
+ * the attribute parser */
+static gchar *
+line_to_string (GString * buf, const gchar * line, gsize length)
+{
+  g_string_truncate (buf, 0);
+  g_string_append_len (buf, line, length);
 
-  return endl;
+  return buf->str;
 }
 
 static gboolean
@@ -614,220 +865,193 @@ gst_m3u8_variant_playlist_add_media (GstM3U8VariantPlaylist * playlist,
   return TRUE;
 }
 
+/* parse a line of a variant playlist. A stream waiting for its URI line is
+ * kept in pending. Streams are prepended to the lists. */
 static gboolean
-gst_m3u8_variant_playlist_parse (GstM3U8VariantPlaylist * playlist,
-    gchar * data)
+gst_m3u8_variant_playlist_parse_line (GstM3U8VariantPlaylist * playlist,
+    gchar * data, GstM3U8Stream ** pending)
 {
-  GstM3U8Stream *stream;
-  gchar *next;
-  gboolean error;
+  GST_TRACE ("parsing `%s'", data);
 
-  next = parse_line (data);
-  if (strcmp (data, "#EXTM3U") != 0) {
-    GST_ERROR ("data doesn't start with #EXTM3U");
-    return FALSE;
-  }
+  if (*data != '#') {
+    GstM3U8Playlist *media_playlist;
 
-  stream = NULL;
-  error = FALSE;
+    if (*pending == NULL) {
+      GST_DEBUG ("got URI line without EXT-X-STREAM-INF, dropping `%s'",
+          data);
+      return TRUE;
+    }
 
-  for (data = next; next != NULL; data = next) {
-    next = parse_line (data);
-    if (*data == '\0')
-      continue;
+    media_playlist = gst_m3u8_playlist_new ();
+    media_playlist->uri = uri_join (playlist->uri, data);
 
-    GST_TRACE ("parsing `%s'", data);
+    (*pending)->playlist = media_playlist;
+    playlist->streams = g_slist_prepend (playlist->streams, *pending);
+    *pending = NULL;
 
-    if (*data != '#') {
-      GstM3U8Playlist *media_playlist;
+  } else if (g_str_has_prefix (data, "#EXT-X-VERSION:")) {
+    gint version;
 
-      if (stream == NULL) {
-        GST_DEBUG ("got URI line without EXT-X-STREAM-INF, dropping `%s'",
-            data);
-        continue;
+    if (parse_int (data + 15, NULL, &version)) {
+      playlist->version = version;
+      if (playlist->version > GST_M3U8_VERSION) {
+        GST_ERROR ("unsupported playlist version %d", playlist->version);
+        return FALSE;
       }
+    }
 
-      media_playlist = gst_m3u8_playlist_new ();
-      media_playlist->uri = uri_join (playlist->uri, data);
-
-      stream->playlist = media_playlist;
-      stream = NULL;
-
-    } else if (g_str_has_prefix (data, "#EXT-X-VERSION:")) {
-      gint version;
-
-      if (parse_int (data + 15, NULL, &version)) {
-        playlist->version = version;
-        if (playlist->version > GST_M3U8_VERSION) {
-          GST_ERROR ("unsupported playlist version %d", playlist->version);
-          error = TRUE;
-          break;
+  } else if (g_str_has_prefix (data, "#EXT-X-MEDIA:")) {
+    gchar *v, *a;
+    GstM3U8Media *media;
+
+    media = gst_m3u8_media_new ();
+    media->type = -1;
+    data += 13;
+
+    while (data && parse_attributes (&data, &a, &v)) {
+      if (!strcmp (a, "TYPE")) {
+        if (!strcmp (v, "AUDIO"))
+          media->type = GST_M3U8_MEDIA_TYPE_AUDIO;
+        else if (!strcmp (v, "VIDEO"))
+          media->type = GST_M3U8_MEDIA_TYPE_VIDEO;
+        else if (!strcmp (v, "SUBTITLES"))
+          media->type = GST_M3U8_MEDIA_TYPE_SUBTITLES;
+      } else if (!strcmp (a, "GROUP-ID") && !media->group_id) {
+        if (strip_quotes (&v)) {
+          g_free (media->group_id);
+          media->group_id = g_strdup (v);
+        }
+      } else if (!strcmp (a, "NAME")) {
+        if (strip_quotes (&v)) {
+          g_free (media->name);
+          media->name = g_strdup (v);
+        }
+      } else if (!strcmp (a, "LANGUAGE")) {
+        if (strip_quotes (&v)) {
+          g_free (media->language);
+          media->language = g_strdup (v);
+        }
+      } else if (!strcmp (a, "DEFAULT")) {
+        if (!parse_bool (v, &media->is_default))
+          GST_WARNING ("invalid DEFAULT value");
+      } else if (!strcmp (a, "AUTOSELECT")) {
+        if (!parse_bool (v, &media->autoselect))
+          GST_WARNING ("invalid AUTOSELECT value");
+      } else if (!strcmp (a, "FORCED")) {
+        if (!parse_bool (v, &media->forced))
+          GST_WARNING ("invalid FORCED value");
+      } else if (!strcmp (a, "URI")) {
+        if (strip_quotes (&v)) {
+          g_free (media->uri);
+          media->uri = uri_join (playlist->uri, v);
         }
       }
+    }
 
-    } else if (g_str_has_prefix (data, "#EXT-X-MEDIA:")) {
-      gchar *v, *a;
-      GstM3U8Media *media;
+    if (media->type == (GstM3U8MediaType) -1) {
+      GST_WARNING ("media with no type, ignoring");
+      gst_m3u8_media_free (media);
+      return TRUE;
+    }
 
-      media = gst_m3u8_media_new ();
-      media->type = -1;
-      data += 13;
+    if (media->group_id == NULL) {
+      GST_WARNING ("media with no group id, ignoring");
+      gst_m3u8_media_free (media);
+      return TRUE;
+    }
 
-      while (data && parse_attributes (&data, &a, &v)) {
-        if (!strcmp (a, "TYPE")) {
-          if (!strcmp (v, "AUDIO"))
-            media->type = GST_M3U8_MEDIA_TYPE_AUDIO;
-          else if (!strcmp (v, "VIDEO"))
-            media->type = GST_M3U8_MEDIA_TYPE_VIDEO;
-          else if (!strcmp (v, "SUBTITLES"))
-            media->type = GST_M3U8_MEDIA_TYPE_SUBTITLES;
-        } else if (!strcmp (a, "GROUP-ID") && !media->group_id) {
-          if (strip_quotes (&v)) {
-            g_free (media->group_id);
-            media->group_id = g_strdup (v);
-          }
-        } else if (!strcmp (a, "NAME")) {
-          if (strip_quotes (&v)) {
-            g_free (media->name);
-            media->name = g_strdup (v);
-          }
-        } else if (!strcmp (a, "LANGUAGE")) {
-          if (strip_quotes (&v)) {
-            g_free (media->language);
-            media->language = g_strdup (v);
-          }
-        } else if (!strcmp (a, "DEFAULT")) {
-          if (!parse_bool (v, &media->is_default))
-            GST_WARNING ("invalid DEFAULT value");
-        } else if (!strcmp (a, "AUTOSELECT")) {
-          if (!parse_bool (v, &media->autoselect))
-            GST_WARNING ("invalid AUTOSELECT value");
-        } else if (!strcmp (a, "FORCED")) {
-          if (!parse_bool (v, &media->forced))
-            GST_WARNING ("invalid FORCED value");
-        } else if (!strcmp (a, "URI")) {
-          if (strip_quotes (&v)) {
-            g_free (media->uri);
-            media->uri = uri_join (playlist->uri, v);
-          }
-        }
-      }
+    if (!gst_m3u8_variant_playlist_add_media (playlist, media)) {
+      GST_WARNING ("invalid media for group %s, ignoring", media->group_id);
+      gst_m3u8_media_free (media);
+      return TRUE;
+    }
 
-      if (media->type == (GstM3U8MediaType) -1) {
-        GST_WARNING ("media with no type, ignoring");
-        gst_m3u8_media_free (media);
-        continue;
-      }
+  } else if (g_str_has_prefix (data, "#EXT-X-STREAM-INF:") ||
+      g_str_has_prefix (data, "#EXT-X-I-FRAME-STREAM-INF:")) {
+    GstM3U8Stream *stream;
+    gchar *v, *a;
 
-      if (media->group_id == NULL) {
-        GST_WARNING ("media with no group id, ignoring");
-        gst_m3u8_media_free (media);
-        continue;
-      }
+    if (*pending != NULL) {
+      GST_WARNING ("dropping stream with no URI");
+      gst_m3u8_stream_free (*pending);
+    }
 
-      if (!gst_m3u8_variant_playlist_add_media (playlist, media)) {
-        GST_WARNING ("invalid media for group %s, ignoring", media->group_id);
-        gst_m3u8_media_free (media);
-        continue;
-      }
+    stream = gst_m3u8_stream_new ();
 
-    } else if (g_str_has_prefix (data, "#EXT-X-STREAM-INF:") ||
-        g_str_has_prefix (data, "#EXT-X-I-FRAME-STREAM-INF:")) {
-      gchar *v, *a;
+    stream->i_frames_only = g_str_has_prefix (data,
+        "#EXT-X-I-FRAME-STREAM-INF:");
 
-      if (stream != NULL) {
-        GST_WARNING ("dropping stream with no URI");
-        gst_m3u8_stream_free (stream);
-      }
+    data += stream->i_frames_only ? 26 : 18;
 
-      stream = gst_m3u8_stream_new ();
+    while (data && parse_attributes (&data, &a, &v)) {
+      if (!strcmp (a, "BANDWIDTH")) {
+        if (!parse_int (v, NULL, &stream->bandwidth))
+          GST_WARNING ("invalid stream bandwidth `%s'", v);
 
-      stream->i_frames_only = g_str_has_prefix (data,
-          "#EXT-X-I-FRAME-STREAM-INF:");
+      } else if (!strcmp (a, "PROGRAM-ID")) {
+        if (!parse_int (v, NULL, &stream->program_id))
+          GST_WARNING ("invalid stream program id `%s'", v);
 
-      data += stream->i_frames_only ? 26 : 18;
+      } else if (!strcmp (a, "CODECS")) {
+        if (strip_quotes (&v)) {
+          gchar **codecs;
+          gint i;
 
-      while (data && parse_attributes (&data, &a, &v)) {
-        if (!strcmp (a, "BANDWIDTH")) {
-          if (!parse_int (v, NULL, &stream->bandwidth))
-            GST_WARNING ("invalid stream bandwidth `%s'", v);
-
-        } else if (!strcmp (a, "PROGRAM-ID")) {
-          if (!parse_int (v, NULL, &stream->program_id))
-            GST_WARNING ("invalid stream program id `%s'", v);
-
-        } else if (!strcmp (a, "CODECS")) {
-          if (strip_quotes (&v)) {
-            gchar **codecs;
-            gint i;
-
-            codecs = g_strsplit (v, ",", 3);
-
-            for (i = 0; i < 3 && codecs[i] != NULL; i++) {
-              GstM3U8MediaType type;
-              GstM3U8MediaCodec codec;
-
-              if (parse_media_codec (g_strstrip (codecs[i]), &codec, &type)) {
-                if (type == GST_M3U8_MEDIA_TYPE_AUDIO)
-                  stream->audio_codec = codec;
-                else if (type == GST_M3U8_MEDIA_TYPE_VIDEO)
-                  stream->video_codec = codec;
-              }
-            }
-            g_strfreev (codecs);
-          }
+          codecs = g_strsplit (v, ",", 3);
 
-        } else if (!strcmp (a, "RESOLUTION")) {
-          if (!parse_resolution (v, NULL, &stream->width, &stream->height))
-            GST_WARNING ("invalid stream resolution `%s'", v);
+          for (i = 0; i < 3 && codecs[i] != NULL; i++) {
+            GstM3U8MediaType type;
+            GstM3U8MediaCodec codec;
 
-        } else if (!strcmp (a, "VIDEO")) {
-          if (strip_quotes (&v)) {
-            g_free (stream->video);
-            stream->video = g_strdup (v);
+            if (parse_media_codec (g_strstrip (codecs[i]), &codec, &type)) {
+              if (type == GST_M3U8_MEDIA_TYPE_AUDIO)
+                stream->audio_codec = codec;
+              else if (type == GST_M3U8_MEDIA_TYPE_VIDEO)
+                stream->video_codec = codec;
+            }
           }
+          g_strfreev (codecs);
+        }
 
-        } else if (!stream->i_frames_only && !strcmp (a, "AUDIO")) {
-          if (strip_quotes (&v)) {
-            g_free (stream->audio);
-            stream->audio = g_strdup (v);
-          }
+      } else if (!strcmp (a, "RESOLUTION")) {
+        if (!parse_resolution (v, NULL, &stream->width, &stream->height))
+          GST_WARNING ("invalid stream resolution `%s'", v);
 
-        } else if (!stream->i_frames_only && !strcmp (a, "SUBTITLES")) {
-          if (strip_quotes (&v)) {
-            g_free (stream->subtitles);
-            stream->subtitles = g_strdup (v);
-          }
+      } else if (!strcmp (a, "VIDEO")) {
+        if (strip_quotes (&v)) {
+          g_free (stream->video);
+          stream->video = g_strdup (v);
+        }
 
-        } else if (stream->i_frames_only && !strcmp (a, "URI")) {
-          if (strip_quotes (&v))
-            gst_m3u8_stream_set_uri (stream, uri_join (playlist->uri, v));
+      } else if (!stream->i_frames_only && !strcmp (a, "AUDIO")) {
+        if (strip_quotes (&v)) {
+          g_free (stream->audio);
+          stream->audio = g_strdup (v);
         }
-      }
 
-      if (stream->i_frames_only) {
-        playlist->i_frame_streams =
-            g_slist_prepend (playlist->i_frame_streams, stream);
-        stream = NULL;
-      } else {
-        playlist->streams = g_slist_prepend (playlist->streams, stream);
+      } else if (!stream->i_frames_only && !strcmp (a, "SUBTITLES")) {
+        if (strip_quotes (&v)) {
+          g_free (stream->subtitles);
+          stream->subtitles = g_strdup (v);
+        }
+
+      } else if (stream->i_frames_only && !strcmp (a, "URI")) {
+        if (strip_quotes (&v))
+          gst_m3u8_stream_set_uri (stream, uri_join (playlist->uri, v));
       }
+    }
 
+    if (stream->i_frames_only) {
+      playlist->i_frame_streams =
+          g_slist_prepend (playlist->i_frame_streams, stream);
+      *pending = NULL;
     } else {
-      GST_LOG ("ignoring unsupported tag `%s'", data);
+      /* added to the streams once its URI is known */
+      *pending = stream;
     }
-  }
-
-  if (stream != NULL) {
-    GST_WARNING ("dropping stream with no URI");
-    gst_m3u8_stream_free (stream);
-  }
 
-  if (error) {
-    gst_m3u8_variant_playlist_cleanup (playlist);
   } else {
-    playlist->streams = g_slist_reverse (playlist->streams);
-    playlist->i_frame_streams = g_slist_reverse (playlist->i_frame_streams);
+    GST_LOG ("ignoring unsupported tag `%s'", data);
   }
 
   return TRUE;
@@ -837,20 +1061,19 @@ static void
 gst_m3u8_playlist_process (GstM3U8Playlist * playlist)
 {
   GstClockTime max_duration;
-  guint n_segments;
-  GSList *l;
+  guint i;
 
-  n_segments = 0;
   max_duration = playlist->target_duration;
   playlist->duration = 0;
 
-  for (l = playlist->segments; l; l = l->next) {
-    GstM3U8Segment *segment = l->data;
-    segment->sequence += playlist->media_sequence;
+  g_array_set_size (playlist->start_times, playlist->segments->len);
+
+  for (i = 0; i < playlist->segments->len; i++) {
+    GstM3U8Segment *segment = g_ptr_array_index (playlist->segments, i);
+    g_array_index (playlist->start_times, GstClockTime, i) = playlist->duration;
     playlist->duration += segment->duration;
     if (max_duration < segment->duration)
       max_duration = ((segment->duration / GST_SECOND) + 1) * GST_SECOND;
-    n_segments++;
   }
 
   if (max_duration > playlist->target_duration) {
@@ -865,29 +1088,453 @@ gst_m3u8_playlist_process (GstM3U8Playlist * playlist)
       playlist->version, playlist->type, playlist->endlist,
       playlist->allow_cache, playlist->i_frames_only,
       GST_TIME_AS_SECONDS (playlist->target_duration),
-      playlist->media_sequence, n_segments,
+      playlist->media_sequence, playlist->segments->len,
       GST_TIME_ARGS (playlist->duration));
 }
 
+static GstM3U8Map *
+gst_m3u8_playlist_parse_map (GstM3U8Playlist * playlist, gchar * data,
+    GstM3U8Map * previous)
+{
+  GstM3U8Map *map;
+  gchar *v, *a;
+
+  map = gst_m3u8_map_new ();
+
+  while (data && parse_attributes (&data, &a, &v)) {
+    if (!strcmp (a, "URI")) {
+      if (strip_quotes (&v)) {
+        g_free (map->uri);
+        map->uri = uri_join (playlist->uri, v);
+      }
+
+    } else if (!strcmp (a, "BYTERANGE")) {
+      if (strip_quotes (&v)) {
+        if (!parse_byte_range (v, NULL, &map->length, &map->offset))
+          GST_WARNING ("invalid map byte-range `%s'", v);
+      }
+    }
+  }
+
+  /* the same map is usually repeated, keep the existing one */
+  if (previous && !g_strcmp0 (previous->uri, map->uri) &&
+      previous->offset == map->offset && previous->length == map->length) {
+    gst_m3u8_map_free (map);
+    return previous;
+  }
+
+  playlist->maps = g_slist_prepend (playlist->maps, map);
+
+  return map;
+}
+
+static GstM3U8Key *
+gst_m3u8_playlist_parse_key (GstM3U8Playlist * playlist, gchar * data,
+    GstM3U8Key * previous)
+{
+  GstM3U8Key *key;
+  gchar *v, *a;
+
+  key = gst_m3u8_key_new ();
+
+  while (data && parse_attributes (&data, &a, &v)) {
+    if (!strcmp (a, "METHOD")) {
+      if (!strcmp (v, "NONE"))
+        key->method = GST_M3U8_KEY_METHOD_NONE;
+      else if (!strcmp (v, "AES-128"))
+        key->method = GST_M3U8_KEY_METHOD_AES_128;
+      else if (!strcmp (v, "SAMPLE-AES"))
+        key->method = GST_M3U8_KEY_METHOD_SAMPLE_AES;
+      else
+        key->method = GST_M3U8_KEY_METHOD_UNKNOWN;
+
+    } else if (!strcmp (a, "URI")) {
+      if (strip_quotes (&v)) {
+        g_free (key->uri);
+        key->uri = uri_join (playlist->uri, v);
+      }
+
+    } else if (!strcmp (a, "IV")) {
+      g_free (key->iv);
+      key->iv = g_ascii_strdown (v, -1);
+
+    } else if (!strcmp (a, "KEYFORMAT")) {
+      if (strip_quotes (&v)) {
+        if (!strcmp (v, "identity"))
+          key->format = GST_M3U8_KEY_FORMAT_IDENTITY;
+        else
+          key->format = GST_M3U8_KEY_FORMAT_UNKNOWN;
+      }
+    } else if (!strcmp (a, "KEYFORMATVERSIONS")) {
+      GST_DEBUG ("ignoring KEYFORMATVERSIONS attribute: `%s'", v);
+    }
+  }
+
+  /* the same key is usually repeated, keep the existing one */
+  if (previous && previous->method == key->method &&
+      previous->format == key->format &&
+      !g_strcmp0 (previous->uri, key->uri) &&
+      !g_strcmp0 (previous->iv, key->iv)) {
+    gst_m3u8_key_free (key);
+    return previous;
+  }
+
+  playlist->keys = g_slist_prepend (playlist->keys, key);
+
+  return key;
+}
+
+static GstM3U8Part *
+gst_m3u8_playlist_parse_part (GstM3U8Playlist * playlist, gchar * data,
+    GPtrArray * parts)
+{
+  GstM3U8Part *part, *previous;
+  gdouble fval;
+  gchar *v, *a;
+
+  part = gst_m3u8_part_new ();
+
+  while (data && parse_attributes (&data, &a, &v)) {
+    if (!strcmp (a, "URI")) {
+      if (strip_quotes (&v)) {
+        g_free (part->uri);
+        part->uri = uri_join (playlist->uri, v);
+      }
+
+    } else if (!strcmp (a, "DURATION")) {
+      if (parse_double (v, NULL, &fval))
+        part->duration = fval * (gdouble) GST_SECOND;
+
+    } else if (!strcmp (a, "INDEPENDENT")) {
+      if (!parse_bool (v, &part->independent))
+        GST_WARNING ("invalid INDEPENDENT value");
+
+    } else if (!strcmp (a, "GAP")) {
+      if (!parse_bool (v, &part->gap))
+        GST_WARNING ("invalid GAP value");
+
+    } else if (!strcmp (a, "BYTERANGE")) {
+      if (!strip_quotes (&v) ||
+          !parse_byte_range (v, NULL, &part->length, &part->offset))
+        GST_WARNING ("invalid part byte-range `%s'", v);
+    }
+  }
+
+  if (!part->uri || !GST_CLOCK_TIME_IS_VALID (part->duration)) {
+    GST_WARNING ("part with no URI or duration, ignoring");
+    gst_m3u8_part_free (part);
+    return NULL;
+  }
+
+  /* without offset, the range follows the previous part of the resource */
+  if (part->offset < 0) {
+    previous = NULL;
+    if (parts && parts->len > 0)
+      previous = g_ptr_array_index (parts, parts->len - 1);
+
+    if (previous && previous->length >= 0 &&
+        !strcmp (previous->uri, part->uri))
+      part->offset = previous->offset + previous->length;
+    else
+      part->offset = 0;
+  }
+
+  return part;
+}
+
+static GstM3U8Part *
+gst_m3u8_playlist_parse_preload_hint (GstM3U8Playlist * playlist,
+    gchar * data)
+{
+  GstM3U8Part *hint;
+  gboolean is_part;
+  gchar *v, *a;
+
+  hint = gst_m3u8_part_new ();
+  is_part = FALSE;
+
+  while (data && parse_attributes (&data, &a, &v)) {
+    if (!strcmp (a, "TYPE")) {
+      is_part = !strcmp (v, "PART");
+
+    } else if (!strcmp (a, "URI")) {
+      if (strip_quotes (&v)) {
+        g_free (hint->uri);
+        hint->uri = uri_join (playlist->uri, v);
+      }
+
+    } else if (!strcmp (a, "BYTERANGE-START")) {
+      if (!parse_int64 (v, NULL, &hint->offset))
+        GST_WARNING ("invalid BYTERANGE-START value");
+
+    } else if (!strcmp (a, "BYTERANGE-LENGTH")) {
+      if (!parse_int64 (v, NULL, &hint->length))
+        GST_WARNING ("invalid BYTERANGE-LENGTH value");
+    }
+  }
+
+  /* only hints for the next part are used */
+  if (!is_part || !hint->uri) {
+    gst_m3u8_part_free (hint);
+    return NULL;
+  }
+
+  return hint;
+}
+
+static void
+gst_m3u8_playlist_parse_server_control (GstM3U8Playlist * playlist,
+    gchar * data)
+{
+  gdouble fval;
+  gchar *v, *a;
+
+  while (data && parse_attributes (&data, &a, &v)) {
+    if (!strcmp (a, "CAN-BLOCK-RELOAD")) {
+      if (!parse_bool (v, &playlist->can_block_reload))
+        GST_WARNING ("invalid CAN-BLOCK-RELOAD value");
+
+    } else if (!strcmp (a, "CAN-SKIP-UNTIL")) {
+      if (parse_double (v, NULL, &fval))
+        playlist->can_skip_until = fval * (gdouble) GST_SECOND;
+
+    } else if (!strcmp (a, "HOLD-BACK")) {
+      if (parse_double (v, NULL, &fval))
+        playlist->hold_back = fval * (gdouble) GST_SECOND;
+
+    } else if (!strcmp (a, "PART-HOLD-BACK")) {
+      if (parse_double (v, NULL, &fval))
+        playlist->part_hold_back = fval * (gdouble) GST_SECOND;
+    }
+  }
+}
+
+/* free the maps and keys no segment refers to anymore */
+static void
+gst_m3u8_playlist_prune (GstM3U8Playlist * playlist)
+{
+  GHashTable *used;
+  GstM3U8Key *key;
+  GstM3U8Map *map;
+  GSList *l, *next;
+  guint i;
+
+  used = g_hash_table_new (NULL, NULL);
+  key = NULL;
+  map = NULL;
+
+  /* the parts being published may already use a new key */
+  if (playlist->parts) {
+    for (i = 0; i < playlist->parts->len; i++) {
+      GstM3U8Part *part = g_ptr_array_index (playlist->parts, i);
+      g_hash_table_add (used, part->key);
+    }
+  }
+
+  if (playlist->preload_hint)
+    g_hash_table_add (used, playlist->preload_hint->key);
+
+  for (i = 0; i < playlist->segments->len; i++) {
+    GstM3U8Segment *segment = g_ptr_array_index (playlist->segments, i);
+
+    if (segment->key != key) {
+      key = segment->key;
+      g_hash_table_add (used, key);
+    }
+
+    if (segment->map != map) {
+      map = segment->map;
+      g_hash_table_add (used, map);
+    }
+  }
+
+  for (l = playlist->keys; l != NULL; l = next) {
+    next = l->next;
+    if (!g_hash_table_contains (used, l->data)) {
+      gst_m3u8_key_free (l->data);
+      playlist->keys = g_slist_delete_link (playlist->keys, l);
+    }
+  }
+
+  for (l = playlist->maps; l != NULL; l = next) {
+    next = l->next;
+    if (!g_hash_table_contains (used, l->data)) {
+      gst_m3u8_map_free (l->data);
+      playlist->maps = g_slist_delete_link (playlist->maps, l);
+    }
+  }
+
+  g_hash_table_unref (used);
+}
+
+/* FNV-1a, only used to detect playlist changes */
+static guint32
+hash_data (const gchar * data, gsize size)
+{
+  guint32 hash = 2166136261u;
+  gsize i;
+
+  for (i = 0; i < size; i++) {
+    hash ^= (guint8) data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/* read EXT-X-MEDIA-SEQUENCE, only looking at the tags before the first
+ * segment */
+static gint
+peek_media_sequence (const gchar * data, gsize size)
+{
+  const gchar *end = data + size;
+  const gchar *line;
+  gsize length, i;
+  gint sequence;
+
+  while (read_line (&data, end, &line, &length)) {
+    if (length > 0 && (*line != '#' ||
+            (length >= 8 && !memcmp (line, "#EXTINF:", 8))))
+      break;
+
+    if (length > 22 && !memcmp (line, "#EXT-X-MEDIA-SEQUENCE:", 22)) {
+      sequence = 0;
+      for (i = 22; i < length && g_ascii_isdigit (line[i]); i++)
+        sequence = sequence * 10 + (line[i] - '0');
+      return sequence;
+    }
+  }
+
+  return 0;
+}
+
+/* find the last URI line, scanning backwards from the end of the data */
+static gboolean
+peek_last_uri (const gchar * data, gsize size, const gchar ** uri,
+    gsize * length)
+{
+  const gchar *end = data + size;
+  const gchar *line;
+
+  while (end > data) {
+    while (end > data && (end[-1] == '\n' || end[-1] == '\r'))
+      end--;
+
+    line = end;
+    while (line > data && line[-1] != '\n')
+      line--;
+
+    if (line < end && *line != '#') {
+      *uri = line;
+      *length = end - line;
+      return TRUE;
+    }
+
+    end = line;
+  }
+
+  return FALSE;
+}
+
+/* check if the playlist data changed since the last update. The size, media
+ * sequence and last segment URI usually tell a live playlist changed, the
+ * data is only hashed when they are all the same. An update following one
+ * that was not hashed is considered changed. */
+static gboolean
+gst_m3u8_playlist_data_changed (GstM3U8Playlist * playlist,
+    const gchar * data, gsize size)
+{
+  const gchar *uri;
+  gsize length;
+  gint sequence;
+  guint32 hash;
+
+  sequence = peek_media_sequence (data, size);
+  if (!peek_last_uri (data, size, &uri, &length)) {
+    uri = NULL;
+    length = 0;
+  }
+
+  if (playlist->data_last_uri && size == playlist->data_size &&
+      sequence == playlist->data_sequence &&
+      uri && line_equals (uri, length, playlist->data_last_uri)) {
+    hash = hash_data (data, size);
+    if (playlist->data_hashed && hash == playlist->data_hash)
+      return FALSE;
+
+    playlist->data_hash = hash;
+    playlist->data_hashed = TRUE;
+    return TRUE;
+  }
+
+  playlist->data_size = size;
+  playlist->data_sequence = sequence;
+  playlist->data_hashed = FALSE;
+  g_free (playlist->data_last_uri);
+  playlist->data_last_uri = uri ? g_strndup (uri, length) : NULL;
+
+  return TRUE;
+}
+
+/* drop the segments that went out of the live window. Returns the sequence
+ * of the last segment kept, or -1 if all segments must be parsed again */
+static gint
+gst_m3u8_playlist_merge_start (GstM3U8Playlist * playlist,
+    gint media_sequence)
+{
+  GstM3U8Segment *first, *last;
+  guint expired;
+
+  if (playlist->segments->len == 0)
+    return -1;
+
+  first = g_ptr_array_index (playlist->segments, 0);
+  last = g_ptr_array_index (playlist->segments, playlist->segments->len - 1);
+
+  if (media_sequence < first->sequence || media_sequence > last->sequence) {
+    GST_DEBUG ("playlist does not overlap previous one, parse all segments");
+    g_ptr_array_set_size (playlist->segments, 0);
+    gst_m3u8_playlist_prune (playlist);
+    return -1;
+  }
+
+  expired = media_sequence - first->sequence;
+  if (expired > 0) {
+    GST_DEBUG ("dropping %u expired segments", expired);
+    g_ptr_array_remove_range (playlist->segments, 0, expired);
+    gst_m3u8_playlist_prune (playlist);
+  }
+
+  return last->sequence;
+}
+
 gboolean
-gst_m3u8_playlist_update (GstM3U8Playlist * playlist, gchar * data,
-    gboolean * updated)
+gst_m3u8_playlist_update (GstM3U8Playlist * playlist, const gchar * buffer,
+    gsize size, gboolean * updated)
 {
-  gchar *digest;
-  gchar *next;
+  const gchar *end = buffer + size;
+  const gchar *line;
+  const gchar *key_data, *map_data;
+  gsize line_length, key_length, map_length;
+  GString *buf;
+  gchar *data;
   gboolean bval;
   gdouble fval;
   gint ival;
+  GstM3U8Segment *segment;
+  GstM3U8Part *part;
+  GPtrArray *parts;
   GstM3U8Key *key;
   GstM3U8Map *map;
   GstClockTime duration;
   gint64 offset, length;
   gboolean discont;
-  guint sequence;
+  gint sequence, last_sequence;
+  guint n_segments;
   gboolean error;
 
-  next = parse_line (data);
-  if (strcmp (data, "#EXTM3U") != 0) {
+  if (!read_line (&buffer, end, &line, &line_length) ||
+      !line_equals (line, line_length, "#EXTM3U")) {
     GST_WARNING ("data doesn't start with #EXTM3U");
     if (updated)
       *updated = FALSE;
@@ -895,64 +1542,108 @@ gst_m3u8_playlist_update (GstM3U8Playlist * playlist, gchar * data,
   }
 
   /* check if the data changed since last update */
-  digest = g_compute_checksum_for_string (G_CHECKSUM_MD5, next, -1);
-  if (!g_strcmp0 (playlist->digest, digest)) {
+  if (!gst_m3u8_playlist_data_changed (playlist, buffer, end - buffer)) {
     GST_DEBUG ("playlist is the same as previous one");
     if (updated)
       *updated = FALSE;
-    g_free (digest);
     return TRUE;
   }
 
-  gst_m3u8_playlist_reset (playlist);
-  playlist->digest = digest;
+  /* tags are parsed again, but segments still in the live window are kept
+   * as is and only the new ones are created */
+  gst_m3u8_playlist_reset_tags (playlist);
   playlist->download_ts = gst_util_get_timestamp ();
 
   duration = GST_CLOCK_TIME_NONE;
-  sequence = 0;
+  sequence = -1;
+  last_sequence = -1;
+  n_segments = 0;
   offset = 0;
   length = -1;
   discont = FALSE;
   key = NULL;
   map = NULL;
+  key_data = NULL;
+  map_data = NULL;
+  key_length = 0;
+  map_length = 0;
+  parts = NULL;
   error = FALSE;
+  buf = g_string_sized_new (256);
 
-  for (data = next; data != NULL; data = next) {
-    next = parse_line (data);
-
-    if (*data == '\0')
+  while (read_line (&buffer, end, &line, &line_length)) {
+    if (line_length == 0)
       continue;
 
-    GST_TRACE ("parsing `%s'", data);
-
-    if (*data != '#') {
-      GstM3U8Segment *segment;
-
+    if (*line != '#') {
       if (duration == GST_CLOCK_TIME_NONE) {
-        GST_DEBUG ("got URI line without EXTINF, dropping `%s'", data);
+        GST_DEBUG ("got URI line without EXTINF, dropping `%.*s'",
+            (gint) line_length, line);
         continue;
       }
 
-      segment = gst_m3u8_segment_new (uri_join (playlist->uri, data),
-          duration, sequence++);
-
-      if (length != -1) {
-        segment->length = length;
-        segment->offset = offset;
-        offset += length;
+      if (sequence < 0) {
+        sequence = playlist->media_sequence;
+        last_sequence = gst_m3u8_playlist_merge_start (playlist, sequence);
       }
 
-      segment->discont = discont;
-      segment->key = key;
-      segment->map = map;
+      if (sequence <= last_sequence) {
+        /* segment is already known, only track the current key and map */
+        segment = gst_m3u8_playlist_get_segment (playlist, sequence);
+        key = segment->key;
+        map = segment->map;
+        key_data = NULL;
+        map_data = NULL;
+
+        if (segment->length != -1)
+          offset = segment->offset + segment->length;
+
+      } else {
+        if (key_data) {
+          data = line_to_string (buf, key_data, key_length);
+          key = gst_m3u8_playlist_parse_key (playlist, data, key);
+          key_data = NULL;
+        }
+
+        if (map_data) {
+          data = line_to_string (buf, map_data, map_length);
+          map = gst_m3u8_playlist_parse_map (playlist, data, map);
+          map_data = NULL;
+        }
+
+        data = line_to_string (buf, line, line_length);
+        segment = gst_m3u8_segment_new (uri_join (playlist->uri, data),
+            duration, sequence);
+
+        if (length != -1) {
+          segment->length = length;
+          segment->offset = offset;
+          offset += length;
+        }
+
+        segment->discont = discont;
+        segment->key = key;
+        segment->map = map;
+        segment->parts = parts;
+        parts = NULL;
+
+        g_ptr_array_add (playlist->segments, segment);
+      }
 
-      playlist->segments = g_slist_prepend (playlist->segments, segment);
+      sequence++;
+      n_segments++;
 
       length = -1;
       duration = GST_CLOCK_TIME_NONE;
       discont = FALSE;
+      continue;
+    }
+
+    data = line_to_string (buf, line, line_length);
+
+    GST_TRACE ("parsing `%s'", data);
 
-    } else if (!strcmp (data, "#EXT-X-ENDLIST")) {
+    if (!strcmp (data, "#EXT-X-ENDLIST")) {
       playlist->endlist = TRUE;
 
     } else if (g_str_has_prefix (data, "#EXT-X-VERSION:")) {
@@ -982,6 +1673,7 @@ gst_m3u8_playlist_update (GstM3U8Playlist * playlist, gchar * data,
     } else if (!strcmp (data, "#EXT-X-DISCONTINUITY")) {
        discont = TRUE;
        map = NULL;
+       map_data = NULL;
 
     } else if (!strcmp (data, "#EXT-X-I-FRAMES-ONLY")) {
        playlist->i_frames_only = TRUE;
@@ -996,77 +1688,108 @@ gst_m3u8_playlist_update (GstM3U8Playlist * playlist, gchar * data,
         playlist->allow_cache = bval;
 
     } else if (g_str_has_prefix (data, "#EXT-X-MAP:")) {
-      GstM3U8Map *map;
-      gchar *v, *a;
+      /* only parsed if a new segment uses it */
+      map_data = line + 11;
+      map_length = line_length - 11;
 
-      map = gst_m3u8_map_new ();
-      data += 11;
+    } else if (g_str_has_prefix (data, "#EXT-X-KEY:")) {
+      /* only parsed if a new segment uses it */
+      key_data = line + 11;
+      key_length = line_length - 11;
 
-      while (data && parse_attributes (&data, &a, &v)) {
-        if (!strcmp (a, "URI")) {
-          if (strip_quotes (&v)) {
-            g_free (map->uri);
-            map->uri = uri_join (playlist->uri, v);
-          }
+    } else if (g_str_has_prefix (data, "#EXTINF:")) {
+      if (!parse_double (data + 8, NULL, &fval)) {
+        GST_WARNING ("can't read EXTINF duration");
+        continue;
+      }
 
-        } else if (!strcmp (a, "BYTERANGE")) {
-          if (strip_quotes (&v)) {
-            if (!parse_byte_range (v, NULL, &map->length, &map->offset))
-              GST_WARNING ("invalid map byte-range `%s'", v);
-          }
-        }
+      duration = fval * (gdouble) GST_SECOND;
+
+    } else if (g_str_has_prefix (data, "#EXT-X-PART:")) {
+      if (sequence < 0) {
+        sequence = playlist->media_sequence;
+        last_sequence = gst_m3u8_playlist_merge_start (playlist, sequence);
       }
 
-      playlist->maps = g_slist_prepend (playlist->maps, map);
+      /* the parts of known segments are kept as is */
+      if (sequence <= last_sequence)
+        continue;
 
-    } else if (g_str_has_prefix (data, "#EXT-X-KEY:")) {
+      part = gst_m3u8_playlist_parse_part (playlist, data + 12, parts);
+      if (part == NULL)
+        continue;
+
+      if (key_data) {
+        data = line_to_string (buf, key_data, key_length);
+        key = gst_m3u8_playlist_parse_key (playlist, data, key);
+        key_data = NULL;
+      }
+
+      part->key = key;
+
+      if (parts == NULL)
+        parts = g_ptr_array_new_with_free_func ((GDestroyNotify)
+            gst_m3u8_part_free);
+      g_ptr_array_add (parts, part);
+
+    } else if (g_str_has_prefix (data, "#EXT-X-PRELOAD-HINT:")) {
+      if (playlist->preload_hint == NULL)
+        playlist->preload_hint =
+            gst_m3u8_playlist_parse_preload_hint (playlist, data + 20);
+
+    } else if (g_str_has_prefix (data, "#EXT-X-PART-INF:")) {
       gchar *v, *a;
 
-      key = gst_m3u8_key_new ();
-      data += 11;
+      data += 16;
+      while (data && parse_attributes (&data, &a, &v)) {
+        if (!strcmp (a, "PART-TARGET") && parse_double (v, NULL, &fval))
+          playlist->part_target = fval * (gdouble) GST_SECOND;
+      }
+
+    } else if (g_str_has_prefix (data, "#EXT-X-SKIP:")) {
+      gchar *v, *a;
+      gint skipped = -1;
 
+      data += 12;
       while (data && parse_attributes (&data, &a, &v)) {
-        if (!strcmp (a, "METHOD")) {
-          if (!strcmp (v, "NONE"))
-            key->method = GST_M3U8_KEY_METHOD_NONE;
-          else if (!strcmp (v, "AES-128"))
-            key->method = GST_M3U8_KEY_METHOD_AES_128;
-          else if (!strcmp (v, "SAMPLE-AES"))
-            key->method = GST_M3U8_KEY_METHOD_SAMPLE_AES;
-          else
-            key->method = GST_M3U8_KEY_METHOD_UNKNOWN;
-
-        } else if (!strcmp (a, "URI")) {
-          if (strip_quotes (&v)) {
-            g_free (key->uri);
-            key->uri = uri_join (playlist->uri, v);
-          }
+        if (!strcmp (a, "SKIPPED-SEGMENTS") && !parse_int (v, NULL, &skipped))
+          skipped = -1;
+      }
 
-        } else if (!strcmp (a, "IV")) {
-          g_free (key->iv);
-          key->iv = g_ascii_strdown (v, -1);
+      if (skipped < 0 || sequence >= 0) {
+        GST_WARNING ("invalid EXT-X-SKIP tag");
+        error = TRUE;
+        break;
+      }
 
-        } else if (!strcmp (a, "KEYFORMAT")) {
-          if (strip_quotes (&v)) {
-            if (!strcmp (v, "identity"))
-              key->format = GST_M3U8_KEY_FORMAT_IDENTITY;
-            else
-              key->format = GST_M3U8_KEY_FORMAT_UNKNOWN;
-          }
-        } else if (!strcmp (a, "KEYFORMATVERSIONS")) {
-          GST_DEBUG ("ignoring KEYFORMATVERSIONS attribute: `%s'", v);
+      sequence = playlist->media_sequence;
+      last_sequence = gst_m3u8_playlist_merge_start (playlist, sequence);
+
+      /* delta update, the skipped segments are the ones of the previous
+       * update */
+      if (skipped > 0) {
+        if (last_sequence < sequence + skipped - 1) {
+          GST_WARNING ("skipped segments are unknown, delta update failed");
+          error = TRUE;
+          break;
         }
-      }
 
-      playlist->keys = g_slist_prepend (playlist->keys, key);
+        segment = gst_m3u8_playlist_get_segment (playlist,
+            sequence + skipped - 1);
+        key = segment->key;
+        map = segment->map;
 
-    } else if (g_str_has_prefix (data, "#EXTINF:")) {
-      if (!parse_double (data + 8, NULL, &fval)) {
-        GST_WARNING ("can't read EXTINF duration");
-        continue;
+        if (segment->length != -1)
+          offset = segment->offset + segment->length;
+
+        GST_DEBUG ("skipped %d segments", skipped);
+
+        sequence += skipped;
+        n_segments += skipped;
       }
 
-      duration = fval * (gdouble) GST_SECOND;
+    } else if (g_str_has_prefix (data, "#EXT-X-SERVER-CONTROL:")) {
+      gst_m3u8_playlist_parse_server_control (playlist, data + 22);
 
     } else if (g_str_has_prefix (data, "#EXT-X-BYTERANGE:")) {
       gint64 range_offset;
@@ -1084,10 +1807,32 @@ gst_m3u8_playlist_update (GstM3U8Playlist * playlist, gchar * data,
     }
   }
 
+  if (!error && playlist->preload_hint) {
+    if (key_data) {
+      data = line_to_string (buf, key_data, key_length);
+      key = gst_m3u8_playlist_parse_key (playlist, data, key);
+    }
+    playlist->preload_hint->key = key;
+  }
+
+  g_string_free (buf, TRUE);
+
+  /* the remaining parts belong to the segment being published */
+  if (playlist->parts)
+    g_ptr_array_unref (playlist->parts);
+  playlist->parts = parts;
+  playlist->parts_sequence = sequence < 0 ? playlist->media_sequence : sequence;
+  playlist->parts_discont = discont;
+
   if (error) {
     gst_m3u8_playlist_reset (playlist);
   } else {
-    playlist->segments = g_slist_reverse (playlist->segments);
+    /* drop segments removed from the end of the playlist */
+    if (playlist->segments->len > n_segments) {
+      g_ptr_array_set_size (playlist->segments, n_segments);
+      gst_m3u8_playlist_prune (playlist);
+    }
+
     gst_m3u8_playlist_process (playlist);
   }
 
@@ -1097,20 +1842,14 @@ gst_m3u8_playlist_update (GstM3U8Playlist * playlist, gchar * data,
   return !error;
 }
 
-static gboolean
-gst_m3u8_is_variant_playlist (const gchar * data)
-{
-  /* A variant playlist must have at least one EXT-X-STREAM-INF */
-  return strstr (data, "#EXT-X-STREAM-INF:") != NULL;
-}
-
 GstM3U8Client *
 gst_m3u8_client_new (void)
 {
   GstM3U8Client *client;
 
-  client = g_new (GstM3U8Client, 1);
+  client = g_new0 (GstM3U8Client, 1);
   client->stream = NULL;
+  client->line = g_string_sized_new (256);
 
   gst_m3u8_variant_playlist_init (&client->master_playlist);
 
@@ -1122,17 +1861,107 @@ gst_m3u8_client_free (GstM3U8Client * client)
 {
   g_return_if_fail (client != NULL);
 
+  if (client->pending_stream)
+    gst_m3u8_stream_free (client->pending_stream);
+
+  g_string_free (client->line, TRUE);
   gst_m3u8_variant_playlist_cleanup (&client->master_playlist);
   g_free (client);
 }
 
+static gboolean
+gst_m3u8_client_parse_master_line (GstM3U8Client * client)
+{
+  GString *line = client->line;
+
+  if (line->len > 0 && line->str[line->len - 1] == '\r')
+    g_string_truncate (line, line->len - 1);
+
+  if (!client->have_header) {
+    if (strcmp (line->str, "#EXTM3U") != 0) {
+      GST_ERROR ("data doesn't start with #EXTM3U");
+      return FALSE;
+    }
+    client->have_header = TRUE;
+    return TRUE;
+  }
+
+  if (line->len == 0)
+    return TRUE;
+
+  /* A variant playlist must have at least one EXT-X-STREAM-INF */
+  if (g_str_has_prefix (line->str, "#EXT-X-STREAM-INF:"))
+    client->is_variant = TRUE;
+  else if (!client->is_variant && g_str_has_prefix (line->str, "#EXTINF:")) {
+    /* rendition playlist, parsed once complete */
+    client->is_rendition = TRUE;
+    return TRUE;
+  }
+
+  return gst_m3u8_variant_playlist_parse_line (&client->master_playlist,
+      line->str, &client->pending_stream);
+}
+
+/* parse the complete lines of a chunk of the master playlist, so that the
+ * streams and renditions are known before the whole playlist is received */
 gboolean
-gst_m3u8_client_parse_master_playlist (GstM3U8Client * client,
-    gchar * data)
+gst_m3u8_client_push_master_playlist (GstM3U8Client * client,
+    const gchar * data, gsize size)
+{
+  const gchar *end = data + size;
+  const gchar *endl;
+
+  g_return_val_if_fail (client != NULL, FALSE);
+
+  while (data < end && !client->error && !client->is_rendition) {
+    endl = memchr (data, '\n', end - data);
+    if (!endl) {
+      g_string_append_len (client->line, data, end - data);
+      break;
+    }
+
+    g_string_append_len (client->line, data, endl - data);
+    data = endl + 1;
+
+    if (!gst_m3u8_client_parse_master_line (client))
+      client->error = TRUE;
+
+    g_string_truncate (client->line, 0);
+  }
+
+  return !client->error;
+}
+
+/* finish parsing the master playlist, data is the complete playlist */
+gboolean
+gst_m3u8_client_finish_master_playlist (GstM3U8Client * client,
+    const gchar * data, gsize size)
 {
+  GstM3U8VariantPlaylist *playlist;
+
   g_return_val_if_fail (client != NULL, FALSE);
 
-  if (!gst_m3u8_is_variant_playlist (data)) {
+  playlist = &client->master_playlist;
+
+  if (!client->error && !client->is_rendition && client->line->len > 0) {
+    if (!gst_m3u8_client_parse_master_line (client))
+      client->error = TRUE;
+    g_string_truncate (client->line, 0);
+  }
+
+  if (client->error)
+    return FALSE;
+
+  if (client->pending_stream != NULL) {
+    GST_WARNING ("dropping stream with no URI");
+    gst_m3u8_stream_free (client->pending_stream);
+    client->pending_stream = NULL;
+  }
+
+  playlist->streams = g_slist_reverse (playlist->streams);
+  playlist->i_frame_streams = g_slist_reverse (playlist->i_frame_streams);
+
+  if (!client->is_variant) {
     GstM3U8Stream *stream;
 
     /* If if's a rendition playlist create a dummy stream and add it to
@@ -1142,24 +1971,26 @@ gst_m3u8_client_parse_master_playlist (GstM3U8Client * client,
     stream->playlist = gst_m3u8_playlist_new ();
     stream->playlist->uri = g_strdup (client->master_playlist.uri);
 
-    if (!gst_m3u8_playlist_update (stream->playlist, data, NULL)) {
+    if (!gst_m3u8_playlist_update (stream->playlist, data, size, NULL)) {
       gst_m3u8_stream_free (stream);
       return FALSE;
     }
 
     client->master_playlist.streams =
         g_slist_prepend (client->master_playlist.streams, stream);
-
-  } else {
-    /* Parse the variant playlist */
-    GST_DEBUG ("parsing variant playlist");
-    if (!gst_m3u8_variant_playlist_parse (&client->master_playlist, data))
-      return FALSE;
   }
 
   return TRUE;
 }
 
+gboolean
+gst_m3u8_client_parse_master_playlist (GstM3U8Client * client,
+    const gchar * data, gsize size)
+{
+  return gst_m3u8_client_push_master_playlist (client, data, size) &&
+      gst_m3u8_client_finish_master_playlist (client, data, size);
+}
+
 GstM3U8Stream *
 gst_m3u8_client_select_stream (GstM3U8Client * client, gint max_bitrate)
 {
@@ -1186,7 +2017,73 @@ gst_m3u8_client_select_stream (GstM3U8Client * client, gint max_bitrate)
   if (!stream)
     stream = lq_stream;
 
-  client->stream = stream;
+  return stream;
+}
+
+/* weight of the buffer level against the bitrate utility, in segments */
+#define BOLA_GAMMA_P 5.0
+
+/* select a stream from the buffer level, with BOLA. The capacity is the
+ * time the buffer can hold and must cover several segments. When it holds
+ * one segment or less, only the lowest or highest stream is picked */
+GstM3U8Stream *
+gst_m3u8_client_select_stream_for_buffer (GstM3U8Client * client,
+    GstClockTime level, GstClockTime capacity, GstClockTime segment_duration)
+{
+  GstM3U8Stream *stream, *lq_stream, *hq_stream;
+  gdouble v_max, v, q, q_max, score, best_score;
+  GSList *l;
+
+  lq_stream = NULL;
+  hq_stream = NULL;
+
+  for (l = client->master_playlist.streams; l != NULL; l = l->next) {
+    GstM3U8Stream *s = (GstM3U8Stream *) l->data;
+
+    if (!lq_stream || s->bandwidth < lq_stream->bandwidth)
+      lq_stream = s;
+
+    if (!hq_stream || s->bandwidth > hq_stream->bandwidth)
+      hq_stream = s;
+  }
+
+  if (!lq_stream || lq_stream->bandwidth <= 0 ||
+      !GST_CLOCK_TIME_IS_VALID (segment_duration) || segment_duration == 0)
+    return gst_m3u8_client_select_stream (client, 0);
+
+  /* BOLA: pick the stream maximizing (V * (v + gp) - Q) / S, where v is the
+   * log utility of the stream bitrate S and Q the buffer level in segments.
+   * V is chosen so that the highest stream is picked when the buffer is
+   * full. */
+  q = (gdouble) level / segment_duration;
+  q_max = (gdouble) capacity / segment_duration;
+  v_max = log ((gdouble) hq_stream->bandwidth / lq_stream->bandwidth);
+
+  stream = NULL;
+  best_score = 0;
+
+  if (q_max > 1) {
+    gdouble V = (q_max - 1) / (v_max + BOLA_GAMMA_P);
+
+    for (l = client->master_playlist.streams; l != NULL; l = l->next) {
+      GstM3U8Stream *s = (GstM3U8Stream *) l->data;
+
+      v = log ((gdouble) MAX (s->bandwidth, 1) / lq_stream->bandwidth);
+      score = (V * (v + BOLA_GAMMA_P) - q) / MAX (s->bandwidth, 1);
+
+      if (!stream || score > best_score) {
+        stream = s;
+        best_score = score;
+      }
+    }
+  }
+
+  /* buffer is above what any stream needs, or too small to decide */
+  if (!stream || best_score < 0)
+    stream = q >= q_max - 1 ? hq_stream : lq_stream;
+
+  GST_LOG ("buffer level %.2f/%.2f segments, selected stream bandwidth %d",
+      q, q_max, stream->bandwidth);
 
   return stream;
 }
@@ -31,6 +31,7 @@ G_BEGIN_DECLS
 typedef struct _GstM3U8Map GstM3U8Map;
 typedef struct _GstM3U8Key GstM3U8Key;
 typedef struct _GstM3U8Segment GstM3U8Segment;
+typedef struct _GstM3U8Part GstM3U8Part;
 typedef struct _GstM3U8Playlist GstM3U8Playlist;
 typedef struct _GstM3U8Media GstM3U8Media;
 typedef struct _GstM3U8Stream GstM3U8Stream;
@@ -94,6 +95,18 @@ struct _GstM3U8Key               /* EXT-X-KEY */
   gchar *iv;                     /* .IV */
 };
 
+struct _GstM3U8Part              /* EXT-X-PART or EXT-X-PRELOAD-HINT */
+{
+  gchar *uri;                    /* .URI */
+  GstClockTime duration;         /* .DURATION */
+  gint64 offset;                 /* .BYTERANGE start */
+  gint64 length;                 /* .BYTERANGE length */
+  gboolean independent;          /* .INDEPENDENT */
+  gboolean gap;                  /* .GAP */
+
+  GstM3U8Key *key;
+};
+
 struct _GstM3U8Segment           /* EXTINF */
 {
   gchar *uri;
@@ -105,6 +118,7 @@ struct _GstM3U8Segment           /* EXTINF */
 
   GstM3U8Map *map;
   GstM3U8Key *key;
+  GPtrArray *parts;             /* GstM3U8Part, NULL if none */
 };
 
 struct _GstM3U8Playlist
@@ -118,14 +132,31 @@ struct _GstM3U8Playlist
   guint media_sequence;          /* EXT-X-MEDIA-SEQUENCE */
   GstDateTime *datetime;         /* EXT-X-PROGRAM-DATE-TIME */
   GstClockTime target_duration;  /* EXT-X-TARGETDURATION */
+  GstClockTime part_target;      /* EXT-X-PART-INF */
+  gboolean can_block_reload;     /* EXT-X-SERVER-CONTROL */
+  GstClockTime can_skip_until;   /* EXT-X-SERVER-CONTROL */
+  GstClockTime hold_back;        /* EXT-X-SERVER-CONTROL */
+  GstClockTime part_hold_back;   /* EXT-X-SERVER-CONTROL */
   GstClockTime download_ts;
   GstClockTime duration;
 
   GSList *maps;
   GSList *keys;
-  GSList *segments;
-
-  gchar *digest;
+  GPtrArray *segments;           /* GstM3U8Segment, by sequence */
+  GArray *start_times;           /* GstClockTime, start of each segment */
+
+  /* parts of the segment being published, after the last segment */
+  GPtrArray *parts;              /* GstM3U8Part */
+  gint parts_sequence;
+  gboolean parts_discont;
+  GstM3U8Part *preload_hint;     /* EXT-X-PRELOAD-HINT */
+
+  /* fingerprint of the last data, to detect changes */
+  gsize data_size;
+  gint data_sequence;
+  gchar *data_last_uri;
+  guint32 data_hash;
+  gboolean data_hashed;
 };
 
 struct _GstM3U8Media             /* EXT-X-MEDIA */
@@ -171,6 +202,14 @@ struct _GstM3U8Client
 {
   GstM3U8VariantPlaylist master_playlist;
   GstM3U8Stream *stream;         /* selected stream */
+
+  /* master playlist parsing state */
+  GString *line;                 /* incomplete line */
+  GstM3U8Stream *pending_stream; /* stream waiting for its URI */
+  gboolean have_header;
+  gboolean is_variant;
+  gboolean is_rendition;
+  gboolean error;
 };
 
 gboolean gst_m3u8_hex_to_bin (const gchar * hex, guint8 *dest, gsize size);
@@ -179,17 +218,37 @@ GstM3U8Client *gst_m3u8_client_new (void);
 void gst_m3u8_client_free (GstM3U8Client * client);
 
 gboolean gst_m3u8_client_parse_master_playlist (GstM3U8Client * client,
-    gchar * data);
+    const gchar * data, gsize size);
+gboolean gst_m3u8_client_push_master_playlist (GstM3U8Client * client,
+    const gchar * data, gsize size);
+gboolean gst_m3u8_client_finish_master_playlist (GstM3U8Client * client,
+    const gchar * data, gsize size);
 
-gboolean gst_m3u8_playlist_update (GstM3U8Playlist * playlist, gchar * data,
-    gboolean * updated);
+gboolean gst_m3u8_playlist_update (GstM3U8Playlist * playlist,
+    const gchar * data, gsize size, gboolean * updated);
 
 GstM3U8Segment *gst_m3u8_playlist_get_segment (GstM3U8Playlist * playlist,
     gint sequence);
 
+GstM3U8Segment *gst_m3u8_playlist_find_segment (GstM3U8Playlist * playlist,
+    GstClockTime position, gboolean snap_after, GstClockTime * start);
+
+GstClockTime gst_m3u8_playlist_get_segment_start (GstM3U8Playlist * playlist,
+    GstM3U8Segment * segment);
+
+GstM3U8Part *gst_m3u8_playlist_get_part (GstM3U8Playlist * playlist,
+    gint sequence, guint index);
+
+gboolean gst_m3u8_playlist_get_live_start (GstM3U8Playlist * playlist,
+    gint * sequence, guint * part);
+
 GstM3U8Stream *gst_m3u8_client_select_stream (GstM3U8Client * client,
     gint max_bitrate);
 
+GstM3U8Stream *gst_m3u8_client_select_stream_for_buffer (
+    GstM3U8Client * client, GstClockTime level, GstClockTime capacity,
+    GstClockTime segment_duration);
+
 gboolean gst_m3u8_client_guess_stream_media_type (GstM3U8Client * client,
     GstM3U8Stream * stream, GstM3U8MediaType * media_type);
 
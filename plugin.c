@@ -3,12 +3,15 @@
 #include "gsthlsdemux.h"
 
 GST_DEBUG_CATEGORY (gst_hls_m3u8);
+GST_DEBUG_CATEGORY (gst_hls_sample_aes_debug);
 
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
   GST_DEBUG_CATEGORY_INIT (gst_hls_m3u8, "m3u8",
       (GST_DEBUG_BOLD | GST_DEBUG_FG_GREEN), "M3U8 playlist");
+  GST_DEBUG_CATEGORY_INIT (gst_hls_sample_aes_debug, "hlssampleaes", 0,
+      "HLS SAMPLE-AES decryption");
 
   if (!gst_element_register (plugin, "pochlsdemux", GST_RANK_PRIMARY + 1,
           GST_TYPE_HLS_DEMUX))
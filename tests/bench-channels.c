@@ -0,0 +1,224 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * bench-channels.c: threads and CPU used as the number of live channels
+ * played by the process grows
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <gst/gst.h>
+
+#include "http-server.h"
+
+/* each channel has a video and two audio renditions */
+static const gchar master_playlist[] =
+    "#EXTM3U\n"
+    "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aud\",NAME=\"en\",DEFAULT=YES,"
+    "URI=\"/audio-en.m3u8\"\n"
+    "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aud\",NAME=\"fr\",URI=\"/audio-fr.m3u8\"\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=800000,AUDIO=\"aud\"\n"
+    "/video-low.m3u8\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=2000000,AUDIO=\"aud\"\n"
+    "/video-high.m3u8\n";
+
+/* the server runs in a child process, so that its threads are not
+ * counted */
+static pid_t
+start_server (guint16 * port)
+{
+  TestHttpServer *server;
+  int fds[2];
+  pid_t pid;
+
+  if (pipe (fds) < 0)
+    g_error ("pipe failed");
+
+  pid = fork ();
+  if (pid < 0)
+    g_error ("fork failed");
+
+  if (pid > 0) {
+    close (fds[1]);
+    if (read (fds[0], port, sizeof (*port)) != sizeof (*port))
+      g_error ("server failed to start");
+    close (fds[0]);
+    return pid;
+  }
+
+  close (fds[0]);
+
+  server = test_http_server_new ();
+  test_http_server_add (server, "/master.m3u8", master_playlist);
+  test_http_server_add_live (server, "/video-low.m3u8", "/vl", 2, 4);
+  test_http_server_add_live (server, "/video-high.m3u8", "/vh", 2, 4);
+  test_http_server_add_live (server, "/audio-en.m3u8", "/ae", 2, 4);
+  test_http_server_add_live (server, "/audio-fr.m3u8", "/af", 2, 4);
+
+  *port = test_http_server_get_port (server);
+  if (write (fds[1], port, sizeof (*port)) != sizeof (*port))
+    _exit (1);
+  close (fds[1]);
+
+  for (;;)
+    pause ();
+}
+
+static guint
+count_threads (void)
+{
+  gchar *status, *line;
+  guint threads = 0;
+
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return 0;
+
+  line = strstr (status, "Threads:");
+  if (line)
+    threads = strtoul (line + 8, NULL, 10);
+  g_free (status);
+
+  return threads;
+}
+
+static gint64
+cpu_time (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+
+  return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+      G_USEC_PER_SEC + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void
+pad_added (GstElement * demux, GstPad * pad, GstBin * pipeline)
+{
+  GstElement *sink;
+  GstPad *sinkpad;
+
+  sink = gst_element_factory_make ("fakesink", NULL);
+  g_object_set (sink, "async", FALSE, NULL);
+  gst_bin_add (pipeline, sink);
+  gst_element_sync_state_with_parent (sink);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+}
+
+static GstElement *
+start_channel (guint16 port)
+{
+  GstElement *pipeline, *demux;
+  gchar *description;
+
+  description = g_strdup_printf ("souphttpsrc "
+      "location=http://127.0.0.1:%u/master.m3u8 ! pochlsdemux name=demux",
+      port);
+  pipeline = gst_parse_launch (description, NULL);
+  g_free (description);
+
+  if (!pipeline)
+    g_error ("failed to create pipeline");
+
+  demux = gst_bin_get_by_name (GST_BIN (pipeline), "demux");
+  g_signal_connect (demux, "pad-added", G_CALLBACK (pad_added), pipeline);
+  gst_object_unref (demux);
+
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  return pipeline;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const guint default_channels[] = { 1, 10, 50, 100, 300 };
+  GPtrArray *pipelines;
+  GError *err = NULL;
+  guint16 port;
+  pid_t server;
+  guint duration = 10;
+  guint i, j, n_steps;
+  guint *steps;
+
+  server = start_server (&port);
+
+  gst_init (&argc, &argv);
+
+  if (!gst_plugin_load_file (PLUGIN_PATH, &err))
+    g_error ("failed to load plugin: %s", err->message);
+
+  if (argc > 1) {
+    n_steps = argc - 1;
+    steps = g_new (guint, n_steps);
+    for (i = 0; i < n_steps; i++)
+      steps[i] = atoi (argv[i + 1]);
+  } else {
+    n_steps = G_N_ELEMENTS (default_channels);
+    steps = g_memdup (default_channels, sizeof (default_channels));
+  }
+
+  printf ("%8s %8s %16s %8s\n", "channels", "threads", "threads/channel",
+      "cpu %");
+
+  pipelines = g_ptr_array_new ();
+
+  for (i = 0; i < n_steps; i++) {
+    guint threads;
+    gint64 start, cpu;
+
+    while (pipelines->len < steps[i])
+      g_ptr_array_add (pipelines, start_channel (port));
+
+    /* let the channels start before measuring the steady state */
+    g_usleep (2 * G_USEC_PER_SEC);
+
+    start = g_get_monotonic_time ();
+    cpu = cpu_time ();
+    g_usleep (duration * G_USEC_PER_SEC);
+    cpu = cpu_time () - cpu;
+    start = g_get_monotonic_time () - start;
+
+    threads = count_threads ();
+
+    printf ("%8u %8u %16.1f %8.1f\n", pipelines->len, threads,
+        (gdouble) threads / pipelines->len, 100.0 * cpu / start);
+    fflush (stdout);
+  }
+
+  for (j = 0; j < pipelines->len; j++) {
+    GstElement *pipeline = g_ptr_array_index (pipelines, j);
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    gst_object_unref (pipeline);
+  }
+  g_ptr_array_free (pipelines, TRUE);
+  g_free (steps);
+
+  kill (server, SIGTERM);
+  waitpid (server, NULL, 0);
+
+  return 0;
+}
@@ -0,0 +1,97 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * bench-decrypt.c: AES-128 CBC decryption throughput, serial and sliced
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+
+#include "gsthlsdecrypt.h"
+
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+static const guint8 key[16];
+static const guint8 iv[16];
+
+static void
+decrypt_serial (guint8 * data, gsize size, guint n_slices)
+{
+  EVP_CIPHER_CTX ctx;
+  gint outsize = size;
+
+  EVP_CIPHER_CTX_init (&ctx);
+  EVP_CipherInit_ex (&ctx, EVP_aes_128_cbc (), NULL, key, iv, AES_DECRYPT);
+  EVP_CIPHER_CTX_set_padding (&ctx, 0);
+  EVP_CipherUpdate (&ctx, data, &outsize, data, size);
+  EVP_CIPHER_CTX_cleanup (&ctx);
+}
+
+static void
+decrypt_sliced (guint8 * data, gsize size, guint n_slices)
+{
+  gst_hls_decrypt_aes128_cbc_slices (key, iv, data, size, n_slices);
+}
+
+/* throughput in MB/s, decrypting the same buffer until enough data went
+ * through */
+static gdouble
+measure (void (*func) (guint8 *, gsize, guint), guint8 * data, gsize size,
+    guint n_slices)
+{
+  gint64 start;
+  gsize done;
+
+  func (data, size, n_slices);
+
+  start = g_get_monotonic_time ();
+  for (done = 0; done < BENCH_BYTES; done += size)
+    func (data, size, n_slices);
+
+  return (gdouble) done / (g_get_monotonic_time () - start);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const gsize sizes[] = { 128 * 1024, 1024 * 1024, 8 * 1024 * 1024 };
+  guint n_cpus = g_get_num_processors ();
+  guint i, n_slices;
+
+  printf ("%10s %8s %12s %12s\n", "size", "slices", "serial MB/s",
+      "sliced MB/s");
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+    guint8 *data = g_malloc0 (sizes[i]);
+    gdouble serial;
+
+    serial = measure (decrypt_serial, data, sizes[i], 1);
+
+    for (n_slices = 1; n_slices <= MAX (n_cpus, 2); n_slices *= 2) {
+      printf ("%10" G_GSIZE_FORMAT " %8u %12.1f %12.1f\n", sizes[i], n_slices,
+          serial, measure (decrypt_sliced, data, sizes[i], n_slices));
+      fflush (stdout);
+    }
+
+    g_free (data);
+  }
+
+  return 0;
+}
@@ -0,0 +1,105 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * bench-m3u8.c: time spent updating live playlists, when they changed and
+ * when they are reloaded unchanged
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <gst/gst.h>
+
+#include "m3u8.h"
+
+GST_DEBUG_CATEGORY (gst_hls_m3u8);
+
+static gchar *
+live_playlist (guint sequence, guint n_segments)
+{
+  GString *data;
+  guint i;
+
+  data = g_string_new ("#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:2\n");
+  g_string_append_printf (data, "#EXT-X-MEDIA-SEQUENCE:%u\n", sequence);
+
+  for (i = sequence; i < sequence + n_segments; i++)
+    g_string_append_printf (data, "#EXTINF:2.000,\n"
+        "http://cdn.example.com/live/channel/segment-%08u.ts\n", i);
+
+  return g_string_free (data, FALSE);
+}
+
+/* average time of an update in microseconds, the playlist sliding by one
+ * segment at each update or reloaded as is */
+static gdouble
+measure (guint n_segments, gboolean sliding)
+{
+  GstM3U8Client *client;
+  GstM3U8Stream *stream;
+  gchar **updates;
+  gboolean updated;
+  gint64 start;
+  guint i, n_updates;
+
+  /* about the same amount of data for all sizes */
+  n_updates = CLAMP (100000 / n_segments, 10, 1000);
+
+  updates = g_new (gchar *, n_updates + 1);
+  for (i = 0; i <= n_updates; i++)
+    updates[i] = live_playlist (sliding ? i : 0, n_segments);
+
+  client = gst_m3u8_client_new ();
+  if (!gst_m3u8_client_parse_master_playlist (client, updates[0],
+          strlen (updates[0])))
+    g_error ("failed to parse playlist");
+  stream = client->master_playlist.streams->data;
+
+  start = g_get_monotonic_time ();
+  for (i = 1; i <= n_updates; i++)
+    gst_m3u8_playlist_update (stream->playlist, updates[i],
+        strlen (updates[i]), &updated);
+  start = g_get_monotonic_time () - start;
+
+  gst_m3u8_client_free (client);
+  for (i = 0; i <= n_updates; i++)
+    g_free (updates[i]);
+  g_free (updates);
+
+  return (gdouble) start / n_updates;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const guint sizes[] = { 10, 100, 1000, 10000 };
+  guint i;
+
+  gst_init (&argc, &argv);
+
+  GST_DEBUG_CATEGORY_INIT (gst_hls_m3u8, "m3u8", 0, "M3U8 parser");
+
+  printf ("%10s %14s %14s\n", "segments", "changed us", "unchanged us");
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+    printf ("%10u %14.1f %14.1f\n", sizes[i], measure (sizes[i], TRUE),
+        measure (sizes[i], FALSE));
+    fflush (stdout);
+  }
+
+  return 0;
+}
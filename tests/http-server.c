@@ -0,0 +1,439 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * http-server.c:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include "http-server.h"
+
+#define TS_PACKET_SIZE 188
+#define DEFAULT_SEGMENT_SIZE (TS_PACKET_SIZE * 1024)
+
+typedef struct {
+  gchar *prefix;
+  guint target_duration;
+  guint window;
+  gboolean live;
+} TestPlaylist;
+
+struct _TestHttpServer {
+  gint ref_count;
+  GSocketService *service;
+  GMainContext *context;
+  GMainLoop *loop;
+  GThread *thread;
+  guint16 port;
+  gint64 start_time;
+
+  GMutex lock;
+  GHashTable *resources;
+  GHashTable *playlists;
+  GHashTable *requests;
+  GHashTable *delays;
+  guint latency;
+  gsize segment_size;
+};
+
+static void
+test_playlist_free (TestPlaylist * playlist)
+{
+  g_free (playlist->prefix);
+  g_free (playlist);
+}
+
+static GBytes *
+test_playlist_generate (TestHttpServer * server, TestPlaylist * playlist)
+{
+  GString *data;
+  guint first, last, i;
+
+  if (playlist->live) {
+    last = (g_get_monotonic_time () - server->start_time) /
+        (playlist->target_duration * G_USEC_PER_SEC) + playlist->window;
+    first = last - playlist->window + 1;
+  } else {
+    first = 0;
+    last = playlist->window - 1;
+  }
+
+  data = g_string_new ("#EXTM3U\n#EXT-X-VERSION:3\n");
+  g_string_append_printf (data, "#EXT-X-TARGETDURATION:%u\n",
+      playlist->target_duration);
+  g_string_append_printf (data, "#EXT-X-MEDIA-SEQUENCE:%u\n", first);
+
+  for (i = first; i <= last; i++)
+    g_string_append_printf (data, "#EXTINF:%u.0,\n%s%u.ts\n",
+        playlist->target_duration, playlist->prefix, i);
+
+  if (!playlist->live)
+    g_string_append (data, "#EXT-X-ENDLIST\n");
+
+  return g_string_free_to_bytes (data);
+}
+
+/* null packets, enough for the data to be typefound as MPEG-TS */
+static GBytes *
+test_segment_generate (gsize size)
+{
+  guint8 *data;
+  gsize offset;
+
+  size -= size % TS_PACKET_SIZE;
+  data = g_malloc (size);
+  memset (data, 0xff, size);
+
+  for (offset = 0; offset < size; offset += TS_PACKET_SIZE) {
+    data[offset] = 0x47;
+    data[offset + 1] = 0x1f;
+    data[offset + 2] = 0xff;
+    data[offset + 3] = 0x10;
+  }
+
+  return g_bytes_new_take (data, size);
+}
+
+static GBytes *
+test_http_server_lookup (TestHttpServer * server, const gchar * path)
+{
+  TestPlaylist *playlist;
+  GBytes *bytes;
+
+  g_mutex_lock (&server->lock);
+
+  g_hash_table_insert (server->requests, g_strdup (path),
+      GUINT_TO_POINTER (GPOINTER_TO_UINT (g_hash_table_lookup
+              (server->requests, path)) + 1));
+
+  bytes = g_hash_table_lookup (server->resources, path);
+  if (bytes) {
+    bytes = g_bytes_ref (bytes);
+  } else if ((playlist = g_hash_table_lookup (server->playlists, path))) {
+    bytes = test_playlist_generate (server, playlist);
+  } else if (g_str_has_suffix (path, ".ts")) {
+    bytes = test_segment_generate (server->segment_size);
+  }
+
+  g_mutex_unlock (&server->lock);
+
+  return bytes;
+}
+
+static gboolean
+test_http_server_write (GOutputStream * out, const gchar * status,
+    GBytes * body, gsize offset, gsize size)
+{
+  gchar *header;
+  gboolean ret;
+
+  header = g_strdup_printf ("HTTP/1.1 %s\r\n"
+      "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+      "Connection: keep-alive\r\n\r\n", status, size);
+
+  ret = g_output_stream_write_all (out, header, strlen (header), NULL, NULL,
+      NULL);
+  g_free (header);
+
+  if (ret && size > 0)
+    ret = g_output_stream_write_all (out,
+        (const guint8 *) g_bytes_get_data (body, NULL) + offset, size, NULL,
+        NULL, NULL);
+
+  return ret;
+}
+
+/* the connections keep the server data alive, they may still be waiting to
+ * respond when the server is freed */
+static void
+test_http_server_unref (TestHttpServer * server)
+{
+  if (!g_atomic_int_dec_and_test (&server->ref_count))
+    return;
+
+  g_hash_table_unref (server->resources);
+  g_hash_table_unref (server->playlists);
+  g_hash_table_unref (server->requests);
+  g_hash_table_unref (server->delays);
+  g_mutex_clear (&server->lock);
+  g_free (server);
+}
+
+/* requests are answered in turn on each connection, until it is closed */
+static gboolean
+test_http_server_run (GThreadedSocketService * service,
+    GSocketConnection * connection, GObject * source, TestHttpServer * server)
+{
+  GDataInputStream *in;
+  GOutputStream *out;
+
+  g_atomic_int_inc (&server->ref_count);
+
+  in = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM
+          (connection)));
+  g_data_input_stream_set_newline_type (in, G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+  out = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+
+  for (;;) {
+    gchar *line, *path, *query;
+    gchar **request;
+    gint64 range_start = 0, range_end = -1;
+    GBytes *body;
+    gsize size;
+    guint delay;
+    gboolean ok;
+
+    line = g_data_input_stream_read_line (in, NULL, NULL, NULL);
+    if (!line)
+      break;
+
+    request = g_strsplit (line, " ", 3);
+    g_free (line);
+
+    /* headers, only the byte range is used */
+    while ((line = g_data_input_stream_read_line (in, NULL, NULL, NULL))) {
+      if (*line == '\0') {
+        g_free (line);
+        break;
+      }
+      if (g_ascii_strncasecmp (line, "Range: bytes=", 13) == 0) {
+        gchar *end;
+
+        range_start = g_ascii_strtoll (line + 13, &end, 10);
+        if (*end == '-' && g_ascii_isdigit (end[1]))
+          range_end = g_ascii_strtoll (end + 1, NULL, 10);
+      }
+      g_free (line);
+    }
+
+    if (g_strv_length (request) < 2) {
+      g_strfreev (request);
+      break;
+    }
+
+    path = g_strdup (request[1]);
+    g_strfreev (request);
+    if ((query = strchr (path, '?')))
+      *query = '\0';
+
+    if (server->latency)
+      g_usleep (server->latency * 1000);
+
+    g_mutex_lock (&server->lock);
+    delay = GPOINTER_TO_UINT (g_hash_table_lookup (server->delays, path));
+    g_mutex_unlock (&server->lock);
+
+    if (delay)
+      g_usleep (delay * 1000);
+
+    body = test_http_server_lookup (server, path);
+    g_free (path);
+
+    if (!body) {
+      ok = test_http_server_write (out, "404 Not Found", NULL, 0, 0);
+    } else {
+      size = g_bytes_get_size (body);
+      if (range_start >= (gint64) size)
+        range_start = size;
+      if (range_end < 0 || range_end >= (gint64) size)
+        range_end = size - 1;
+
+      ok = test_http_server_write (out,
+          range_start > 0 || range_end < (gint64) size - 1 ?
+          "206 Partial Content" : "200 OK", body, range_start,
+          range_end - range_start + 1);
+      g_bytes_unref (body);
+    }
+
+    if (!ok)
+      break;
+  }
+
+  g_object_unref (in);
+  test_http_server_unref (server);
+
+  return TRUE;
+}
+
+static gpointer
+test_http_server_loop (TestHttpServer * server)
+{
+  g_main_context_push_thread_default (server->context);
+  g_main_loop_run (server->loop);
+  g_main_context_pop_thread_default (server->context);
+
+  return NULL;
+}
+
+/* connections are accepted from a thread of the server, the application
+ * does not need to run a main loop */
+TestHttpServer *
+test_http_server_new (void)
+{
+  TestHttpServer *server;
+  GSocketAddress *address, *effective;
+  GError *err = NULL;
+
+  server = g_new0 (TestHttpServer, 1);
+  server->ref_count = 1;
+  server->start_time = g_get_monotonic_time ();
+  server->segment_size = DEFAULT_SEGMENT_SIZE;
+
+  g_mutex_init (&server->lock);
+  server->resources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) g_bytes_unref);
+  server->playlists = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) test_playlist_free);
+  server->requests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      NULL);
+  server->delays = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      NULL);
+
+  server->context = g_main_context_new ();
+  server->loop = g_main_loop_new (server->context, FALSE);
+  g_main_context_push_thread_default (server->context);
+
+  server->service = g_threaded_socket_service_new (-1);
+  g_signal_connect (server->service, "run", G_CALLBACK (test_http_server_run),
+      server);
+
+  address = g_inet_socket_address_new_from_string ("127.0.0.1", 0);
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (server->service),
+          address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL,
+          &effective, &err))
+    g_error ("failed to listen: %s", err->message);
+  g_object_unref (address);
+
+  server->port =
+      g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (effective));
+  g_object_unref (effective);
+
+  g_socket_service_start (server->service);
+  g_main_context_pop_thread_default (server->context);
+
+  server->thread = g_thread_new ("http-server",
+      (GThreadFunc) test_http_server_loop, server);
+
+  return server;
+}
+
+void
+test_http_server_free (TestHttpServer * server)
+{
+  g_socket_service_stop (server->service);
+  g_socket_listener_close (G_SOCKET_LISTENER (server->service));
+  g_object_unref (server->service);
+
+  g_main_loop_quit (server->loop);
+  g_thread_join (server->thread);
+  g_main_loop_unref (server->loop);
+  g_main_context_unref (server->context);
+
+  test_http_server_unref (server);
+}
+
+guint16
+test_http_server_get_port (TestHttpServer * server)
+{
+  return server->port;
+}
+
+gchar *
+test_http_server_get_uri (TestHttpServer * server, const gchar * path)
+{
+  return g_strdup_printf ("http://127.0.0.1:%u%s", server->port, path);
+}
+
+void
+test_http_server_set_latency (TestHttpServer * server, guint latency)
+{
+  server->latency = latency;
+}
+
+void
+test_http_server_set_segment_size (TestHttpServer * server, gsize size)
+{
+  g_mutex_lock (&server->lock);
+  server->segment_size = size;
+  g_mutex_unlock (&server->lock);
+}
+
+void
+test_http_server_set_delay (TestHttpServer * server, const gchar * path,
+    guint delay)
+{
+  g_mutex_lock (&server->lock);
+  g_hash_table_insert (server->delays, g_strdup (path),
+      GUINT_TO_POINTER (delay));
+  g_mutex_unlock (&server->lock);
+}
+
+void
+test_http_server_add (TestHttpServer * server, const gchar * path,
+    const gchar * data)
+{
+  g_mutex_lock (&server->lock);
+  g_hash_table_insert (server->resources, g_strdup (path),
+      g_bytes_new (data, strlen (data)));
+  g_mutex_unlock (&server->lock);
+}
+
+static void
+test_http_server_add_playlist (TestHttpServer * server, const gchar * path,
+    const gchar * prefix, guint target_duration, guint window, gboolean live)
+{
+  TestPlaylist *playlist;
+
+  playlist = g_new0 (TestPlaylist, 1);
+  playlist->prefix = g_strdup (prefix);
+  playlist->target_duration = target_duration;
+  playlist->window = window;
+  playlist->live = live;
+
+  g_mutex_lock (&server->lock);
+  g_hash_table_insert (server->playlists, g_strdup (path), playlist);
+  g_mutex_unlock (&server->lock);
+}
+
+void
+test_http_server_add_live (TestHttpServer * server, const gchar * path,
+    const gchar * prefix, guint target_duration, guint window)
+{
+  test_http_server_add_playlist (server, path, prefix, target_duration,
+      window, TRUE);
+}
+
+void
+test_http_server_add_vod (TestHttpServer * server, const gchar * path,
+    const gchar * prefix, guint target_duration, guint n_segments)
+{
+  test_http_server_add_playlist (server, path, prefix, target_duration,
+      n_segments, FALSE);
+}
+
+guint
+test_http_server_get_requests (TestHttpServer * server, const gchar * path)
+{
+  guint requests;
+
+  g_mutex_lock (&server->lock);
+  requests = GPOINTER_TO_UINT (g_hash_table_lookup (server->requests, path));
+  g_mutex_unlock (&server->lock);
+
+  return requests;
+}
@@ -0,0 +1,64 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * http-server.h
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef TEST_HTTP_SERVER_H_
+# define TEST_HTTP_SERVER_H_
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* local HTTP server standing in for a CDN in the tests and benchmarks. It
+ * serves static resources and generated playlists, any other .ts path is
+ * answered with MPEG-TS null packets. */
+typedef struct _TestHttpServer TestHttpServer;
+
+TestHttpServer *test_http_server_new (void);
+void test_http_server_free (TestHttpServer * server);
+
+guint16 test_http_server_get_port (TestHttpServer * server);
+gchar *test_http_server_get_uri (TestHttpServer * server, const gchar * path);
+
+/* delay added before each response, in milliseconds */
+void test_http_server_set_latency (TestHttpServer * server, guint latency);
+void test_http_server_set_segment_size (TestHttpServer * server, gsize size);
+
+/* delay added before the responses for a path, in milliseconds */
+void test_http_server_set_delay (TestHttpServer * server, const gchar * path,
+    guint delay);
+
+void test_http_server_add (TestHttpServer * server, const gchar * path,
+    const gchar * data);
+
+/* media playlist of segments named <prefix><sequence>.ts. A live playlist
+ * slides its window as time passes, a VOD playlist lists all segments */
+void test_http_server_add_live (TestHttpServer * server, const gchar * path,
+    const gchar * prefix, guint target_duration, guint window);
+void test_http_server_add_vod (TestHttpServer * server, const gchar * path,
+    const gchar * prefix, guint target_duration, guint n_segments);
+
+/* number of requests for a path, the query is ignored */
+guint test_http_server_get_requests (TestHttpServer * server,
+    const gchar * path);
+
+G_END_DECLS
+
+#endif /* TEST_HTTP_SERVER_H_ */
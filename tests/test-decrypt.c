@@ -0,0 +1,146 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * test-decrypt.c: sliced AES-128 CBC decryption against the serial one
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+
+#include "gsthlsdecrypt.h"
+
+static const guint8 key[16] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+static const guint8 iv[16] = {
+  0xf0, 0xe1, 0xd2, 0xc3, 0xb4, 0xa5, 0x96, 0x87,
+  0x78, 0x69, 0x5a, 0x4b, 0x3c, 0x2d, 0x1e, 0x0f
+};
+
+static void
+cbc (gint enc, guint8 * data, gsize size)
+{
+  EVP_CIPHER_CTX ctx;
+  gint outsize = size;
+
+  EVP_CIPHER_CTX_init (&ctx);
+  EVP_CipherInit_ex (&ctx, EVP_aes_128_cbc (), NULL, key, iv, enc);
+  EVP_CIPHER_CTX_set_padding (&ctx, 0);
+  EVP_CipherUpdate (&ctx, data, &outsize, data, size);
+  EVP_CIPHER_CTX_cleanup (&ctx);
+}
+
+static guint8 *
+plaintext_new (gsize size)
+{
+  guint8 *data;
+  gsize i;
+
+  data = g_malloc (size);
+  for (i = 0; i < size; i++)
+    data[i] = g_random_int ();
+
+  return data;
+}
+
+/* sizes around the slice boundaries, with slices one block long, uneven
+ * slices and a last slice longer than the others */
+static void
+test_slices (void)
+{
+  static const gsize sizes[] = {
+    16, 48, 1024,
+    GST_HLS_DECRYPT_SLICE_MIN_SIZE - 16,
+    GST_HLS_DECRYPT_SLICE_MIN_SIZE,
+    GST_HLS_DECRYPT_SLICE_MIN_SIZE + 16,
+    2 * GST_HLS_DECRYPT_SLICE_MIN_SIZE - 16,
+    2 * GST_HLS_DECRYPT_SLICE_MIN_SIZE,
+    2 * GST_HLS_DECRYPT_SLICE_MIN_SIZE + 16,
+    1024 * 1024 + 48
+  };
+  guint i, n_slices;
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+    gsize size = sizes[i];
+    guint8 *plain, *cipher, *serial, *sliced;
+
+    plain = plaintext_new (size);
+    cipher = g_memdup (plain, size);
+    cbc (AES_ENCRYPT, cipher, size);
+
+    serial = g_memdup (cipher, size);
+    cbc (AES_DECRYPT, serial, size);
+    g_assert (memcmp (serial, plain, size) == 0);
+
+    for (n_slices = 1; n_slices <= 8; n_slices++) {
+      sliced = g_memdup (cipher, size);
+      gst_hls_decrypt_aes128_cbc_slices (key, iv, sliced, size, n_slices);
+      if (memcmp (sliced, serial, size) != 0)
+        g_error ("%" G_GSIZE_FORMAT " bytes in %u slices differ", size,
+            n_slices);
+      g_free (sliced);
+    }
+
+    g_free (serial);
+    g_free (cipher);
+    g_free (plain);
+  }
+}
+
+static void
+test_parallel (void)
+{
+  gsize size = 4 * GST_HLS_DECRYPT_SLICE_MIN_SIZE;
+  guint8 *plain, *data;
+
+  plain = plaintext_new (size);
+  data = g_memdup (plain, size);
+  cbc (AES_ENCRYPT, data, size);
+
+  /* too small to be split, left for the caller to decrypt */
+  g_assert (!gst_hls_decrypt_aes128_cbc_parallel (key, iv, data,
+          GST_HLS_DECRYPT_SLICE_MIN_SIZE));
+  cbc (AES_ENCRYPT, plain, GST_HLS_DECRYPT_SLICE_MIN_SIZE);
+  g_assert (memcmp (data, plain, GST_HLS_DECRYPT_SLICE_MIN_SIZE) == 0);
+  g_free (plain);
+
+  plain = g_memdup (data, size);
+  cbc (AES_DECRYPT, plain, size);
+
+  if (gst_hls_decrypt_aes128_cbc_parallel (key, iv, data, size))
+    g_assert (memcmp (data, plain, size) == 0);
+  else
+    g_assert_cmpuint (g_get_num_processors (), <, 2);
+
+  g_free (data);
+  g_free (plain);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/decrypt/slices", test_slices);
+  g_test_add_func ("/decrypt/parallel", test_parallel);
+
+  return g_test_run ();
+}
@@ -0,0 +1,424 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * test-sample-aes.c: SAMPLE-AES decryption of MPEG-TS segments built with
+ * openssl
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include <gst/gst.h>
+
+#include "gsthlssampleaes.h"
+
+GST_DEBUG_CATEGORY (gst_hls_sample_aes_debug);
+
+#define TS_PACKET_SIZE 188
+
+#define PMT_PID 0x100
+#define VIDEO_PID 0x101
+#define AUDIO_PID 0x102
+
+/* NAL units of 20 bytes after three encrypted blocks in their pattern, and
+ * ADTS frames of three encrypted blocks with 5 trailing clear bytes */
+#define NAL_SIZE (32 + 3 * 160 + 20)
+#define ADTS_FRAME_SIZE (7 + 16 + 3 * 16 + 5)
+
+static const guint8 key[16] = {
+  0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+  0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+
+static const guint8 iv[16] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+/* first encrypted block of the NAL unit, chosen so that the escaped data has
+ * emulation prevention bytes inside the block and across its start */
+static const guint8 nal_cipher_block[16] = {
+  0x01, 0x00, 0x00, 0x00, 0x00, 0x02, 0x5a, 0x00,
+  0x00, 0x03, 0xa5, 0x00, 0x00, 0x01, 0x3c, 0xc3
+};
+
+/* encrypt or decrypt the blocks of a sample as a single CBC chain
+ * starting from the IV */
+static void
+cbc_blocks (gint enc, guint8 * data, const gsize * offsets, guint n_blocks)
+{
+  EVP_CIPHER_CTX ctx;
+  gint outsize;
+  guint i;
+
+  EVP_CIPHER_CTX_init (&ctx);
+  EVP_CipherInit_ex (&ctx, EVP_aes_128_cbc (), NULL, key, iv, enc);
+  EVP_CIPHER_CTX_set_padding (&ctx, 0);
+
+  for (i = 0; i < n_blocks; i++) {
+    outsize = 16;
+    EVP_CipherUpdate (&ctx, data + offsets[i], &outsize, data + offsets[i],
+        16);
+  }
+
+  EVP_CIPHER_CTX_cleanup (&ctx);
+}
+
+static void
+fill_random (guint8 * data, gsize size)
+{
+  while (size--)
+    *data++ = g_random_int_range (0x10, 0x100);
+}
+
+static void
+append_crc (GByteArray * section)
+{
+  guint32 crc = 0xffffffff;
+  guint8 bytes[4];
+  guint i, j;
+
+  for (i = 0; i < section->len; i++) {
+    crc ^= section->data[i] << 24;
+    for (j = 0; j < 8; j++)
+      crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+  }
+
+  GST_WRITE_UINT32_BE (bytes, crc);
+  g_byte_array_append (section, bytes, 4);
+}
+
+/* packetize a PES packet or a PSI section, the last packet is padded with
+ * adaptation field stuffing */
+static void
+append_packets (GByteArray * ts, guint pid, const guint8 * data, gsize size,
+    gboolean psi)
+{
+  gboolean first = TRUE;
+  guint8 packet[TS_PACKET_SIZE];
+  guint8 *payload;
+  gsize avail, chunk;
+
+  while (size > 0) {
+    memset (packet, 0xff, sizeof (packet));
+    packet[0] = 0x47;
+    packet[1] = (first ? 0x40 : 0x00) | (pid >> 8);
+    packet[2] = pid & 0xff;
+    packet[3] = 0x10;
+
+    payload = packet + 4;
+    avail = TS_PACKET_SIZE - 4;
+
+    if (psi) {
+      /* pointer field, the section is followed by stuffing bytes */
+      *payload++ = 0;
+      avail--;
+    } else if (size < avail) {
+      packet[3] |= 0x20;
+      packet[4] = avail - size - 1;
+      if (packet[4] > 0)
+        packet[5] = 0x00;
+      payload += avail - size;
+      avail = size;
+    }
+
+    chunk = MIN (size, avail);
+    memcpy (payload, data, chunk);
+    g_byte_array_append (ts, packet, sizeof (packet));
+
+    data += chunk;
+    size -= chunk;
+    first = FALSE;
+  }
+}
+
+static void
+append_pat (GByteArray * ts)
+{
+  static const guint8 pat[] = {
+    0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+    0x00, 0x01, 0xe0 | (PMT_PID >> 8), PMT_PID & 0xff
+  };
+  GByteArray *section;
+
+  section = g_byte_array_new ();
+  g_byte_array_append (section, pat, sizeof (pat));
+  append_crc (section);
+  append_packets (ts, 0, section->data, section->len, TRUE);
+  g_byte_array_unref (section);
+}
+
+static void
+append_pmt (GByteArray * ts, guint8 video_type, guint8 audio_type)
+{
+  const guint8 pmt[] = {
+    0x02, 0xb0, 0x17, 0x00, 0x01, 0xc1, 0x00, 0x00,
+    0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0x00,
+    video_type, 0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0x00,
+    audio_type, 0xe0 | (AUDIO_PID >> 8), AUDIO_PID & 0xff, 0xf0, 0x00
+  };
+  GByteArray *section;
+
+  section = g_byte_array_new ();
+  g_byte_array_append (section, pmt, sizeof (pmt));
+  append_crc (section);
+  append_packets (ts, PMT_PID, section->data, section->len, TRUE);
+  g_byte_array_unref (section);
+}
+
+static void
+append_pes (GByteArray * ts, guint pid, guint8 stream_id, GByteArray * es)
+{
+  guint8 header[] = {
+    0x00, 0x00, 0x01, stream_id, 0x00, 0x00,
+    0x80, 0x80, 0x05, 0x21, 0x00, 0x01, 0x00, 0x01
+  };
+  GByteArray *pes;
+  gsize length;
+
+  /* unbounded video PES packets */
+  length = stream_id == 0xe0 ? 0 : es->len + sizeof (header) - 6;
+  header[4] = length >> 8;
+  header[5] = length & 0xff;
+
+  pes = g_byte_array_new ();
+  g_byte_array_append (pes, header, sizeof (header));
+  g_byte_array_append (pes, es->data, es->len);
+  append_packets (ts, pid, pes->data, pes->len, FALSE);
+  g_byte_array_unref (pes);
+}
+
+/* escape the NAL unit data the way the encoder does after encryption */
+static void
+append_escaped (GByteArray * es, const guint8 * data, gsize size)
+{
+  static const guint8 epb = 0x03;
+  guint zeros = 0;
+  gsize i;
+
+  for (i = 0; i < size; i++) {
+    if (zeros >= 2 && data[i] <= 0x03) {
+      g_byte_array_append (es, &epb, 1);
+      zeros = 0;
+    }
+
+    g_byte_array_append (es, &data[i], 1);
+    zeros = data[i] == 0 ? zeros + 1 : 0;
+  }
+}
+
+/* a SPS left in the clear, followed by an encrypted IDR slice. The leader
+ * ends with zeros, continued by the first encrypted block. The decrypted
+ * slice is written back unescaped, followed by as many zeros as emulation
+ * prevention bytes were removed. */
+static void
+make_video (GByteArray * encrypted, GByteArray * clear)
+{
+  static const guint8 start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+  static const guint8 sps[] = {
+    0x67, 0x42, 0x00, 0x1e, 0x95, 0xa8, 0x28, 0x0f, 0x64
+  };
+  static const guint8 zero = 0;
+  guint8 nal[NAL_SIZE];
+  gsize offsets[4];
+  guint i, n_epb;
+
+  fill_random (nal, sizeof (nal));
+  nal[0] = 0x65;
+  nal[5] = nal[6] = nal[7] = 0x00;
+  nal[30] = nal[31] = 0x00;
+  nal[NAL_SIZE - 1] = 0x80;
+
+  for (i = 0; i < G_N_ELEMENTS (offsets); i++)
+    offsets[i] = 32 + i * 160;
+
+  /* derive the plaintext from the chosen first ciphertext block */
+  memcpy (nal + offsets[0], nal_cipher_block, 16);
+  cbc_blocks (AES_DECRYPT, nal, offsets, 1);
+  cbc_blocks (AES_ENCRYPT, nal, offsets, G_N_ELEMENTS (offsets));
+  g_assert (memcmp (nal + offsets[0], nal_cipher_block, 16) == 0);
+
+  g_byte_array_append (encrypted, start_code, sizeof (start_code));
+  g_byte_array_append (encrypted, sps, sizeof (sps));
+  g_byte_array_append (encrypted, start_code, sizeof (start_code));
+  n_epb = encrypted->len;
+  append_escaped (encrypted, nal, sizeof (nal));
+  n_epb = encrypted->len - n_epb - sizeof (nal);
+  g_assert_cmpuint (n_epb, >=, 5);
+
+  cbc_blocks (AES_DECRYPT, nal, offsets, G_N_ELEMENTS (offsets));
+
+  g_byte_array_append (clear, start_code, sizeof (start_code));
+  g_byte_array_append (clear, sps, sizeof (sps));
+  g_byte_array_append (clear, start_code, sizeof (start_code));
+  g_byte_array_append (clear, nal, sizeof (nal));
+  for (i = 0; i < n_epb; i++)
+    g_byte_array_append (clear, &zero, 1);
+}
+
+/* two ADTS frames, only the full blocks after the leader are encrypted */
+static void
+make_audio (GByteArray * encrypted, GByteArray * clear)
+{
+  guint8 frame[ADTS_FRAME_SIZE];
+  gsize offsets[3];
+  guint i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (offsets); i++)
+    offsets[i] = 7 + 16 + i * 16;
+
+  for (j = 0; j < 2; j++) {
+    fill_random (frame, sizeof (frame));
+    frame[0] = 0xff;
+    frame[1] = 0xf1;
+    frame[2] = 0x50;
+    frame[3] = 0x80 | ((ADTS_FRAME_SIZE >> 11) & 0x03);
+    frame[4] = (ADTS_FRAME_SIZE >> 3) & 0xff;
+    frame[5] = ((ADTS_FRAME_SIZE & 0x07) << 5) | 0x1f;
+    frame[6] = 0xfc;
+
+    g_byte_array_append (clear, frame, sizeof (frame));
+    cbc_blocks (AES_ENCRYPT, frame, offsets, G_N_ELEMENTS (offsets));
+    g_byte_array_append (encrypted, frame, sizeof (frame));
+  }
+}
+
+static void
+make_segment (GByteArray * encrypted, GByteArray * clear)
+{
+  GByteArray *video, *video_clear, *audio, *audio_clear;
+
+  video = g_byte_array_new ();
+  video_clear = g_byte_array_new ();
+  audio = g_byte_array_new ();
+  audio_clear = g_byte_array_new ();
+
+  make_video (video, video_clear);
+  make_audio (audio, audio_clear);
+
+  /* the encrypted stream types are replaced by the clear ones */
+  append_pat (encrypted);
+  append_pmt (encrypted, 0xdb, 0xcf);
+  append_pes (encrypted, VIDEO_PID, 0xe0, video);
+  append_pes (encrypted, AUDIO_PID, 0xc0, audio);
+
+  append_pat (clear);
+  append_pmt (clear, 0x1b, 0x0f);
+  append_pes (clear, VIDEO_PID, 0xe0, video_clear);
+  append_pes (clear, AUDIO_PID, 0xc0, audio_clear);
+
+  g_assert_cmpuint (encrypted->len, ==, clear->len);
+
+  g_byte_array_unref (video);
+  g_byte_array_unref (video_clear);
+  g_byte_array_unref (audio);
+  g_byte_array_unref (audio_clear);
+}
+
+/* decrypt the segment handed over in chunks of the given sizes, the last
+ * chunk taking the rest */
+static void
+check_decrypt (const gsize * chunks, guint n_chunks)
+{
+  GstHlsSampleAes *dec;
+  GByteArray *segment, *clear;
+  GstMapInfo *maps;
+  gsize offset = 0;
+  guint i;
+
+  segment = g_byte_array_new ();
+  clear = g_byte_array_new ();
+  make_segment (segment, clear);
+
+  maps = g_new0 (GstMapInfo, n_chunks + 1);
+  for (i = 0; i < n_chunks && offset < segment->len; i++) {
+    maps[i].data = segment->data + offset;
+    maps[i].size = MIN (chunks[i], segment->len - offset);
+    offset += maps[i].size;
+  }
+  if (offset < segment->len) {
+    maps[i].data = segment->data + offset;
+    maps[i].size = segment->len - offset;
+    i++;
+  }
+
+  dec = gst_hls_sample_aes_new ();
+  gst_hls_sample_aes_set_key (dec, key, iv);
+  g_assert (gst_hls_sample_aes_decrypt (dec, maps, i));
+  gst_hls_sample_aes_free (dec);
+
+  for (offset = 0; offset < segment->len; offset++) {
+    if (segment->data[offset] != clear->data[offset])
+      g_error ("mismatch at packet %" G_GSIZE_FORMAT " byte %" G_GSIZE_FORMAT,
+          offset / TS_PACKET_SIZE, offset % TS_PACKET_SIZE);
+  }
+
+  g_free (maps);
+  g_byte_array_unref (segment);
+  g_byte_array_unref (clear);
+}
+
+static void
+test_whole (void)
+{
+  check_decrypt (NULL, 0);
+}
+
+/* packets split in two, in three with a single byte in the middle, and the
+ * PES header split from its payload */
+static void
+test_split_packets (void)
+{
+  static const gsize split[] = { 100, 188, 1, 200, 4 * 188 + 13 };
+  static const gsize bytes[] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+  static const gsize pes_header[] = { 2 * 188 + 4 + 9, 5 };
+
+  check_decrypt (split, G_N_ELEMENTS (split));
+  check_decrypt (bytes, G_N_ELEMENTS (bytes));
+  check_decrypt (pes_header, G_N_ELEMENTS (pes_header));
+}
+
+/* every chunk size up to two packets */
+static void
+test_chunk_sizes (void)
+{
+  gsize chunks[64];
+  guint i, size;
+
+  for (size = 1; size <= 2 * TS_PACKET_SIZE; size += 7) {
+    for (i = 0; i < G_N_ELEMENTS (chunks); i++)
+      chunks[i] = size;
+    check_decrypt (chunks, G_N_ELEMENTS (chunks));
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  gst_init (&argc, &argv);
+  g_test_init (&argc, &argv, NULL);
+
+  GST_DEBUG_CATEGORY_INIT (gst_hls_sample_aes_debug, "hlssampleaes", 0,
+      "HLS SAMPLE-AES decryption");
+
+  g_test_add_func ("/sample-aes/whole", test_whole);
+  g_test_add_func ("/sample-aes/split-packets", test_split_packets);
+  g_test_add_func ("/sample-aes/chunk-sizes", test_chunk_sizes);
+
+  return g_test_run ();
+}
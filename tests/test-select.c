@@ -0,0 +1,375 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * test-select.c: tracks deselected or unlinked, then selected or linked
+ * again
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <gst/gst.h>
+
+#include "http-server.h"
+
+static const gchar master_playlist[] =
+    "#EXTM3U\n"
+    "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aud\",NAME=\"en\",DEFAULT=YES,"
+    "URI=\"/audio-en.m3u8\"\n"
+    "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aud\",NAME=\"fr\",URI=\"/audio-fr.m3u8\"\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=800000,AUDIO=\"aud\"\n"
+    "/video.m3u8\n";
+
+static const gchar video_playlist[] =
+    "#EXTM3U\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=800000\n"
+    "/video.m3u8\n";
+
+typedef struct {
+  TestHttpServer *server;
+  GstElement *pipeline;
+  GstElement *demux;
+  GstStreamCollection *collection;
+  GstPad *pad;                  /* first pad exposed */
+  GstPad *sinkpad;
+
+  GMutex lock;
+  GCond cond;
+  GHashTable *buffers;          /* stream id -> number of buffers */
+} TestPlayback;
+
+static void
+handoff (GstElement * sink, GstBuffer * buffer, GstPad * pad,
+    TestPlayback * playback)
+{
+  gchar *stream_id;
+  guint count;
+
+  stream_id = gst_pad_get_stream_id (pad);
+  if (!stream_id)
+    return;
+
+  g_mutex_lock (&playback->lock);
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (playback->buffers,
+          stream_id));
+  g_hash_table_insert (playback->buffers, stream_id,
+      GUINT_TO_POINTER (count + 1));
+  g_cond_broadcast (&playback->cond);
+  g_mutex_unlock (&playback->lock);
+}
+
+static void
+pad_added (GstElement * demux, GstPad * pad, TestPlayback * playback)
+{
+  GstElement *sink;
+  GstPad *sinkpad;
+
+  sink = gst_element_factory_make ("fakesink", NULL);
+  g_object_set (sink, "async", FALSE, "sync", FALSE, "signal-handoffs", TRUE,
+      NULL);
+  g_signal_connect (sink, "handoff", G_CALLBACK (handoff), playback);
+  gst_bin_add (GST_BIN (playback->pipeline), sink);
+  gst_element_sync_state_with_parent (sink);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_link (pad, sinkpad);
+
+  g_mutex_lock (&playback->lock);
+  if (!playback->pad) {
+    playback->pad = gst_object_ref (pad);
+    playback->sinkpad = gst_object_ref (sinkpad);
+  }
+  g_mutex_unlock (&playback->lock);
+
+  gst_object_unref (sinkpad);
+}
+
+static guint
+get_buffers (TestPlayback * playback, const gchar * stream_id)
+{
+  guint count;
+
+  g_mutex_lock (&playback->lock);
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (playback->buffers,
+          stream_id));
+  g_mutex_unlock (&playback->lock);
+
+  return count;
+}
+
+static void
+wait_buffers (TestPlayback * playback, const gchar * stream_id, guint count)
+{
+  gint64 end_time;
+
+  end_time = g_get_monotonic_time () + 20 * G_USEC_PER_SEC;
+
+  g_mutex_lock (&playback->lock);
+  while (GPOINTER_TO_UINT (g_hash_table_lookup (playback->buffers,
+              stream_id)) < count) {
+    if (!g_cond_wait_until (&playback->cond, &playback->lock, end_time))
+      g_error ("no data received from stream %s", stream_id);
+  }
+  g_mutex_unlock (&playback->lock);
+}
+
+static void
+wait_requests (TestPlayback * playback, const gchar * path, guint count)
+{
+  gint64 end_time;
+
+  end_time = g_get_monotonic_time () + 20 * G_USEC_PER_SEC;
+
+  while (test_http_server_get_requests (playback->server, path) < count) {
+    if (g_get_monotonic_time () > end_time)
+      g_error ("%s not requested", path);
+    g_usleep (50 * 1000);
+  }
+}
+
+/* stream id of the rendition with that name, or of the video stream */
+static const gchar *
+get_stream_id (TestPlayback * playback, const gchar * name)
+{
+  guint i;
+
+  for (i = 0; i < gst_stream_collection_get_size (playback->collection); i++) {
+    GstStream *stream;
+    GstTagList *tags;
+    gchar *title = NULL;
+    gboolean match;
+
+    stream = gst_stream_collection_get_stream (playback->collection, i);
+
+    if (!name) {
+      if (gst_stream_get_stream_type (stream) == GST_STREAM_TYPE_VIDEO)
+        return gst_stream_get_stream_id (stream);
+      continue;
+    }
+
+    tags = gst_stream_get_tags (stream);
+    if (!tags)
+      continue;
+
+    gst_tag_list_get_string (tags, GST_TAG_TITLE, &title);
+    match = g_strcmp0 (title, name) == 0;
+    g_free (title);
+    gst_tag_list_unref (tags);
+
+    if (match)
+      return gst_stream_get_stream_id (stream);
+  }
+
+  g_error ("no stream %s", name ? name : "video");
+  return NULL;
+}
+
+static void
+select_audio (TestPlayback * playback, const gchar * name)
+{
+  GList *streams = NULL;
+
+  streams = g_list_append (streams, (gchar *) get_stream_id (playback, NULL));
+  streams = g_list_append (streams, (gchar *) get_stream_id (playback, name));
+
+  g_assert (gst_element_send_event (playback->demux,
+          gst_event_new_select_streams (streams)));
+
+  g_list_free (streams);
+}
+
+static void
+check_no_error (TestPlayback * playback)
+{
+  GstMessage *message;
+  GstBus *bus;
+
+  bus = gst_element_get_bus (playback->pipeline);
+  message = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+  gst_object_unref (bus);
+
+  if (message) {
+    GError *err;
+
+    gst_message_parse_error (message, &err, NULL);
+    g_error ("error from %s: %s", GST_MESSAGE_SRC_NAME (message),
+        err->message);
+  }
+}
+
+static void
+playback_init (TestPlayback * playback)
+{
+  playback->server = test_http_server_new ();
+  playback->pad = NULL;
+  playback->sinkpad = NULL;
+}
+
+static void
+playback_start (TestPlayback * playback, const gchar * playlist)
+{
+  GstMessage *message;
+  gchar *description;
+  GError *err = NULL;
+  GstBus *bus;
+
+  test_http_server_add (playback->server, "/master.m3u8", playlist);
+
+  description = g_strdup_printf ("souphttpsrc location=http://127.0.0.1:%u"
+      "/master.m3u8 ! pochlsdemux name=demux",
+      test_http_server_get_port (playback->server));
+  playback->pipeline = gst_parse_launch (description, &err);
+  g_free (description);
+  g_assert_no_error (err);
+
+  playback->demux = gst_bin_get_by_name (GST_BIN (playback->pipeline),
+      "demux");
+  g_object_set (playback->demux, "min-buffering-time", GST_SECOND, NULL);
+  g_signal_connect (playback->demux, "pad-added", G_CALLBACK (pad_added),
+      playback);
+
+  g_mutex_init (&playback->lock);
+  g_cond_init (&playback->cond);
+  playback->buffers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      NULL);
+
+  gst_element_set_state (playback->pipeline, GST_STATE_PLAYING);
+
+  bus = gst_element_get_bus (playback->pipeline);
+  message = gst_bus_timed_pop_filtered (bus, 10 * GST_SECOND,
+      GST_MESSAGE_STREAM_COLLECTION | GST_MESSAGE_ERROR);
+  gst_object_unref (bus);
+
+  g_assert (message != NULL);
+  g_assert_cmpint (GST_MESSAGE_TYPE (message), ==,
+      GST_MESSAGE_STREAM_COLLECTION);
+  gst_message_parse_stream_collection (message, &playback->collection);
+  gst_message_unref (message);
+}
+
+static void
+playback_stop (TestPlayback * playback)
+{
+  gst_element_set_state (playback->pipeline, GST_STATE_NULL);
+  gst_object_unref (playback->collection);
+  if (playback->pad) {
+    gst_object_unref (playback->pad);
+    gst_object_unref (playback->sinkpad);
+  }
+  gst_object_unref (playback->demux);
+  gst_object_unref (playback->pipeline);
+  test_http_server_free (playback->server);
+  g_hash_table_unref (playback->buffers);
+  g_mutex_clear (&playback->lock);
+  g_cond_clear (&playback->cond);
+}
+
+/* a rendition selected again reloads its playlist, which moved meanwhile,
+ * and resumes where the other tracks are */
+static void
+test_reselect_live (void)
+{
+  TestPlayback playback;
+  const gchar *en, *fr;
+  guint count, requests;
+
+  playback_init (&playback);
+  test_http_server_add_live (playback.server, "/video.m3u8", "/v", 2, 4);
+  test_http_server_add_live (playback.server, "/audio-en.m3u8", "/ae", 2, 4);
+  test_http_server_add_live (playback.server, "/audio-fr.m3u8", "/af", 2, 4);
+  playback_start (&playback, master_playlist);
+
+  en = get_stream_id (&playback, "en");
+  fr = get_stream_id (&playback, "fr");
+
+  wait_buffers (&playback, en, 1);
+
+  select_audio (&playback, "fr");
+  wait_buffers (&playback, fr, 1);
+
+  /* let the live window slide */
+  g_usleep (3 * G_USEC_PER_SEC);
+
+  count = get_buffers (&playback, en);
+  requests = test_http_server_get_requests (playback.server,
+      "/audio-en.m3u8");
+
+  select_audio (&playback, "en");
+  wait_buffers (&playback, en, count + 1);
+
+  g_assert_cmpuint (test_http_server_get_requests (playback.server,
+          "/audio-en.m3u8"), >, requests);
+  check_no_error (&playback);
+
+  /* and once more, the downloads cancelled by the previous deselection do
+   * not fail the next ones */
+  select_audio (&playback, "fr");
+  count = get_buffers (&playback, fr);
+  wait_buffers (&playback, fr, count + 1);
+  check_no_error (&playback);
+
+  playback_stop (&playback);
+}
+
+/* the only track of a VOD stream, unlinked long enough for its downloads to
+ * be suspended, resumes where it stopped once linked again */
+static void
+test_relink_vod (void)
+{
+  TestPlayback playback;
+  const gchar *video;
+  guint count;
+
+  playback_init (&playback);
+  test_http_server_add_vod (playback.server, "/video.m3u8", "/v", 2, 30);
+  test_http_server_set_latency (playback.server, 200);
+  playback_start (&playback, video_playlist);
+
+  video = get_stream_id (&playback, NULL);
+
+  wait_requests (&playback, "/v2.ts", 1);
+  g_assert (gst_pad_unlink (playback.pad, playback.sinkpad));
+
+  /* data keeps being pushed unlinked until the downloads are suspended */
+  g_usleep (4 * G_USEC_PER_SEC);
+
+  count = get_buffers (&playback, video);
+  g_assert_cmpint (gst_pad_link (playback.pad, playback.sinkpad), ==,
+      GST_PAD_LINK_OK);
+  wait_buffers (&playback, video, count + 1);
+
+  g_assert_cmpuint (test_http_server_get_requests (playback.server,
+          "/v0.ts"), ==, 1);
+  check_no_error (&playback);
+
+  playback_stop (&playback);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *err = NULL;
+
+  gst_init (&argc, &argv);
+  g_test_init (&argc, &argv, NULL);
+
+  if (!gst_plugin_load_file (PLUGIN_PATH, &err))
+    g_error ("failed to load plugin: %s", err->message);
+
+  g_test_add_func ("/select/reselect-live", test_reselect_live);
+  g_test_add_func ("/select/relink-vod", test_relink_vod);
+
+  return g_test_run ();
+}
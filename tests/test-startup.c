@@ -0,0 +1,213 @@
+/* GStreamer
+ * Copyright (C) 2013 Arnaud Vrac <avrac@freebox.fr>
+ *
+ * test-startup.c: media playlist fetched while the master playlist is
+ * parsed
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <gst/gst.h>
+
+#include "http-server.h"
+
+static const gchar master_playlist[] =
+    "#EXTM3U\n"
+    "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"aud\",NAME=\"en\",DEFAULT=YES,"
+    "URI=\"/audio.m3u8\"\n"
+    "#EXT-X-STREAM-INF:BANDWIDTH=800000,AUDIO=\"aud\"\n"
+    "/video.m3u8\n";
+
+typedef struct {
+  TestHttpServer *server;
+  GstElement *pipeline;
+  GstElement *demux;
+
+  GMutex lock;
+  GCond cond;
+  guint buffers;
+} TestPlayback;
+
+static void
+handoff (GstElement * sink, GstBuffer * buffer, GstPad * pad,
+    TestPlayback * playback)
+{
+  g_mutex_lock (&playback->lock);
+  playback->buffers++;
+  g_cond_broadcast (&playback->cond);
+  g_mutex_unlock (&playback->lock);
+}
+
+static void
+pad_added (GstElement * demux, GstPad * pad, TestPlayback * playback)
+{
+  GstElement *sink;
+  GstPad *sinkpad;
+
+  sink = gst_element_factory_make ("fakesink", NULL);
+  g_object_set (sink, "async", FALSE, "sync", FALSE, "signal-handoffs", TRUE,
+      NULL);
+  g_signal_connect (sink, "handoff", G_CALLBACK (handoff), playback);
+  gst_bin_add (GST_BIN (playback->pipeline), sink);
+  gst_element_sync_state_with_parent (sink);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+}
+
+static void
+playback_init (TestPlayback * playback)
+{
+  gchar *description;
+  GError *err = NULL;
+
+  playback->server = test_http_server_new ();
+  test_http_server_add (playback->server, "/master.m3u8", master_playlist);
+  test_http_server_add_vod (playback->server, "/video.m3u8", "/v", 2, 5);
+  test_http_server_add_vod (playback->server, "/audio.m3u8", "/a", 2, 5);
+
+  description = g_strdup_printf ("souphttpsrc location=http://127.0.0.1:%u"
+      "/master.m3u8 ! pochlsdemux name=demux",
+      test_http_server_get_port (playback->server));
+  playback->pipeline = gst_parse_launch (description, &err);
+  g_free (description);
+  g_assert_no_error (err);
+
+  playback->demux = gst_bin_get_by_name (GST_BIN (playback->pipeline),
+      "demux");
+  g_signal_connect (playback->demux, "pad-added", G_CALLBACK (pad_added),
+      playback);
+
+  g_mutex_init (&playback->lock);
+  g_cond_init (&playback->cond);
+  playback->buffers = 0;
+}
+
+static void
+playback_clear (TestPlayback * playback)
+{
+  gst_element_set_state (playback->pipeline, GST_STATE_NULL);
+  gst_object_unref (playback->demux);
+  gst_object_unref (playback->pipeline);
+  test_http_server_free (playback->server);
+  g_mutex_clear (&playback->lock);
+  g_cond_clear (&playback->cond);
+}
+
+static GstStreamCollection *
+wait_collection (TestPlayback * playback)
+{
+  GstStreamCollection *collection;
+  GstMessage *message;
+  GstBus *bus;
+
+  bus = gst_element_get_bus (playback->pipeline);
+  message = gst_bus_timed_pop_filtered (bus, 10 * GST_SECOND,
+      GST_MESSAGE_STREAM_COLLECTION | GST_MESSAGE_ERROR);
+  gst_object_unref (bus);
+
+  g_assert (message != NULL);
+  g_assert_cmpint (GST_MESSAGE_TYPE (message), ==,
+      GST_MESSAGE_STREAM_COLLECTION);
+
+  gst_message_parse_stream_collection (message, &collection);
+  gst_message_unref (message);
+
+  return collection;
+}
+
+/* the media playlist is fetched once, by the early fetch started from the
+ * first lines of the master playlist, and used by the track */
+static void
+test_early_fetch (void)
+{
+  TestPlayback playback;
+  gint64 end_time;
+
+  playback_init (&playback);
+  test_http_server_set_latency (playback.server, 200);
+
+  gst_element_set_state (playback.pipeline, GST_STATE_PLAYING);
+
+  end_time = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  g_mutex_lock (&playback.lock);
+  while (playback.buffers == 0)
+    g_assert (g_cond_wait_until (&playback.cond, &playback.lock, end_time));
+  g_mutex_unlock (&playback.lock);
+
+  g_assert_cmpuint (test_http_server_get_requests (playback.server,
+          "/video.m3u8"), ==, 1);
+
+  playback_clear (&playback);
+}
+
+/* deselecting the track while it waits for the early fetch of its playlist
+ * does not wait for the fetch to complete */
+static void
+test_deselect_during_early_fetch (void)
+{
+  TestPlayback playback;
+  GstStreamCollection *collection;
+  GList *streams = NULL;
+  gint64 start;
+  guint i;
+
+  playback_init (&playback);
+  test_http_server_set_delay (playback.server, "/video.m3u8", 10000);
+
+  gst_element_set_state (playback.pipeline, GST_STATE_PLAYING);
+
+  collection = wait_collection (&playback);
+  for (i = 0; i < gst_stream_collection_get_size (collection); i++) {
+    GstStream *stream = gst_stream_collection_get_stream (collection, i);
+
+    if (gst_stream_get_stream_type (stream) == GST_STREAM_TYPE_AUDIO)
+      streams = g_list_append (streams,
+          (gchar *) gst_stream_get_stream_id (stream));
+  }
+  g_assert_cmpuint (g_list_length (streams), ==, 1);
+
+  start = g_get_monotonic_time ();
+  g_assert (gst_element_send_event (playback.demux,
+          gst_event_new_select_streams (streams)));
+  g_assert_cmpint (g_get_monotonic_time () - start, <, 2 * G_USEC_PER_SEC);
+
+  g_list_free (streams);
+  gst_object_unref (collection);
+
+  start = g_get_monotonic_time ();
+  playback_clear (&playback);
+  g_assert_cmpint (g_get_monotonic_time () - start, <, 2 * G_USEC_PER_SEC);
+}
+
+int
+main (int argc, char **argv)
+{
+  GError *err = NULL;
+
+  gst_init (&argc, &argv);
+  g_test_init (&argc, &argv, NULL);
+
+  if (!gst_plugin_load_file (PLUGIN_PATH, &err))
+    g_error ("failed to load plugin: %s", err->message);
+
+  g_test_add_func ("/startup/early-fetch", test_early_fetch);
+  g_test_add_func ("/startup/deselect-during-early-fetch",
+      test_deselect_during_early_fetch);
+
+  return g_test_run ();
+}